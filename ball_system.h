@@ -0,0 +1,1027 @@
+#pragma once
+
+#include "job_scheduler.h"
+#include "morton_order.h"
+#include "spatial_grid.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BALL_SYSTEM_X86
+#endif
+
+#define BALL_SYSTEM_ALIGNMENT 64
+// Balls per scheduler chunk: 4096 balls touch 128 KiB of state and instance
+// data, which keeps each chunk resident in a typical per-core L2.
+#define BALL_SYSTEM_CHUNK_SIZE 4096
+// Streaming kernels (integrate, interpolate, copies) cost a few ns per
+// ball, so below this many balls per worker waking workers costs more than
+// it saves and the range runs inline.
+#define BALL_SYSTEM_MIN_PER_WORKER 16384
+// Cells with contacts per chunk when resolving contacts.
+#define BALL_SYSTEM_RESOLVE_CHUNK 256
+// A ball falls asleep after this many consecutive steps with its speed and
+// its displacement per step below the sleep speed.
+#define BALL_SLEEP_STEPS 60
+#define DEFAULT_SLEEP_SPEED 0.05f
+// Dirty instances separated by fewer clean ones than this are reported as
+// one range; a copy region costs more than a few hundred bytes of slack.
+#define DIRTY_RANGE_MERGE_GAP 64
+
+template <typename T> struct AlignedAllocator {
+  using value_type = T;
+  AlignedAllocator() = default;
+  template <typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+  T *allocate(size_t count) {
+    size_t bytes = (count * sizeof(T) + BALL_SYSTEM_ALIGNMENT - 1) &
+                   ~size_t(BALL_SYSTEM_ALIGNMENT - 1);
+    void *ptr = std::aligned_alloc(BALL_SYSTEM_ALIGNMENT, bytes);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  };
+  void deallocate(T *ptr, size_t) { std::free(ptr); };
+  template <typename U> bool operator==(const AlignedAllocator<U> &) const {
+    return true;
+  };
+  template <typename U> bool operator!=(const AlignedAllocator<U> &) const {
+    return false;
+  };
+};
+
+template <typename T> using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+enum class SimdLevel { eScalar, eSse, eAvx2 };
+
+inline const char *simdLevelName(SimdLevel level) {
+  switch (level) {
+  case SimdLevel::eAvx2:
+    return "avx2";
+  case SimdLevel::eSse:
+    return "sse";
+  default:
+    return "scalar";
+  }
+}
+
+// Pointers into the SoA arrays handed to the integration kernels. All
+// kernels must produce bit-identical results so the dispatch level never
+// changes the simulation.
+struct BallArrays {
+  float *x;
+  float *y;
+  float *radius;
+  float *vx;
+  float *vy;
+  float *instanceData;
+  float *previousX;
+  float *previousY;
+};
+
+// Instances [first, first + count).
+struct InstanceRange {
+  uint32_t first;
+  uint32_t count;
+};
+
+// Sorts ranges and merges those that overlap or are less than gap
+// instances apart.
+inline void coalesceRanges(std::vector<InstanceRange> &ranges, uint32_t gap) {
+  if (ranges.empty()) {
+    return;
+  }
+  std::sort(ranges.begin(), ranges.end(),
+            [](const InstanceRange &a, const InstanceRange &b) {
+              return a.first < b.first;
+            });
+  size_t merged = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    InstanceRange &last = ranges[merged];
+    uint32_t lastEnd = last.first + last.count;
+    if (ranges[i].first <= lastEnd + gap) {
+      last.count =
+          std::max(lastEnd, ranges[i].first + ranges[i].count) - last.first;
+    } else {
+      ranges[++merged] = ranges[i];
+    }
+  }
+  ranges.resize(merged + 1);
+}
+
+struct BroadphaseStats {
+  uint64_t pairsTested;
+  uint64_t pairsColliding;
+  // Sum of j - i over colliding pairs (i, j); per pair it measures how far
+  // apart in memory touching balls are stored.
+  uint64_t pairIndexDistance;
+  uint32_t gridDim;
+  bool rebuilt;
+};
+
+// Read-only view of everything needed to resume a run bit-exactly, in slot
+// order: ids[slot] is the id of the ball stored in slot.
+struct BallStateView {
+  uint32_t count;
+  uint64_t stepCount;
+  const float *x;
+  const float *y;
+  const float *radius;
+  const float *vx;
+  const float *vy;
+  const uint32_t *ids;
+  const uint8_t *asleep;
+  const uint16_t *restSteps;
+};
+
+// Owning copy of a BallStateView, e.g. a checkpoint on its way to disk.
+struct BallState {
+  uint64_t stepCount = 0;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> radius;
+  std::vector<float> vx;
+  std::vector<float> vy;
+  std::vector<uint32_t> ids;
+  std::vector<uint8_t> asleep;
+  std::vector<uint16_t> restSteps;
+  BallStateView view() const {
+    return BallStateView{uint32_t(x.size()), stepCount,    x.data(),
+                         y.data(),           radius.data(), vx.data(),
+                         vy.data(),          ids.data(),    asleep.data(),
+                         restSteps.data()};
+  };
+};
+
+struct ReorderStats {
+  uint64_t reorders;
+  double lastMilliseconds;
+  double totalMilliseconds;
+};
+
+#ifdef BALL_SYSTEM_X86
+// Packs four x/y/radius lanes into the interleaved vec3 instance layout.
+inline void storeInstances4(float *out, __m128 x, __m128 y, __m128 r) {
+  __m128 xy = _mm_unpacklo_ps(x, y);
+  __m128 xyHigh = _mm_unpackhi_ps(x, y);
+  __m128 a = _mm_shuffle_ps(r, x, _MM_SHUFFLE(1, 1, 0, 0));
+  __m128 b = _mm_shuffle_ps(y, r, _MM_SHUFFLE(1, 1, 1, 1));
+  __m128 c = _mm_shuffle_ps(r, x, _MM_SHUFFLE(3, 3, 2, 2));
+  __m128 d = _mm_shuffle_ps(y, r, _MM_SHUFFLE(3, 3, 3, 3));
+  _mm_storeu_ps(out, _mm_shuffle_ps(xy, a, _MM_SHUFFLE(2, 0, 1, 0)));
+  _mm_storeu_ps(out + 4, _mm_shuffle_ps(b, xyHigh, _MM_SHUFFLE(1, 0, 2, 0)));
+  _mm_storeu_ps(out + 8, _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
+
+class BallSystem {
+private:
+  const float GRAVITY = 0.5;
+  AlignedVector<float> m_x;
+  AlignedVector<float> m_y;
+  AlignedVector<float> m_radius;
+  AlignedVector<float> m_vx;
+  AlignedVector<float> m_vy;
+  AlignedVector<float> m_instanceData;
+  AlignedVector<float> m_previousX;
+  AlignedVector<float> m_previousY;
+  // Sleeping balls are skipped by integration and only move when an awake
+  // ball hits them hard enough to wake them. m_touched marks balls that
+  // fell asleep since the last takeDirtyRanges().
+  std::vector<uint8_t> m_asleep;
+  std::vector<uint8_t> m_touched;
+  std::vector<uint16_t> m_restSteps;
+  uint32_t m_sleepingCount = 0;
+  bool m_sleepEnabled = false;
+  float m_sleepSpeed = DEFAULT_SLEEP_SPEED;
+  float m_restitution = 1.0f;
+  // Fraction of velocity lost per second.
+  float m_damping = 0.0f;
+  AlignedVector<float> m_interpolatedData;
+  uint64_t m_stepCount = 0;
+  SimdLevel m_simdLevel;
+  float m_maxRadius = 0.0f;
+  bool m_collisions = false;
+  SpatialGrid m_grid;
+  // Pairs found by one cell within one chunk of sorted grid positions:
+  // m_chunkPairs[chunk][pairBegin..pairEnd].
+  struct PairRun {
+    uint32_t cell;
+    uint32_t chunk;
+    uint32_t pairBegin;
+    uint32_t pairEnd;
+  };
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> m_chunkPairs;
+  std::vector<uint64_t> m_chunkPairsTested;
+  std::vector<uint64_t> m_chunkPairDistance;
+  // Indexed by chunk * SPATIAL_GRID_PHASES + phase.
+  std::vector<std::vector<PairRun>> m_chunkPairRuns;
+  // Runs of every chunk grouped by phase, in sorted grid order.
+  std::vector<PairRun> m_phaseRuns;
+  uint32_t m_phaseRunStart[SPATIAL_GRID_PHASES + 1] = {};
+  BroadphaseStats m_broadphaseStats{};
+  // m_ids[slot] is the stable id of the ball stored in slot and m_slots is
+  // its inverse. reorder() moves balls between slots; ids never change.
+  std::vector<uint32_t> m_ids;
+  std::vector<uint32_t> m_slots;
+  uint32_t m_reorderInterval = 0;
+  // Every instance moved since the last takeDirtyRanges().
+  bool m_reordered = false;
+  RadixSorter m_sorter;
+  std::vector<uint32_t> m_sortKeys;
+  std::vector<uint32_t> m_order;
+  AlignedVector<float> m_floatScratch;
+  std::vector<uint8_t> m_byteScratch;
+  std::vector<uint16_t> m_restStepScratch;
+  std::vector<uint32_t> m_idScratch;
+  ReorderStats m_reorderStats{};
+  static void integrateScalar(const BallArrays &balls, uint32_t begin,
+                              uint32_t end, float dt, float dvy,
+                              float restitution, float damping) {
+    for (uint32_t i = begin; i < end; i++) {
+      float r = balls.radius[i];
+      float vx = balls.vx[i] * damping;
+      float vy = balls.vy[i] * damping;
+      balls.previousX[i] = balls.x[i];
+      balls.previousY[i] = balls.y[i];
+      float x = balls.x[i] + vx * dt;
+      float y = balls.y[i] - vy * dt;
+      vy = vy - dvy;
+      if (x + r > 1.0f) {
+        vx = -vx * restitution;
+        x = 1.0f - r;
+      }
+      if (x - r < -1.0f) {
+        vx = -vx * restitution;
+        x = -1.0f + r;
+      }
+      if (y + r > 1.0f) {
+        vy = -vy * restitution;
+        y = 1.0f - r;
+      }
+      if (y - r < -1.0f) {
+        vy = -vy * restitution;
+        y = -1.0f + r;
+      }
+      balls.x[i] = x;
+      balls.y[i] = y;
+      balls.vx[i] = vx;
+      balls.vy[i] = vy;
+      balls.instanceData[3 * i] = x;
+      balls.instanceData[3 * i + 1] = y;
+      balls.instanceData[3 * i + 2] = r;
+    }
+  };
+#ifdef BALL_SYSTEM_X86
+  static void integrateSse(const BallArrays &balls, uint32_t begin,
+                           uint32_t end, float dt, float dvy,
+                           float restitution, float damping) {
+    const __m128 vdt = _mm_set1_ps(dt);
+    const __m128 ve = _mm_set1_ps(restitution);
+    const __m128 vdamping = _mm_set1_ps(damping);
+    const __m128 vdvy = _mm_set1_ps(dvy);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 negOne = _mm_set1_ps(-1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+      __m128 r = _mm_loadu_ps(balls.radius + i);
+      __m128 vx = _mm_mul_ps(_mm_loadu_ps(balls.vx + i), vdamping);
+      __m128 vy = _mm_mul_ps(_mm_loadu_ps(balls.vy + i), vdamping);
+      __m128 x = _mm_loadu_ps(balls.x + i);
+      __m128 y = _mm_loadu_ps(balls.y + i);
+      _mm_storeu_ps(balls.previousX + i, x);
+      _mm_storeu_ps(balls.previousY + i, y);
+      x = _mm_add_ps(x, _mm_mul_ps(vx, vdt));
+      y = _mm_sub_ps(y, _mm_mul_ps(vy, vdt));
+      vy = _mm_sub_ps(vy, vdvy);
+      __m128 mask = _mm_cmpgt_ps(_mm_add_ps(x, r), one);
+      vx = _mm_mul_ps(_mm_xor_ps(vx, _mm_and_ps(mask, sign)),
+                      select4(mask, ve, one));
+      x = select4(mask, _mm_sub_ps(one, r), x);
+      mask = _mm_cmplt_ps(_mm_sub_ps(x, r), negOne);
+      vx = _mm_mul_ps(_mm_xor_ps(vx, _mm_and_ps(mask, sign)),
+                      select4(mask, ve, one));
+      x = select4(mask, _mm_add_ps(negOne, r), x);
+      mask = _mm_cmpgt_ps(_mm_add_ps(y, r), one);
+      vy = _mm_mul_ps(_mm_xor_ps(vy, _mm_and_ps(mask, sign)),
+                      select4(mask, ve, one));
+      y = select4(mask, _mm_sub_ps(one, r), y);
+      mask = _mm_cmplt_ps(_mm_sub_ps(y, r), negOne);
+      vy = _mm_mul_ps(_mm_xor_ps(vy, _mm_and_ps(mask, sign)),
+                      select4(mask, ve, one));
+      y = select4(mask, _mm_add_ps(negOne, r), y);
+      _mm_storeu_ps(balls.x + i, x);
+      _mm_storeu_ps(balls.y + i, y);
+      _mm_storeu_ps(balls.vx + i, vx);
+      _mm_storeu_ps(balls.vy + i, vy);
+      storeInstances4(balls.instanceData + 3 * i, x, y, r);
+    }
+    integrateScalar(balls, i, end, dt, dvy, restitution, damping);
+  };
+  __attribute__((target("avx2"))) static void
+  integrateAvx2(const BallArrays &balls, uint32_t begin, uint32_t end,
+                float dt, float dvy, float restitution, float damping) {
+    const __m256 vdt = _mm256_set1_ps(dt);
+    const __m256 ve = _mm256_set1_ps(restitution);
+    const __m256 vdamping = _mm256_set1_ps(damping);
+    const __m256 vdvy = _mm256_set1_ps(dvy);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 negOne = _mm256_set1_ps(-1.0f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+      __m256 r = _mm256_loadu_ps(balls.radius + i);
+      __m256 vx = _mm256_mul_ps(_mm256_loadu_ps(balls.vx + i), vdamping);
+      __m256 vy = _mm256_mul_ps(_mm256_loadu_ps(balls.vy + i), vdamping);
+      __m256 x = _mm256_loadu_ps(balls.x + i);
+      __m256 y = _mm256_loadu_ps(balls.y + i);
+      _mm256_storeu_ps(balls.previousX + i, x);
+      _mm256_storeu_ps(balls.previousY + i, y);
+      x = _mm256_add_ps(x, _mm256_mul_ps(vx, vdt));
+      y = _mm256_sub_ps(y, _mm256_mul_ps(vy, vdt));
+      vy = _mm256_sub_ps(vy, vdvy);
+      __m256 mask = _mm256_cmp_ps(_mm256_add_ps(x, r), one, _CMP_GT_OQ);
+      vx = _mm256_mul_ps(_mm256_xor_ps(vx, _mm256_and_ps(mask, sign)),
+                         _mm256_blendv_ps(one, ve, mask));
+      x = _mm256_blendv_ps(x, _mm256_sub_ps(one, r), mask);
+      mask = _mm256_cmp_ps(_mm256_sub_ps(x, r), negOne, _CMP_LT_OQ);
+      vx = _mm256_mul_ps(_mm256_xor_ps(vx, _mm256_and_ps(mask, sign)),
+                         _mm256_blendv_ps(one, ve, mask));
+      x = _mm256_blendv_ps(x, _mm256_add_ps(negOne, r), mask);
+      mask = _mm256_cmp_ps(_mm256_add_ps(y, r), one, _CMP_GT_OQ);
+      vy = _mm256_mul_ps(_mm256_xor_ps(vy, _mm256_and_ps(mask, sign)),
+                         _mm256_blendv_ps(one, ve, mask));
+      y = _mm256_blendv_ps(y, _mm256_sub_ps(one, r), mask);
+      mask = _mm256_cmp_ps(_mm256_sub_ps(y, r), negOne, _CMP_LT_OQ);
+      vy = _mm256_mul_ps(_mm256_xor_ps(vy, _mm256_and_ps(mask, sign)),
+                         _mm256_blendv_ps(one, ve, mask));
+      y = _mm256_blendv_ps(y, _mm256_add_ps(negOne, r), mask);
+      _mm256_storeu_ps(balls.x + i, x);
+      _mm256_storeu_ps(balls.y + i, y);
+      _mm256_storeu_ps(balls.vx + i, vx);
+      _mm256_storeu_ps(balls.vy + i, vy);
+      storeInstances4(balls.instanceData + 3 * i, _mm256_castps256_ps128(x),
+                      _mm256_castps256_ps128(y), _mm256_castps256_ps128(r));
+      storeInstances4(balls.instanceData + 3 * i + 12,
+                      _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1),
+                      _mm256_extractf128_ps(r, 1));
+    }
+    integrateScalar(balls, i, end, dt, dvy, restitution, damping);
+  };
+#endif
+  // Elastic response between two overlapping balls with mass proportional
+  // to area. vy points up while y points down, hence the flipped signs.
+  // Only touches balls i and j; woken counts sleepers it wakes, so pairs
+  // of disjoint balls can be resolved concurrently.
+  void resolvePair(uint32_t i, uint32_t j, uint32_t &woken) {
+    float dx = m_x[j] - m_x[i];
+    float dy = m_y[j] - m_y[i];
+    float minDistance = m_radius[i] + m_radius[j];
+    float distanceSquared = dx * dx + dy * dy;
+    if (distanceSquared >= minDistance * minDistance) {
+      return;
+    }
+    float distance = std::sqrt(distanceSquared);
+    float nx = 1.0f;
+    float ny = 0.0f;
+    if (distance > 0.0f) {
+      nx = dx / distance;
+      ny = dy / distance;
+    }
+    float approach =
+        (m_vx[i] - m_vx[j]) * nx - (m_vy[i] - m_vy[j]) * ny;
+    if (m_asleep[i] != m_asleep[j]) {
+      uint32_t sleeper = m_asleep[i] ? i : j;
+      if (approach <= m_sleepSpeed) {
+        // A gentle touch: the sleeper acts as a static obstacle.
+        float side = sleeper == j ? -1.0f : 1.0f;
+        uint32_t k = sleeper == j ? i : j;
+        float overlap = minDistance - distance;
+        m_x[k] += side * nx * overlap;
+        m_y[k] += side * ny * overlap;
+        if (approach > 0.0f) {
+          float impulse = (1.0f + m_restitution) * approach;
+          m_vx[k] += side * impulse * nx;
+          m_vy[k] -= side * impulse * ny;
+        }
+        clampToWalls(k);
+        return;
+      }
+      m_asleep[sleeper] = 0;
+      m_restSteps[sleeper] = 0;
+      woken++;
+    }
+    float mi = m_radius[i] * m_radius[i];
+    float mj = m_radius[j] * m_radius[j];
+    float inverseMass = 1.0f / (mi + mj);
+    float overlap = minDistance - distance;
+    m_x[i] -= nx * overlap * mj * inverseMass;
+    m_y[i] -= ny * overlap * mj * inverseMass;
+    m_x[j] += nx * overlap * mi * inverseMass;
+    m_y[j] += ny * overlap * mi * inverseMass;
+    if (approach > 0.0f) {
+      float impulseI = (1.0f + m_restitution) * mj * inverseMass * approach;
+      float impulseJ = (1.0f + m_restitution) * mi * inverseMass * approach;
+      m_vx[i] -= impulseI * nx;
+      m_vy[i] += impulseI * ny;
+      m_vx[j] += impulseJ * nx;
+      m_vy[j] -= impulseJ * ny;
+    }
+    clampToWalls(i);
+    clampToWalls(j);
+  };
+  void clampToWalls(uint32_t k) {
+    m_x[k] = std::min(std::max(m_x[k], -1.0f + m_radius[k]),
+                      1.0f - m_radius[k]);
+    m_y[k] = std::min(std::max(m_y[k], -1.0f + m_radius[k]),
+                      1.0f - m_radius[k]);
+    m_instanceData[3 * k] = m_x[k];
+    m_instanceData[3 * k + 1] = m_y[k];
+  };
+  void wake(uint32_t i) {
+    if (m_asleep[i]) {
+      m_asleep[i] = 0;
+      m_sleepingCount--;
+    }
+    m_restSteps[i] = 0;
+  };
+  // Counts steps at rest and puts balls to sleep. Runs after collisions so
+  // pushes from neighbours count as movement.
+  void updateSleep(float dt, JobScheduler *scheduler) {
+    std::atomic<uint32_t> fellAsleep{0};
+    float speedSquared = m_sleepSpeed * m_sleepSpeed;
+    float stepSquared = speedSquared * dt * dt;
+    auto update = [&](uint32_t begin, uint32_t end, uint32_t) {
+      uint32_t count = 0;
+      for (uint32_t i = begin; i < end; i++) {
+        if (m_asleep[i]) {
+          continue;
+        }
+        float dx = m_x[i] - m_previousX[i];
+        float dy = m_y[i] - m_previousY[i];
+        float speed = m_vx[i] * m_vx[i] + m_vy[i] * m_vy[i];
+        if (speed >= speedSquared || dx * dx + dy * dy >= stepSquared) {
+          m_restSteps[i] = 0;
+          continue;
+        }
+        if (++m_restSteps[i] < BALL_SLEEP_STEPS) {
+          continue;
+        }
+        m_asleep[i] = 1;
+        m_touched[i] = 1;
+        m_vx[i] = 0.0f;
+        m_vy[i] = 0.0f;
+        m_previousX[i] = m_x[i];
+        m_previousY[i] = m_y[i];
+        count++;
+      }
+      fellAsleep.fetch_add(count, std::memory_order_relaxed);
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(size(), BALL_SYSTEM_CHUNK_SIZE, update,
+                            BALL_SYSTEM_MIN_PER_WORKER);
+    } else {
+      update(0, size(), 0);
+    }
+    m_sleepingCount += fellAsleep.load();
+  };
+  // Finds overlapping pairs in parallel, one pair list per chunk of sorted
+  // grid positions, so each cell's pairs are contiguous. Cells that found
+  // pairs are then resolved in the grid's nine phases: the cells of a phase
+  // have disjoint neighbourhoods, so their pairs touch disjoint balls and
+  // run in parallel, while pairs within a cell keep their serial order.
+  // The outcome therefore does not depend on the thread count or
+  // scheduling.
+  void collide(JobScheduler *scheduler) {
+    uint32_t count = size();
+    m_grid.configure(m_maxRadius);
+    m_broadphaseStats.rebuilt = m_grid.build(
+        m_x.data(), m_y.data(), count, scheduler, BALL_SYSTEM_CHUNK_SIZE);
+    uint32_t chunkCount =
+        (count + BALL_SYSTEM_CHUNK_SIZE - 1) / BALL_SYSTEM_CHUNK_SIZE;
+    m_chunkPairs.resize(chunkCount);
+    m_chunkPairsTested.assign(chunkCount, 0);
+    m_chunkPairDistance.assign(chunkCount, 0);
+    m_chunkPairRuns.resize(size_t(chunkCount) * SPATIAL_GRID_PHASES);
+    auto findPairs = [&](uint32_t begin, uint32_t end, uint32_t) {
+      for (uint32_t chunkBegin = begin; chunkBegin < end;
+           chunkBegin += BALL_SYSTEM_CHUNK_SIZE) {
+        uint32_t chunk = chunkBegin / BALL_SYSTEM_CHUNK_SIZE;
+        uint32_t chunkEnd = std::min(chunkBegin + BALL_SYSTEM_CHUNK_SIZE, end);
+        auto &pairs = m_chunkPairs[chunk];
+        auto *runs = &m_chunkPairRuns[size_t(chunk) * SPATIAL_GRID_PHASES];
+        uint64_t tested = 0;
+        uint64_t distance = 0;
+        pairs.clear();
+        for (uint32_t phase = 0; phase < SPATIAL_GRID_PHASES; phase++) {
+          runs[phase].clear();
+        }
+        auto closeRun = [&](uint32_t cell, uint32_t pairBegin) {
+          if (pairs.size() > pairBegin) {
+            runs[m_grid.phaseOf(cell)].push_back(
+                {cell, chunk, pairBegin, uint32_t(pairs.size())});
+          }
+        };
+        uint32_t runCell = m_grid.sortedCell(chunkBegin);
+        uint32_t runBegin = 0;
+        for (uint32_t k = chunkBegin; k < chunkEnd; k++) {
+          if (m_grid.sortedCell(k) != runCell) {
+            closeRun(runCell, runBegin);
+            runCell = m_grid.sortedCell(k);
+            runBegin = pairs.size();
+          }
+          uint32_t i = m_grid.sortedBall(k);
+          float xi = m_x[i];
+          float yi = m_y[i];
+          float ri = m_radius[i];
+          m_grid.forEachNeighbour(i, [&](uint32_t j) {
+            if (j <= i) {
+              return;
+            }
+            tested++;
+            if (m_asleep[i] && m_asleep[j]) {
+              return;
+            }
+            float dx = m_x[j] - xi;
+            float dy = m_y[j] - yi;
+            float minDistance = ri + m_radius[j];
+            if (dx * dx + dy * dy < minDistance * minDistance) {
+              pairs.emplace_back(i, j);
+              distance += j - i;
+            }
+          });
+        }
+        closeRun(runCell, runBegin);
+        m_chunkPairsTested[chunk] = tested;
+        m_chunkPairDistance[chunk] = distance;
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(count, BALL_SYSTEM_CHUNK_SIZE, findPairs);
+    } else {
+      findPairs(0, count, 0);
+    }
+    m_broadphaseStats.pairsTested = 0;
+    m_broadphaseStats.pairsColliding = 0;
+    m_broadphaseStats.pairIndexDistance = 0;
+    m_broadphaseStats.gridDim = m_grid.dim();
+    for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+      m_broadphaseStats.pairsTested += m_chunkPairsTested[chunk];
+      m_broadphaseStats.pairsColliding += m_chunkPairs[chunk].size();
+      m_broadphaseStats.pairIndexDistance += m_chunkPairDistance[chunk];
+    }
+    if (m_broadphaseStats.pairsColliding == 0) {
+      return;
+    }
+    m_phaseRuns.clear();
+    for (uint32_t phase = 0; phase < SPATIAL_GRID_PHASES; phase++) {
+      m_phaseRunStart[phase] = m_phaseRuns.size();
+      for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+        const auto &runs =
+            m_chunkPairRuns[size_t(chunk) * SPATIAL_GRID_PHASES + phase];
+        m_phaseRuns.insert(m_phaseRuns.end(), runs.begin(), runs.end());
+      }
+    }
+    m_phaseRunStart[SPATIAL_GRID_PHASES] = m_phaseRuns.size();
+    // A cell split across two chunks has consecutive runs; the range
+    // holding its first run resolves all of them.
+    std::atomic<uint32_t> woken{0};
+    for (uint32_t phase = 0; phase < SPATIAL_GRID_PHASES; phase++) {
+      const PairRun *runs = m_phaseRuns.data() + m_phaseRunStart[phase];
+      uint32_t runCount = m_phaseRunStart[phase + 1] - m_phaseRunStart[phase];
+      auto resolveRuns = [&](uint32_t begin, uint32_t end, uint32_t) {
+        while (begin > 0 && begin < end &&
+               runs[begin].cell == runs[begin - 1].cell) {
+          begin++;
+        }
+        if (begin == end) {
+          return;
+        }
+        while (end < runCount && runs[end].cell == runs[end - 1].cell) {
+          end++;
+        }
+        uint32_t localWoken = 0;
+        for (uint32_t r = begin; r < end; r++) {
+          const auto &pairs = m_chunkPairs[runs[r].chunk];
+          for (uint32_t p = runs[r].pairBegin; p < runs[r].pairEnd; p++) {
+            resolvePair(pairs[p].first, pairs[p].second, localWoken);
+          }
+        }
+        woken.fetch_add(localWoken, std::memory_order_relaxed);
+      };
+      if (scheduler != nullptr) {
+        scheduler->parallelFor(runCount, BALL_SYSTEM_RESOLVE_CHUNK,
+                               resolveRuns);
+      } else {
+        resolveRuns(0, runCount, 0);
+      }
+    }
+    m_sleepingCount -= woken.load();
+  };
+
+  // Moves the ball in slot m_order[k] to slot k; width is the number of
+  // elements per ball.
+  template <typename Vector>
+  void gather(Vector &array, Vector &scratch, uint32_t width,
+              JobScheduler *scheduler) {
+    scratch.resize(array.size());
+    auto copy = [&](uint32_t begin, uint32_t end, uint32_t) {
+      for (uint32_t k = begin; k < end; k++) {
+        size_t from = size_t(m_order[k]) * width;
+        for (uint32_t c = 0; c < width; c++) {
+          scratch[size_t(k) * width + c] = array[from + c];
+        }
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(size(), BALL_SYSTEM_CHUNK_SIZE, copy,
+                            BALL_SYSTEM_MIN_PER_WORKER);
+    } else {
+      copy(0, size(), 0);
+    }
+    array.swap(scratch);
+  };
+
+public:
+  BallSystem(SimdLevel simdLevel = detectSimdLevel()) {
+    m_simdLevel = simdLevel;
+  };
+  static SimdLevel detectSimdLevel() {
+#ifdef BALL_SYSTEM_X86
+    if (__builtin_cpu_supports("avx2")) {
+      return SimdLevel::eAvx2;
+    }
+    return SimdLevel::eSse;
+#else
+    return SimdLevel::eScalar;
+#endif
+  };
+  SimdLevel getSimdLevel() { return m_simdLevel; };
+  void setSimdLevel(SimdLevel simdLevel) { m_simdLevel = simdLevel; };
+  void reserve(uint32_t count) {
+    for (auto *array : {&m_x, &m_y, &m_radius, &m_vx, &m_vy, &m_previousX,
+                        &m_previousY}) {
+      array->reserve(count);
+    }
+    m_instanceData.reserve(3 * size_t(count));
+    m_asleep.reserve(count);
+    m_touched.reserve(count);
+    m_restSteps.reserve(count);
+    m_ids.reserve(count);
+    m_slots.reserve(count);
+  };
+  uint32_t addBall(float x, float y, float vx, float vy, float radius) {
+    m_x.push_back(x);
+    m_y.push_back(y);
+    m_radius.push_back(radius);
+    m_vx.push_back(vx);
+    m_vy.push_back(vy);
+    m_previousX.push_back(x);
+    m_previousY.push_back(y);
+    m_asleep.push_back(0);
+    m_touched.push_back(0);
+    m_restSteps.push_back(0);
+    m_ids.push_back(m_slots.size());
+    m_slots.push_back(m_x.size() - 1);
+    m_instanceData.insert(m_instanceData.end(), {x, y, radius});
+    m_maxRadius = std::max(m_maxRadius, radius);
+    return m_ids.back();
+  };
+  uint32_t size() { return m_x.size(); };
+  // addBall() returns a ball's id; its slot, the index into the state
+  // arrays and the instance stream, changes whenever reorder() runs.
+  uint32_t slotOf(uint32_t id) { return m_slots[id]; };
+  uint32_t idOf(uint32_t slot) { return m_ids[slot]; };
+  float getGravity() { return GRAVITY; };
+  void setCollisions(bool enabled) { m_collisions = enabled; };
+  bool getCollisions() { return m_collisions; };
+  // Sleeping is off by default; with the default perfectly elastic walls
+  // and collisions and no damping, balls never come to rest anyway.
+  void setSleeping(bool enabled, float sleepSpeed = DEFAULT_SLEEP_SPEED) {
+    m_sleepEnabled = enabled;
+    m_sleepSpeed = sleepSpeed;
+    if (!enabled) {
+      for (uint32_t i = 0; i < size(); i++) {
+        wake(i);
+      }
+    }
+  };
+  bool getSleeping() { return m_sleepEnabled; };
+  void setRestitution(float restitution) { m_restitution = restitution; };
+  void setDamping(float damping) { m_damping = damping; };
+  uint32_t getSleepingCount() { return m_sleepingCount; };
+  uint32_t getAwakeCount() { return size() - m_sleepingCount; };
+  bool isAsleep(uint32_t i) { return m_asleep[i] != 0; };
+  // Adds dv to every ball's velocity and wakes the sleeping ones.
+  void applyImpulse(float dvx, float dvy) {
+    for (uint32_t i = 0; i < size(); i++) {
+      wake(i);
+      m_vx[i] += dvx;
+      m_vy[i] += dvy;
+    }
+  };
+  // Appends the instances that may have changed since the previous call:
+  // every awake ball plus balls that fell asleep since the last call, whose
+  // final step may not have been uploaded yet. Sleeping balls never move,
+  // so the rest are skipped. Ranges come back sorted and coalesced.
+  void takeDirtyRanges(std::vector<InstanceRange> &ranges,
+                       uint32_t gap = DIRTY_RANGE_MERGE_GAP) {
+    ranges.clear();
+    uint32_t count = size();
+    if (m_sleepingCount == 0 || m_reordered) {
+      m_reordered = false;
+      std::fill(m_touched.begin(), m_touched.end(), 0);
+      if (count > 0) {
+        ranges.push_back({0, count});
+      }
+      return;
+    }
+    uint32_t i = 0;
+    while (i < count) {
+      while (i < count && m_asleep[i] && !m_touched[i]) {
+        i++;
+      }
+      uint32_t first = i;
+      while (i < count && (!m_asleep[i] || m_touched[i])) {
+        m_touched[i] = 0;
+        i++;
+      }
+      if (i > first) {
+        ranges.push_back({first, i - first});
+      }
+    }
+    coalesceRanges(ranges, gap);
+  };
+  BroadphaseStats getBroadphaseStats() { return m_broadphaseStats; };
+  void saveState(BallState &state) {
+    state.stepCount = m_stepCount;
+    state.x.assign(m_x.begin(), m_x.end());
+    state.y.assign(m_y.begin(), m_y.end());
+    state.radius.assign(m_radius.begin(), m_radius.end());
+    state.vx.assign(m_vx.begin(), m_vx.end());
+    state.vy.assign(m_vy.begin(), m_vy.end());
+    state.ids = m_ids;
+    state.asleep = m_asleep;
+    state.restSteps = m_restSteps;
+  };
+  // Replaces every ball with the state in view, which may point straight
+  // into a memory-mapped file; chunks are copied in parallel so page-ins
+  // overlap. The interpolation history restarts at the loaded positions.
+  void loadState(const BallStateView &view,
+                 JobScheduler *scheduler = nullptr) {
+    uint32_t count = view.count;
+    for (auto *array : {&m_x, &m_y, &m_radius, &m_vx, &m_vy, &m_previousX,
+                        &m_previousY}) {
+      array->resize(count);
+    }
+    m_instanceData.resize(3 * size_t(count));
+    m_asleep.resize(count);
+    m_touched.assign(count, 0);
+    m_restSteps.resize(count);
+    m_ids.resize(count);
+    m_slots.resize(count);
+    auto load = [&](uint32_t begin, uint32_t end, uint32_t) {
+      size_t bytes = sizeof(float) * (end - begin);
+      memcpy(&m_x[begin], view.x + begin, bytes);
+      memcpy(&m_y[begin], view.y + begin, bytes);
+      memcpy(&m_radius[begin], view.radius + begin, bytes);
+      memcpy(&m_vx[begin], view.vx + begin, bytes);
+      memcpy(&m_vy[begin], view.vy + begin, bytes);
+      memcpy(&m_previousX[begin], view.x + begin, bytes);
+      memcpy(&m_previousY[begin], view.y + begin, bytes);
+      memcpy(&m_asleep[begin], view.asleep + begin, end - begin);
+      memcpy(&m_restSteps[begin], view.restSteps + begin,
+             sizeof(uint16_t) * (end - begin));
+      memcpy(&m_ids[begin], view.ids + begin, sizeof(uint32_t) * (end - begin));
+      for (uint32_t i = begin; i < end; i++) {
+        m_instanceData[3 * i] = m_x[i];
+        m_instanceData[3 * i + 1] = m_y[i];
+        m_instanceData[3 * i + 2] = m_radius[i];
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(count, BALL_SYSTEM_CHUNK_SIZE, load,
+                            BALL_SYSTEM_MIN_PER_WORKER);
+    } else {
+      load(0, count, 0);
+    }
+    m_maxRadius = 0.0f;
+    m_sleepingCount = 0;
+    for (uint32_t slot = 0; slot < count; slot++) {
+      m_slots[m_ids[slot]] = slot;
+      m_maxRadius = std::max(m_maxRadius, m_radius[slot]);
+      m_sleepingCount += m_asleep[slot] != 0;
+    }
+    m_stepCount = view.stepCount;
+    m_reordered = true;
+  };
+  // step() calls reorder() every interval steps; 0 turns it off.
+  void setReorderInterval(uint32_t interval) {
+    m_reorderInterval = interval;
+  };
+  uint32_t getReorderInterval() { return m_reorderInterval; };
+  ReorderStats getReorderStats() { return m_reorderStats; };
+  // Sorts every per-ball array by the Morton code of the ball's position,
+  // so balls that are close in space are close in memory: grid cells,
+  // neighbour lists and the instance stream the vertex shader reads all
+  // become mostly sequential. Reordering changes the order in which
+  // contacts are resolved, so a run with reordering differs from one
+  // without, but stays deterministic and identical across SIMD levels.
+  void reorder(JobScheduler *scheduler = nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t count = size();
+    m_sortKeys.resize(count);
+    m_order.resize(count);
+    auto computeKeys = [&](uint32_t begin, uint32_t end, uint32_t) {
+      for (uint32_t i = begin; i < end; i++) {
+        m_sortKeys[i] = mortonCode(m_x[i], m_y[i]);
+        m_order[i] = i;
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(count, BALL_SYSTEM_CHUNK_SIZE, computeKeys,
+                            BALL_SYSTEM_MIN_PER_WORKER);
+    } else {
+      computeKeys(0, count, 0);
+    }
+    m_sorter.sort(m_sortKeys, m_order, scheduler, BALL_SYSTEM_CHUNK_SIZE);
+    for (auto *array : {&m_x, &m_y, &m_radius, &m_vx, &m_vy, &m_previousX,
+                        &m_previousY}) {
+      gather(*array, m_floatScratch, 1, scheduler);
+    }
+    gather(m_instanceData, m_floatScratch, 3, scheduler);
+    gather(m_asleep, m_byteScratch, 1, scheduler);
+    gather(m_touched, m_byteScratch, 1, scheduler);
+    gather(m_restSteps, m_restStepScratch, 1, scheduler);
+    gather(m_ids, m_idScratch, 1, scheduler);
+    for (uint32_t slot = 0; slot < count; slot++) {
+      m_slots[m_ids[slot]] = slot;
+    }
+    m_reordered = true;
+    double milliseconds = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    m_reorderStats.reorders++;
+    m_reorderStats.lastMilliseconds = milliseconds;
+    m_reorderStats.totalMilliseconds += milliseconds;
+  };
+  float *getInstanceData() { return m_instanceData.data(); };
+  BallArrays arrays() {
+    return BallArrays{m_x.data(),  m_y.data(),  m_radius.data(),
+                      m_vx.data(), m_vy.data(), m_instanceData.data(),
+                      m_previousX.data(), m_previousY.data()};
+  };
+  // Integrates and wall-bounces balls [begin, end). Ranges never overlap
+  // between callers, so disjoint ranges may be integrated concurrently.
+  // Sleeping balls are skipped by running the kernel over each run of
+  // awake ones.
+  void integrate(uint32_t begin, uint32_t end, float dt) {
+    BallArrays balls = arrays();
+    float dvy = GRAVITY * dt;
+    // Exactly 1 when damping is off, which keeps the default simulation
+    // bit-identical to the undamped kernels.
+    float damping = std::max(0.0f, 1.0f - m_damping * dt);
+    uint32_t i = begin;
+    while (i < end) {
+      while (i < end && m_asleep[i]) {
+        i++;
+      }
+      uint32_t runBegin = i;
+      while (i < end && !m_asleep[i]) {
+        i++;
+      }
+      if (i == runBegin) {
+        continue;
+      }
+      switch (m_simdLevel) {
+#ifdef BALL_SYSTEM_X86
+      case SimdLevel::eAvx2:
+        integrateAvx2(balls, runBegin, i, dt, dvy, m_restitution,
+                      damping);
+        break;
+      case SimdLevel::eSse:
+        integrateSse(balls, runBegin, i, dt, dvy, m_restitution,
+                     damping);
+        break;
+#endif
+      default:
+        integrateScalar(balls, runBegin, i, dt, dvy, m_restitution,
+                        damping);
+        break;
+      }
+    }
+  };
+  void step(float dt, JobScheduler *scheduler = nullptr) {
+    if (scheduler == nullptr) {
+      integrate(0, size(), dt);
+    } else {
+      scheduler->parallelFor(
+          size(), BALL_SYSTEM_CHUNK_SIZE,
+          [&](uint32_t begin, uint32_t end, uint32_t) {
+            integrate(begin, end, dt);
+          },
+          BALL_SYSTEM_MIN_PER_WORKER);
+    }
+    if (m_collisions) {
+      collide(scheduler);
+    }
+    if (m_sleepEnabled) {
+      updateSleep(dt, scheduler);
+    }
+    m_stepCount++;
+    if (m_reorderInterval > 0 && m_stepCount % m_reorderInterval == 0) {
+      reorder(scheduler);
+    }
+  };
+  uint64_t getStepCount() { return m_stepCount; };
+  // Instance stream blended between the previous and current step: alpha 0
+  // is the previous state, 1 the current one. Rendering therefore lags the
+  // simulation by up to one step.
+  float *getInterpolatedInstanceData(float alpha,
+                                     JobScheduler *scheduler = nullptr) {
+    if (alpha >= 1.0f) {
+      return m_instanceData.data();
+    }
+    m_interpolatedData.resize(m_instanceData.size());
+    writeInterpolatedInstanceData(alpha, m_interpolatedData.data(), scheduler);
+    return m_interpolatedData.data();
+  };
+  // Same as getInterpolatedInstanceData() but writes 3 * size() floats into
+  // caller-owned storage, e.g. a snapshot handed to another thread.
+  void writeInterpolatedInstanceData(float alpha, float *out,
+                                     JobScheduler *scheduler = nullptr) {
+    auto interpolate = [&](uint32_t begin, uint32_t end, uint32_t) {
+      if (alpha >= 1.0f) {
+        memcpy(out + 3 * size_t(begin),
+               m_instanceData.data() + 3 * size_t(begin),
+               sizeof(float) * 3 * (end - begin));
+        return;
+      }
+      for (uint32_t i = begin; i < end; i++) {
+        out[3 * i] = m_previousX[i] + (m_x[i] - m_previousX[i]) * alpha;
+        out[3 * i + 1] = m_previousY[i] + (m_y[i] - m_previousY[i]) * alpha;
+        out[3 * i + 2] = m_radius[i];
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(size(), BALL_SYSTEM_CHUNK_SIZE, interpolate,
+                            BALL_SYSTEM_MIN_PER_WORKER);
+    } else {
+      interpolate(0, size(), 0);
+    }
+  };
+  // FNV-1a over the bit patterns of the simulated state in id order;
+  // equal checksums after equal step counts mean bit-identical runs.
+  uint64_t checksum() {
+    uint64_t hash = 14695981039346656037ull;
+    for (const auto *array : {&m_x, &m_y, &m_radius, &m_vx, &m_vy}) {
+      for (uint32_t slot : m_slots) {
+        uint32_t bits;
+        memcpy(&bits, &(*array)[slot], sizeof(bits));
+        for (int byte = 0; byte < 4; byte++) {
+          hash ^= (bits >> (8 * byte)) & 0xff;
+          hash *= 1099511628211ull;
+        }
+      }
+    }
+    return hash;
+  };
+};
+
+// Deterministic population for a seed: a single ball reproduces the
+// original demo, larger counts get radii that shrink with the population.
+inline void spawnBalls(BallSystem &balls, uint32_t count, uint32_t seed) {
+  if (count == 1) {
+    balls.addBall(0, 0, 0.1, 0.2, 0.2);
+    return;
+  }
+  std::mt19937 rng(seed);
+  float maxRadius = std::min(0.2f, 0.3f / std::sqrt(float(count)));
+  std::uniform_real_distribution<float> radius(0.5f * maxRadius, maxRadius);
+  std::uniform_real_distribution<float> position(-1.0f + maxRadius,
+                                                 1.0f - maxRadius);
+  std::uniform_real_distribution<float> velocity(-0.5f, 0.5f);
+  balls.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    float x = position(rng);
+    float y = position(rng);
+    float vx = velocity(rng);
+    float vy = velocity(rng);
+    balls.addBall(x, y, vx, vy, radius(rng));
+  }
+}
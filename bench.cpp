@@ -0,0 +1,315 @@
+#include "ball_system.h"
+#include "simulation_clock.h"
+#include "vulkan_renderer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BenchConfig {
+  uint32_t ballCount;
+  uint32_t framesInFlight;
+  RenderMode renderMode;
+};
+
+struct BenchResult {
+  BenchConfig config;
+  uint64_t frames;
+  double seconds;
+  double meanMilliseconds;
+  double p50Milliseconds;
+  double p95Milliseconds;
+  double p99Milliseconds;
+  double maxMilliseconds;
+  double visibleFraction;
+  double instanceBytesPerFrame;
+  double reorderMilliseconds;
+  double meanWaitMicroseconds;
+  uint32_t pacingDepth;
+};
+
+// Parses a comma-separated list of positive integers. Returns false on an
+// empty list, an empty or non-numeric entry, or a zero.
+bool parseList(const char *arg, std::vector<uint32_t> &values) {
+  values.clear();
+  while (true) {
+    if (*arg < '0' || *arg > '9') {
+      return false;
+    }
+    char *end;
+    unsigned long value = std::strtoul(arg, &end, 10);
+    if (value == 0 || value > UINT32_MAX) {
+      return false;
+    }
+    values.push_back(value);
+    if (*end == '\0') {
+      return true;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    arg = end + 1;
+  }
+}
+
+double percentile(std::vector<double> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = std::min(sorted.size() - 1,
+                          static_cast<size_t>(fraction * sorted.size()));
+  return sorted[index];
+}
+
+// One headless run: warm-up frames are untimed, then every frame is timed
+// from the start of the physics step to the return of drawFrame(). The
+// total includes a final waitIdle so queued GPU work is paid for.
+BenchResult runConfig(const BenchConfig &config, uint64_t frameCount,
+                      uint64_t warmupFrames, JobScheduler &scheduler,
+                      bool collisions, bool gpuPhysics, bool culling,
+                      float zoom, uint32_t recordThreads,
+                      InstanceFormat instanceFormat, uint32_t seed,
+                      uint32_t reorderInterval, bool adaptivePacing) {
+  BallSystem balls;
+  spawnBalls(balls, config.ballCount, seed);
+  balls.setCollisions(collisions && !gpuPhysics);
+  balls.setReorderInterval(gpuPhysics ? 0 : reorderInterval);
+  SimulationClock clock;
+  RendererSettings settings;
+  settings.headless = true;
+  settings.framesInFlight = config.framesInFlight;
+  settings.offscreenTargetCount = config.framesInFlight;
+  settings.maxInstances = balls.size();
+  settings.gpuPhysics = gpuPhysics;
+  settings.renderMode = config.renderMode;
+  settings.gpuCulling = culling;
+  settings.recordThreads = recordThreads;
+  settings.instanceFormat = instanceFormat;
+  settings.adaptivePacing = adaptivePacing;
+  VulkanRenderer app(settings);
+  app.setView(0.0f, 0.0f, zoom);
+  if (gpuPhysics) {
+    app.initGpuPhysics(balls.arrays(), balls.size(), balls.getGravity());
+    app.setGpuPhysicsSteps(clock.getStepSeconds(), 1);
+  }
+  auto frame = [&]() {
+    if (gpuPhysics) {
+      app.drawFrame(nullptr, balls.size());
+    } else {
+      balls.step(clock.getStepSeconds(), &scheduler);
+      app.drawFrame(balls.getInstanceData(), balls.size());
+    }
+  };
+  for (uint64_t i = 0; i < warmupFrames; i++) {
+    frame();
+  }
+  app.waitIdle();
+  std::vector<double> frameTimes;
+  frameTimes.reserve(frameCount);
+  auto start = std::chrono::high_resolution_clock::now();
+  for (uint64_t i = 0; i < frameCount; i++) {
+    auto frameStart = std::chrono::high_resolution_clock::now();
+    frame();
+    frameTimes.push_back(
+        std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - frameStart)
+            .count());
+  }
+  app.waitIdle();
+  BenchResult result{};
+  result.config = config;
+  result.frames = frameCount;
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::high_resolution_clock::now() - start)
+                       .count();
+  double total = 0.0;
+  for (double time : frameTimes) {
+    total += time;
+  }
+  std::sort(frameTimes.begin(), frameTimes.end());
+  result.meanMilliseconds = frameTimes.empty() ? 0.0 : total / frameCount;
+  result.p50Milliseconds = percentile(frameTimes, 0.50);
+  result.p95Milliseconds = percentile(frameTimes, 0.95);
+  result.p99Milliseconds = percentile(frameTimes, 0.99);
+  result.maxMilliseconds = frameTimes.empty() ? 0.0 : frameTimes.back();
+  CullStats cull = app.getCullStats();
+  result.visibleFraction =
+      cull.totalSum > 0 ? double(cull.visibleSum) / cull.totalSum : 1.0;
+  result.instanceBytesPerFrame = app.getInstanceBytesPerFrame();
+  FramePacingStats pacing = app.getFramePacing();
+  result.meanWaitMicroseconds = pacing.meanWaitMicroseconds;
+  result.pacingDepth = pacing.depth;
+  ReorderStats reorder = balls.getReorderStats();
+  result.reorderMilliseconds =
+      reorder.reorders > 0 ? reorder.totalMilliseconds / reorder.reorders
+                           : 0.0;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint32_t> ballCounts = {1000, 10000, 100000};
+  std::vector<uint32_t> framesInFlight = {1, 2, 3};
+  std::vector<RenderMode> renderModes = {RenderMode::eMesh};
+  uint64_t frameCount = 500;
+  uint64_t warmupFrames = 50;
+  uint32_t threadCount = std::thread::hardware_concurrency();
+  uint32_t seed = 1;
+  bool collisions = false;
+  bool gpuPhysics = false;
+  bool culling = false;
+  float zoom = 1.0f;
+  uint32_t recordThreads = 0;
+  InstanceFormat instanceFormat = InstanceFormat::eFloat32;
+  uint32_t reorderInterval = 0;
+  bool adaptivePacing = true;
+  std::string outputPath;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc) {
+      if (!parseList(argv[++i], ballCounts)) {
+        fprintf(stderr, "--balls takes positive integers, e.g. 1000,10000\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+      if (!parseList(argv[++i], framesInFlight)) {
+        fprintf(stderr, "--frames-in-flight takes positive integers, "
+                        "e.g. 1,2,3\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--render-modes") == 0 && i + 1 < argc) {
+      renderModes.clear();
+      const char *modes = argv[++i];
+      if (strstr(modes, "mesh") != nullptr) {
+        renderModes.push_back(RenderMode::eMesh);
+      }
+      if (strstr(modes, "sdf") != nullptr) {
+        renderModes.push_back(RenderMode::eImpostor);
+      }
+      if (renderModes.empty()) {
+        fprintf(stderr, "--render-modes takes mesh, sdf or mesh,sdf\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frameCount = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmupFrames = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threadCount = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--collisions") == 0) {
+      collisions = true;
+    } else if (strcmp(argv[i], "--gpu-physics") == 0) {
+      gpuPhysics = true;
+    } else if (strcmp(argv[i], "--cull") == 0) {
+      culling = true;
+    } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+      recordThreads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--instance-format") == 0 && i + 1 < argc) {
+      const char *format = argv[++i];
+      if (strcmp(format, "float") == 0 || strcmp(format, "float32") == 0) {
+        instanceFormat = InstanceFormat::eFloat32;
+      } else if (strcmp(format, "half") == 0) {
+        instanceFormat = InstanceFormat::eHalf;
+      } else if (strcmp(format, "snorm16") == 0) {
+        instanceFormat = InstanceFormat::eSnorm16;
+      } else {
+        fprintf(stderr, "--instance-format takes float, half or snorm16\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+      reorderInterval = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--fixed-pacing") == 0) {
+      adaptivePacing = false;
+    } else if (strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+      zoom = std::max(0.01f, std::strtof(argv[++i], nullptr));
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--balls N,N,...] [--frames-in-flight N,N,...] "
+              "[--render-modes mesh,sdf] "
+              "[--frames N] [--warmup N] [--threads N] [--seed N] "
+              "[--collisions] [--gpu-physics] [--cull] [--zoom Z] "
+              "[--record-threads N] "
+              "[--instance-format float|half|snorm16] [--reorder STEPS] "
+              "[--fixed-pacing] [--output FILE]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  JobScheduler scheduler(threadCount);
+  std::vector<BenchResult> results;
+  for (RenderMode renderMode : renderModes) {
+    for (uint32_t ballCount : ballCounts) {
+      for (uint32_t depth : framesInFlight) {
+        BenchConfig config{ballCount, depth, renderMode};
+        BenchResult result =
+            runConfig(config, frameCount, warmupFrames, scheduler, collisions,
+                      gpuPhysics, culling, zoom, recordThreads,
+                      instanceFormat, seed, reorderInterval, adaptivePacing);
+        fprintf(stderr,
+                "%4s %8u balls, %u in flight: %8.1f fps, p50 %.3f ms, "
+                "p95 %.3f ms, p99 %.3f ms\n",
+                renderModeName(renderMode), config.ballCount,
+                config.framesInFlight, result.frames / result.seconds,
+                result.p50Milliseconds, result.p95Milliseconds,
+                result.p99Milliseconds);
+        results.push_back(result);
+      }
+    }
+  }
+  FILE *output = stdout;
+  if (!outputPath.empty()) {
+    output = fopen(outputPath.c_str(), "w");
+    if (output == nullptr) {
+      fprintf(stderr, "Failed to open %s\n", outputPath.c_str());
+      return 1;
+    }
+  }
+  fprintf(output,
+          "{\n  \"frames\": %llu,\n  \"warmup\": %llu,\n  \"threads\": %u,\n"
+          "  \"collisions\": %s,\n  \"gpu_physics\": %s,\n"
+          "  \"culling\": %s,\n  \"zoom\": %.3f,\n"
+          "  \"record_threads\": %u,\n  \"instance_format\": \"%s\",\n"
+          "  \"reorder_interval\": %u,\n  \"adaptive_pacing\": %s,\n"
+          "  \"results\": [",
+          static_cast<unsigned long long>(frameCount),
+          static_cast<unsigned long long>(warmupFrames),
+          scheduler.threadCount(), collisions ? "true" : "false",
+          gpuPhysics ? "true" : "false", culling ? "true" : "false", zoom,
+          recordThreads, instanceFormatName(instanceFormat), reorderInterval,
+          adaptivePacing ? "true" : "false");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &result = results[i];
+    fprintf(output,
+            "%s\n    {\"render_mode\": \"%s\", \"balls\": %u, "
+            "\"frames_in_flight\": %u, "
+            "\"seconds\": %.6f, \"fps\": %.3f, \"balls_per_second\": %.1f, "
+            "\"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, "
+            "\"p99_ms\": %.4f, \"max_ms\": %.4f, "
+            "\"visible_fraction\": %.4f, "
+            "\"instance_bytes_per_frame\": %.1f, "
+            "\"reorder_ms\": %.4f, \"mean_wait_us\": %.1f, "
+            "\"pacing_depth\": %u}",
+            i == 0 ? "" : ",", renderModeName(result.config.renderMode),
+            result.config.ballCount,
+            result.config.framesInFlight, result.seconds,
+            result.frames / result.seconds,
+            double(result.config.ballCount) * result.frames / result.seconds,
+            result.meanMilliseconds, result.p50Milliseconds,
+            result.p95Milliseconds, result.p99Milliseconds,
+            result.maxMilliseconds, result.visibleFraction,
+            result.instanceBytesPerFrame, result.reorderMilliseconds,
+            result.meanWaitMicroseconds, result.pacingDepth);
+  }
+  fprintf(output, "\n  ]\n}\n");
+  if (output != stdout) {
+    fclose(output);
+  }
+  return 0;
+}
@@ -1,4 +1,45 @@
 #version 450
 
+layout(local_size_x = 64) in;
+
+layout(std430, binding = 0) buffer InstanceBuffer { float instances[]; };
+layout(std430, binding = 1) buffer VelocityBuffer { vec2 velocities[]; };
+
+layout(push_constant) uniform PushConstants {
+    float dt;
+    float gravity;
+    uint count;
+} pc;
+
 void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= pc.count) {
+        return;
+    }
+    float x = instances[3 * i];
+    float y = instances[3 * i + 1];
+    float r = instances[3 * i + 2];
+    vec2 v = velocities[i];
+    x += v.x * pc.dt;
+    y -= v.y * pc.dt;
+    v.y -= pc.gravity * pc.dt;
+    if (x + r > 1.0) {
+        v.x = -v.x;
+        x = 1.0 - r;
+    }
+    if (x - r < -1.0) {
+        v.x = -v.x;
+        x = -1.0 + r;
+    }
+    if (y + r > 1.0) {
+        v.y = -v.y;
+        y = 1.0 - r;
+    }
+    if (y - r < -1.0) {
+        v.y = -v.y;
+        y = -1.0 + r;
+    }
+    instances[3 * i] = x;
+    instances[3 * i + 1] = y;
+    velocities[i] = v;
 }
@@ -0,0 +1,58 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+// InstanceFormat: 0 float x, y, radius; 1 half and 2 snorm16 x, y, radius,
+// pad. Instances are moved as opaque words so survivors keep the format.
+layout(constant_id = 0) const uint INSTANCE_FORMAT = 0;
+const uint WORDS = INSTANCE_FORMAT == 0 ? 3 : 2;
+
+layout(std430, binding = 0) readonly buffer InstanceBuffer { uint instances[]; };
+layout(std430, binding = 1) writeonly buffer VisibleBuffer { uint visible[]; };
+layout(std430, binding = 2) buffer DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+} command;
+
+layout(push_constant) uniform PushConstants {
+    vec2 center;
+    float zoom;
+    float minRadius;
+    uint count;
+    uint first;
+} pc;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= pc.count) {
+        return;
+    }
+    uint base = WORDS * (pc.first + i);
+    vec2 position;
+    float r;
+    if (INSTANCE_FORMAT == 1) {
+        position = unpackHalf2x16(instances[base]);
+        r = unpackHalf2x16(instances[base + 1]).x;
+    } else if (INSTANCE_FORMAT == 2) {
+        position = unpackSnorm2x16(instances[base]);
+        r = unpackSnorm2x16(instances[base + 1]).x;
+    } else {
+        position = uintBitsToFloat(uvec2(instances[base], instances[base + 1]));
+        r = uintBitsToFloat(instances[base + 2]);
+    }
+    vec2 projected = (position - pc.center) * pc.zoom;
+    float projectedRadius = r * pc.zoom;
+    if (projectedRadius < pc.minRadius) {
+        return;
+    }
+    if (any(greaterThan(abs(projected) - projectedRadius, vec2(1.0)))) {
+        return;
+    }
+    uint slot = atomicAdd(command.instanceCount, 1u);
+    for (uint word = 0; word < WORDS; word++) {
+        visible[WORDS * slot + word] = instances[base + word];
+    }
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_CAPTURE_LIMIT 1000
+#define CAPTURE_FILE_MAGIC "BBCAPTR1"
+
+enum class CaptureFormat { eRaw, ePpm, eMapped };
+
+struct CaptureStats {
+  uint64_t written;
+  uint64_t dropped;
+  uint64_t bytes;
+  double seconds;
+  double framesPerSecond;
+};
+
+// Header of a CaptureFormat::eMapped file; frames of width * height * 4
+// bytes follow it back to back.
+struct CaptureFileHeader {
+  char magic[8];
+  uint32_t width;
+  uint32_t height;
+  // 1 when pixels are stored B, G, R, A; 0 for R, G, B, A.
+  uint32_t bgra;
+  uint32_t frameCount;
+};
+
+// Writes captured frames on a background thread. Frames are handed over
+// by pointer into caller-owned slots (the renderer's mapped readback
+// buffers) and nothing is copied on the caller's thread; a slot stays busy
+// until its frame is on disk, and the caller drops frames rather than
+// waiting for it. eRaw and ePpm write one file per frame, eMapped streams
+// every frame into one preallocated memory-mapped file.
+class FrameCapture {
+private:
+  struct Job {
+    const uint8_t *pixels;
+    uint32_t slot;
+    uint64_t frame;
+  };
+  CaptureFormat m_format;
+  std::string m_path;
+  uint32_t m_width;
+  uint32_t m_height;
+  bool m_bgra;
+  size_t m_frameBytes;
+  uint64_t m_limit;
+  std::unique_ptr<std::atomic<bool>[]> m_slotBusy;
+  std::deque<Job> m_jobs;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_stop = false;
+  bool m_writing = false;
+  std::thread m_thread;
+  int m_file = -1;
+  uint8_t *m_mapped = nullptr;
+  size_t m_mappedBytes = 0;
+  std::atomic<uint64_t> m_written{0};
+  std::atomic<uint64_t> m_dropped{0};
+  std::atomic<uint64_t> m_bytes{0};
+  std::chrono::time_point<std::chrono::steady_clock> m_start;
+  std::vector<uint8_t> m_row;
+  std::string framePath(uint64_t frame, const char *extension) {
+    char name[32];
+    snprintf(name, sizeof(name), "_%06llu.%s",
+             static_cast<unsigned long long>(frame), extension);
+    return m_path + name;
+  };
+  bool writePpm(const Job &job) {
+    FILE *file = fopen(framePath(job.frame, "ppm").c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    fprintf(file, "P6\n%u %u\n255\n", m_width, m_height);
+    bool ok = true;
+    for (uint32_t y = 0; y < m_height && ok; y++) {
+      const uint8_t *src = job.pixels + size_t(y) * m_width * 4;
+      for (uint32_t x = 0; x < m_width; x++) {
+        m_row[3 * x] = src[4 * x + (m_bgra ? 2 : 0)];
+        m_row[3 * x + 1] = src[4 * x + 1];
+        m_row[3 * x + 2] = src[4 * x + (m_bgra ? 0 : 2)];
+      }
+      ok = fwrite(m_row.data(), 1, m_row.size(), file) == m_row.size();
+    }
+    return fclose(file) == 0 && ok;
+  };
+  bool writeRaw(const Job &job) {
+    FILE *file = fopen(framePath(job.frame, "raw").c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool ok = fwrite(job.pixels, 1, m_frameBytes, file) == m_frameBytes;
+    return fclose(file) == 0 && ok;
+  };
+  bool writeMapped(const Job &job) {
+    uint64_t index = m_written.load(std::memory_order_relaxed);
+    if (index >= m_limit) {
+      return false;
+    }
+    memcpy(m_mapped + sizeof(CaptureFileHeader) + index * m_frameBytes,
+           job.pixels, m_frameBytes);
+    reinterpret_cast<CaptureFileHeader *>(m_mapped)->frameCount = index + 1;
+    return true;
+  };
+  void run() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() { return m_stop || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+          return;
+        }
+        job = m_jobs.front();
+        m_jobs.pop_front();
+        m_writing = true;
+      }
+      bool ok;
+      switch (m_format) {
+      case CaptureFormat::ePpm:
+        ok = writePpm(job);
+        break;
+      case CaptureFormat::eRaw:
+        ok = writeRaw(job);
+        break;
+      default:
+        ok = writeMapped(job);
+        break;
+      }
+      if (ok) {
+        m_written.fetch_add(1, std::memory_order_relaxed);
+        m_bytes.fetch_add(m_frameBytes, std::memory_order_relaxed);
+      } else {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      m_slotBusy[job.slot].store(false, std::memory_order_release);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writing = false;
+      }
+      m_condition.notify_all();
+    }
+  };
+
+public:
+  // path is a file name for eMapped and a prefix for the per-frame
+  // formats. limit caps the number of frames written.
+  FrameCapture(CaptureFormat format, const std::string &path, uint32_t width,
+               uint32_t height, bool bgra, uint32_t slotCount,
+               uint64_t limit = DEFAULT_CAPTURE_LIMIT)
+      : m_format(format), m_path(path), m_width(width), m_height(height),
+        m_bgra(bgra), m_frameBytes(size_t(width) * height * 4),
+        m_limit(limit), m_slotBusy(new std::atomic<bool>[slotCount]) {
+    for (uint32_t i = 0; i < slotCount; i++) {
+      m_slotBusy[i].store(false);
+    }
+    m_row.resize(size_t(width) * 3);
+    if (m_format == CaptureFormat::eMapped) {
+      m_mappedBytes = sizeof(CaptureFileHeader) + m_limit * m_frameBytes;
+      m_file = open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (m_file < 0 || ftruncate(m_file, m_mappedBytes) != 0) {
+        throw std::runtime_error("Failed to create capture file " + m_path);
+      }
+      void *mapped = mmap(nullptr, m_mappedBytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, m_file, 0);
+      if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Failed to map capture file " + m_path);
+      }
+      m_mapped = static_cast<uint8_t *>(mapped);
+      CaptureFileHeader header{};
+      memcpy(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic));
+      header.width = m_width;
+      header.height = m_height;
+      header.bgra = m_bgra;
+      memcpy(m_mapped, &header, sizeof(header));
+    }
+    m_start = std::chrono::steady_clock::now();
+    m_thread = std::thread([this]() { run(); });
+  };
+  // Drains queued frames, then trims the mapped file to what was written.
+  ~FrameCapture() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+    if (m_mapped != nullptr) {
+      munmap(m_mapped, m_mappedBytes);
+      if (ftruncate(m_file, sizeof(CaptureFileHeader) +
+                                m_written.load() * m_frameBytes) != 0) {
+        fprintf(stderr, "Failed to trim capture file %s\n", m_path.c_str());
+      }
+    }
+    if (m_file >= 0) {
+      close(m_file);
+    }
+  };
+  size_t getFrameBytes() { return m_frameBytes; };
+  bool isFull() {
+    return m_written.load(std::memory_order_relaxed) >= m_limit;
+  };
+  bool slotBusy(uint32_t slot) {
+    return m_slotBusy[slot].load(std::memory_order_acquire);
+  };
+  // pixels must stay valid and unmodified until slotBusy(slot) is false.
+  void submit(uint32_t slot, const void *pixels, uint64_t frame) {
+    m_slotBusy[slot].store(true, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.push_back({static_cast<const uint8_t *>(pixels), slot, frame});
+    }
+    m_condition.notify_one();
+  };
+  // Blocks until every submitted frame has been written.
+  void drain() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [&]() { return m_jobs.empty() && !m_writing; });
+  };
+  void noteDropped() { m_dropped.fetch_add(1, std::memory_order_relaxed); };
+  CaptureStats getStats() {
+    CaptureStats stats;
+    stats.written = m_written.load();
+    stats.dropped = m_dropped.load();
+    stats.bytes = m_bytes.load();
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - m_start)
+                        .count();
+    stats.framesPerSecond =
+        stats.seconds > 0.0 ? stats.written / stats.seconds : 0.0;
+    return stats;
+  };
+};
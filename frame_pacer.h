@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+// Frames per pacing decision.
+#define PACING_WINDOW_FRAMES 30
+// A window counts as GPU-bound when the host spent more than this share of
+// its frame time waiting for the GPU.
+#define PACING_WAIT_FRACTION 0.1
+// A window counts as starved when more than this share of its frames left
+// the queue empty while the host recorded the next one.
+#define PACING_STARVED_FRACTION 0.1
+// Windows the depth is held after growing; doubled whenever a shrink had
+// to be undone, up to PACING_MAX_HOLD_WINDOWS, so probing for lower
+// latency gets rarer once it has failed.
+#define PACING_HOLD_WINDOWS 4
+#define PACING_MAX_HOLD_WINDOWS 64
+
+struct FramePacingStats {
+  // Frames the host may run ahead of the GPU, at most the frames in flight.
+  uint32_t depth;
+  uint32_t maxDepth;
+  double lastWaitMicroseconds;
+  double meanWaitMicroseconds;
+  uint64_t frames;
+  uint64_t starvedFrames;
+  uint64_t depthIncreases;
+  uint64_t depthDecreases;
+};
+
+// Decides how far ahead of the GPU the host runs. Frame n waits until
+// frame n - depth has finished, i.e. for the frame timeline to reach
+// n + 1 - depth. A GPU-bound host waits every frame anyway, so each extra
+// frame of depth is only latency unless the queue would otherwise run dry;
+// the pacer shrinks the depth while the host waits and the queue stays
+// fed, and grows it again once frames start finding the queue empty. A
+// CPU-bound host hardly waits and the depth is left alone.
+class FramePacer {
+private:
+  uint32_t m_maxDepth = 1;
+  uint32_t m_depth = 1;
+  bool m_adaptive = false;
+  uint32_t m_windowFrames = 0;
+  uint32_t m_windowStarved = 0;
+  double m_windowWait = 0.0;
+  double m_windowFrameTime = 0.0;
+  uint32_t m_hold = 0;
+  uint32_t m_holdWindows = PACING_HOLD_WINDOWS;
+  bool m_lastDecreased = false;
+  FramePacingStats m_stats{};
+  void adapt() {
+    bool waited = m_windowWait > PACING_WAIT_FRACTION * m_windowFrameTime;
+    bool starved = m_windowStarved > PACING_STARVED_FRACTION * m_windowFrames;
+    if (m_hold > 0) {
+      m_hold--;
+    }
+    if (waited && starved && m_depth < m_maxDepth) {
+      if (m_lastDecreased) {
+        m_holdWindows =
+            std::min<uint32_t>(2 * m_holdWindows, PACING_MAX_HOLD_WINDOWS);
+      }
+      m_depth++;
+      m_hold = m_holdWindows;
+      m_lastDecreased = false;
+      m_stats.depthIncreases++;
+    } else if (waited && !starved && m_depth > 1 && m_hold == 0) {
+      m_depth--;
+      m_lastDecreased = true;
+      m_stats.depthDecreases++;
+    }
+  };
+
+public:
+  FramePacer() = default;
+  // Starts at maxDepth, the previous fixed behaviour; without adaptive the
+  // depth never changes.
+  FramePacer(uint32_t maxDepth, bool adaptive)
+      : m_maxDepth(std::max(maxDepth, 1u)), m_depth(m_maxDepth),
+        m_adaptive(adaptive) {};
+  uint32_t depth() { return m_depth; };
+  // Timeline value frame frameNumber waits for before recording; 0 needs
+  // no wait.
+  uint64_t waitValue(uint64_t frameNumber) {
+    return frameNumber + 1 > m_depth ? frameNumber + 1 - m_depth : 0;
+  };
+  // starved: the GPU had finished every submitted frame once the wait
+  // returned, so it idles while this frame is recorded. frameMicroseconds
+  // is the time since the previous frame started.
+  void record(bool starved, double waitMicroseconds,
+              double frameMicroseconds) {
+    m_stats.frames++;
+    m_stats.starvedFrames += starved;
+    m_stats.lastWaitMicroseconds = waitMicroseconds;
+    m_stats.meanWaitMicroseconds +=
+        (waitMicroseconds - m_stats.meanWaitMicroseconds) / m_stats.frames;
+    if (!m_adaptive) {
+      return;
+    }
+    m_windowFrames++;
+    m_windowStarved += starved;
+    m_windowWait += waitMicroseconds;
+    m_windowFrameTime += frameMicroseconds;
+    if (m_windowFrames < PACING_WINDOW_FRAMES) {
+      return;
+    }
+    adapt();
+    m_windowFrames = 0;
+    m_windowStarved = 0;
+    m_windowWait = 0.0;
+    m_windowFrameTime = 0.0;
+  };
+  FramePacingStats getStats() {
+    FramePacingStats stats = m_stats;
+    stats.depth = m_depth;
+    stats.maxDepth = m_maxDepth;
+    return stats;
+  };
+};
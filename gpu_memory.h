@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct MemoryHeapStats {
+  bool deviceLocal;
+  // Process usage and the budget reported by VK_EXT_memory_budget, or
+  // VMA's own estimate when the extension is missing.
+  uint64_t usage;
+  uint64_t budget;
+  uint64_t size;
+  uint32_t blockCount;
+  uint32_t allocationCount;
+  uint32_t unusedRangeCount;
+  uint64_t blockBytes;
+  uint64_t allocationBytes;
+};
+
+struct MemoryTelemetry {
+  bool budgetExtension;
+  std::vector<MemoryHeapStats> heaps;
+  uint32_t allocationCount;
+  uint64_t blockBytes;
+  uint64_t allocationBytes;
+  // Share of the bytes in VMA's memory blocks not covered by an
+  // allocation, and the number of free ranges they are split into.
+  double fragmentation;
+  uint32_t unusedRangeCount;
+};
+
+// vmaCreateBuffer that throws on failure and names the allocation, so it
+// can be told apart in writeMemoryStatsJson() dumps.
+inline void createNamedBuffer(VmaAllocator allocator,
+                              const vk::BufferCreateInfo &bufferInfo,
+                              const VmaAllocationCreateInfo &allocInfo,
+                              const std::string &name, vk::Buffer &buffer,
+                              VmaAllocation &allocation,
+                              VmaAllocationInfo *info = nullptr) {
+  if (vmaCreateBuffer(
+          allocator, reinterpret_cast<const VkBufferCreateInfo *>(&bufferInfo),
+          &allocInfo, reinterpret_cast<VkBuffer *>(&buffer), &allocation,
+          info) != VK_SUCCESS) {
+    throw std::runtime_error("Failed to create " + name + " buffer");
+  }
+  vmaSetAllocationName(allocator, allocation, name.c_str());
+}
+
+// Calculates per-heap statistics by walking every block, so it is meant to
+// run every few hundred frames rather than every frame.
+inline MemoryTelemetry queryMemoryTelemetry(VmaAllocator allocator,
+                                            bool budgetExtension) {
+  const VkPhysicalDeviceMemoryProperties *properties;
+  vmaGetMemoryProperties(allocator, &properties);
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetHeapBudgets(allocator, budgets);
+  VmaTotalStatistics totals;
+  vmaCalculateStatistics(allocator, &totals);
+  MemoryTelemetry telemetry{};
+  telemetry.budgetExtension = budgetExtension;
+  for (uint32_t i = 0; i < properties->memoryHeapCount; i++) {
+    const VmaDetailedStatistics &detailed = totals.memoryHeap[i];
+    MemoryHeapStats heap;
+    heap.deviceLocal = (properties->memoryHeaps[i].flags &
+                        VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    heap.usage = budgets[i].usage;
+    heap.budget = budgets[i].budget;
+    heap.size = properties->memoryHeaps[i].size;
+    heap.blockCount = detailed.statistics.blockCount;
+    heap.allocationCount = detailed.statistics.allocationCount;
+    heap.unusedRangeCount = detailed.unusedRangeCount;
+    heap.blockBytes = detailed.statistics.blockBytes;
+    heap.allocationBytes = detailed.statistics.allocationBytes;
+    telemetry.heaps.push_back(heap);
+  }
+  const VmaStatistics &total = totals.total.statistics;
+  telemetry.allocationCount = total.allocationCount;
+  telemetry.blockBytes = total.blockBytes;
+  telemetry.allocationBytes = total.allocationBytes;
+  telemetry.unusedRangeCount = totals.total.unusedRangeCount;
+  telemetry.fragmentation =
+      total.blockBytes > 0
+          ? 1.0 - double(total.allocationBytes) / total.blockBytes
+          : 0.0;
+  return telemetry;
+}
+
+inline void printMemoryTelemetry(FILE *file,
+                                 const MemoryTelemetry &telemetry) {
+  fprintf(file,
+          "memory: %u allocations, %.1f of %.1f MB in blocks used "
+          "(%.1f%% fragmented, %u free ranges)%s\n",
+          telemetry.allocationCount, telemetry.allocationBytes / 1e6,
+          telemetry.blockBytes / 1e6, telemetry.fragmentation * 100.0,
+          telemetry.unusedRangeCount,
+          telemetry.budgetExtension ? "" : ", budget estimated");
+  for (uint32_t i = 0; i < telemetry.heaps.size(); i++) {
+    const MemoryHeapStats &heap = telemetry.heaps[i];
+    if (heap.blockCount == 0 && heap.usage == 0) {
+      continue;
+    }
+    fprintf(file,
+            "  heap %u (%s): %.1f of %.1f MB budget (%.1f%%), %u "
+            "allocations in %u blocks\n",
+            i, heap.deviceLocal ? "device" : "host", heap.usage / 1e6,
+            heap.budget / 1e6,
+            heap.budget > 0 ? 100.0 * heap.usage / heap.budget : 0.0,
+            heap.allocationCount, heap.blockCount);
+  }
+}
+
+// Writes VMA's detailed JSON statistics, including the block map with
+// every named allocation.
+inline bool writeMemoryStatsJson(VmaAllocator allocator,
+                                 const std::string &path) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+  char *stats;
+  vmaBuildStatsString(allocator, &stats, VK_TRUE);
+  bool written = fputs(stats, file) >= 0;
+  vmaFreeStatsString(allocator, stats);
+  return fclose(file) == 0 && written;
+}
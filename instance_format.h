@@ -0,0 +1,218 @@
+#pragma once
+
+#include "ball_system.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Layout of the per-instance stream the renderer uploads. eFloat32 is the
+// simulation's own x, y, radius triple. The packed formats store x, y,
+// radius and a zero pad as four 16-bit values, which the vertex fetch
+// expands to floats (R16G16B16A16 Sfloat or Snorm), so the shaders see
+// the same vec3 either way. 16-bit three-component vertex formats are not
+// guaranteed to be supported and MoltenVK requires 4-byte aligned
+// strides, hence the pad. eSnorm16 relies on positions and radii lying in
+// [-1, 1], which the walls of the simulation guarantee.
+enum class InstanceFormat { eFloat32, eHalf, eSnorm16 };
+
+inline const char *instanceFormatName(InstanceFormat format) {
+  switch (format) {
+  case InstanceFormat::eHalf:
+    return "half";
+  case InstanceFormat::eSnorm16:
+    return "snorm16";
+  default:
+    return "float32";
+  }
+}
+
+inline uint32_t instanceStride(InstanceFormat format) {
+  return format == InstanceFormat::eFloat32 ? sizeof(float) * 3
+                                            : sizeof(uint16_t) * 4;
+}
+
+struct InstancePrecision {
+  float maxPositionError;
+  float maxRadiusError;
+};
+
+// Round-to-nearest-even conversion matching F16C's _mm_cvtps_ph, so the
+// scalar and SIMD packers produce identical bits.
+inline uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000;
+  uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000) {
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000) {
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) {
+    // Adding 0.5 lines the mantissa up with the half subnormal step and
+    // lets the FPU do the rounding.
+    float shifted;
+    memcpy(&shifted, &magnitude, sizeof(shifted));
+    shifted += 0.5f;
+    memcpy(&magnitude, &shifted, sizeof(magnitude));
+    return sign | (magnitude - 0x3f000000);
+  }
+  magnitude += 0xc8000fff + ((magnitude >> 13) & 1);
+  return sign | (magnitude >> 13);
+}
+
+inline float halfToFloat(uint16_t half) {
+  uint32_t sign = uint32_t(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else {
+    float value = std::ldexp(float(mantissa), -24);
+    memcpy(&bits, &value, sizeof(bits));
+    bits |= sign;
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+inline int16_t floatToSnorm16(float value) {
+  value = std::min(1.0f, std::max(-1.0f, value));
+  return int16_t(std::lrint(value * 32767.0f));
+}
+
+// Decodes as the vertex fetch does: c / 32767, with -32768 clamped to -1.
+inline float snorm16ToFloat(int16_t value) {
+  return std::max(-1.0f, value / 32767.0f);
+}
+
+inline void packInstancesScalar(InstanceFormat format, const float *in,
+                                uint16_t *out, uint32_t begin, uint32_t end) {
+  for (uint32_t i = begin; i < end; i++) {
+    for (uint32_t c = 0; c < 3; c++) {
+      float value = in[3 * i + c];
+      out[4 * i + c] = format == InstanceFormat::eHalf
+                           ? floatToHalf(value)
+                           : uint16_t(floatToSnorm16(value));
+    }
+    out[4 * i + 3] = 0;
+  }
+}
+
+#ifdef BALL_SYSTEM_X86
+// Splits four x, y, radius triples into one x, y, radius, 0 vector each
+// without reading past the twelve floats.
+inline void loadInstances4(const float *in, __m128 instances[4]) {
+  const __m128 keep = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  __m128 last = _mm_loadu_ps(in + 8);
+  instances[0] = _mm_and_ps(_mm_loadu_ps(in), keep);
+  instances[1] = _mm_and_ps(_mm_loadu_ps(in + 3), keep);
+  instances[2] = _mm_and_ps(_mm_loadu_ps(in + 6), keep);
+  instances[3] = _mm_and_ps(
+      _mm_shuffle_ps(last, last, _MM_SHUFFLE(3, 3, 2, 1)), keep);
+}
+
+inline void packSnorm16Sse(const float *in, uint16_t *out, uint32_t begin,
+                           uint32_t end) {
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 negOne = _mm_set1_ps(-1.0f);
+  const __m128 scale = _mm_set1_ps(32767.0f);
+  uint32_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 instances[4];
+    loadInstances4(in + 3 * size_t(i), instances);
+    __m128i words[4];
+    for (int j = 0; j < 4; j++) {
+      __m128 clamped = _mm_min_ps(one, _mm_max_ps(negOne, instances[j]));
+      words[j] = _mm_cvtps_epi32(_mm_mul_ps(clamped, scale));
+    }
+    __m128i *dst = reinterpret_cast<__m128i *>(out + 4 * size_t(i));
+    _mm_storeu_si128(dst, _mm_packs_epi32(words[0], words[1]));
+    _mm_storeu_si128(dst + 1, _mm_packs_epi32(words[2], words[3]));
+  }
+  packInstancesScalar(InstanceFormat::eSnorm16, in, out, i, end);
+}
+
+__attribute__((target("avx,f16c"))) inline void
+packHalfF16c(const float *in, uint16_t *out, uint32_t begin, uint32_t end) {
+  uint32_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 instances[4];
+    loadInstances4(in + 3 * size_t(i), instances);
+    __m128i *dst = reinterpret_cast<__m128i *>(out + 4 * size_t(i));
+    _mm_storeu_si128(dst, _mm256_cvtps_ph(_mm256_set_m128(instances[1],
+                                                          instances[0]),
+                                          _MM_FROUND_TO_NEAREST_INT));
+    _mm_storeu_si128(dst + 1,
+                     _mm256_cvtps_ph(_mm256_set_m128(instances[3],
+                                                     instances[2]),
+                                     _MM_FROUND_TO_NEAREST_INT));
+  }
+  packInstancesScalar(InstanceFormat::eHalf, in, out, i, end);
+}
+#endif
+
+inline bool hasF16c() {
+#ifdef BALL_SYSTEM_X86
+  static const bool supported = __builtin_cpu_supports("f16c");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+// Converts instances [begin, end) of an x, y, radius float stream into
+// format. out points at instance 0 of the packed stream.
+inline void packInstances(InstanceFormat format, const float *in, void *out,
+                          uint32_t begin, uint32_t end,
+                          SimdLevel simdLevel =
+                              BallSystem::detectSimdLevel()) {
+  uint16_t *packed = static_cast<uint16_t *>(out);
+#ifdef BALL_SYSTEM_X86
+  if (simdLevel != SimdLevel::eScalar) {
+    if (format == InstanceFormat::eSnorm16) {
+      packSnorm16Sse(in, packed, begin, end);
+      return;
+    }
+    if (hasF16c()) {
+      packHalfF16c(in, packed, begin, end);
+      return;
+    }
+  }
+#endif
+  packInstancesScalar(format, in, packed, begin, end);
+}
+
+// Largest difference between the simulation's floats and what the vertex
+// fetch decodes from the packed stream, in simulation units (2 units span
+// the window).
+inline InstancePrecision measureInstancePrecision(InstanceFormat format,
+                                                  const float *in,
+                                                  uint32_t count) {
+  InstancePrecision precision{0.0f, 0.0f};
+  if (format == InstanceFormat::eFloat32) {
+    return precision;
+  }
+  std::vector<uint16_t> packed(4 * size_t(count));
+  packInstances(format, in, packed.data(), 0, count);
+  for (uint32_t i = 0; i < count; i++) {
+    for (uint32_t c = 0; c < 3; c++) {
+      uint16_t word = packed[4 * i + c];
+      float decoded = format == InstanceFormat::eHalf
+                          ? halfToFloat(word)
+                          : snorm16ToFloat(int16_t(word));
+      float error = std::fabs(decoded - in[3 * i + c]);
+      float &maxError =
+          c < 2 ? precision.maxPositionError : precision.maxRadiusError;
+      maxError = std::max(maxError, error);
+    }
+  }
+  return precision;
+}
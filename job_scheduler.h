@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkerStats {
+  uint64_t jobs;
+  uint64_t steals;
+  double busySeconds;
+  double utilization;
+};
+
+// Small work-stealing pool. parallelFor() splits a range into chunks and
+// deals them in contiguous slices, one per participating worker. Each
+// worker claims chunks from its own slice with an atomic counter and, once
+// that runs dry, claims from the other slices; no locks are taken per
+// chunk. Idle workers sleep on a condition variable. The calling thread
+// acts as worker 0, so a scheduler with one thread spawns nothing, and
+// ranges too small to pay for waking workers run inline.
+class JobScheduler {
+public:
+  using RangeFunction =
+      std::function<void(uint32_t begin, uint32_t end, uint32_t worker)>;
+
+private:
+  // Each slice sits on its own cache line so claims by different workers
+  // do not contend.
+  struct alignas(64) Worker {
+    std::atomic<uint32_t> nextChunk{0};
+    uint32_t endChunk = 0;
+    std::atomic<uint64_t> jobCount{0};
+    std::atomic<uint64_t> stealCount{0};
+    std::atomic<uint64_t> busyNanoseconds{0};
+  };
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<std::thread> m_threads;
+  // The job of the current parallelFor(); written before m_generation is
+  // bumped under m_wakeMutex, so workers read it after the wake.
+  const RangeFunction *m_function = nullptr;
+  uint32_t m_count = 0;
+  uint32_t m_chunkSize = 1;
+  uint32_t m_sliceCount = 0;
+  std::mutex m_wakeMutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  uint64_t m_generation = 0;
+  // Workers may only join while the job is open; the caller closes it and
+  // then waits for the joined ones to leave, so no worker can still be
+  // claiming when the slices are reset for the next job.
+  bool m_open = false;
+  std::atomic<uint32_t> m_active{0};
+  bool m_quit = false;
+  std::chrono::time_point<std::chrono::steady_clock> m_statsStart;
+  bool claim(uint32_t slice, uint32_t &chunk) {
+    Worker &worker = *m_workers[slice];
+    if (worker.nextChunk.load(std::memory_order_relaxed) >= worker.endChunk) {
+      return false;
+    }
+    chunk = worker.nextChunk.fetch_add(1, std::memory_order_relaxed);
+    return chunk < worker.endChunk;
+  };
+  void runJobs(uint32_t index) {
+    Worker &worker = *m_workers[index];
+    uint64_t busy = 0;
+    uint64_t jobs = 0;
+    uint64_t steals = 0;
+    for (uint32_t i = 0; i < m_sliceCount; i++) {
+      // Own slice first, then the others starting with the next one.
+      uint32_t slice = (index + i) % m_sliceCount;
+      uint32_t chunk;
+      while (claim(slice, chunk)) {
+        uint32_t begin = chunk * m_chunkSize;
+        auto start = std::chrono::steady_clock::now();
+        (*m_function)(begin, std::min(begin + m_chunkSize, m_count), index);
+        busy += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+        jobs++;
+        steals += slice != index;
+      }
+    }
+    worker.busyNanoseconds.fetch_add(busy, std::memory_order_relaxed);
+    worker.jobCount.fetch_add(jobs, std::memory_order_relaxed);
+    worker.stealCount.fetch_add(steals, std::memory_order_relaxed);
+  };
+  void workerLoop(uint32_t index) {
+    uint64_t seenGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_wake.wait(lock, [&] {
+          return m_quit || (m_generation != seenGeneration && m_open);
+        });
+        if (m_quit) {
+          return;
+        }
+        seenGeneration = m_generation;
+        m_active.fetch_add(1, std::memory_order_relaxed);
+      }
+      runJobs(index);
+      {
+        std::lock_guard<std::mutex> lock(m_wakeMutex);
+        if (m_active.fetch_sub(1, std::memory_order_release) != 1) {
+          continue;
+        }
+      }
+      m_done.notify_one();
+    }
+  };
+  void runInline(uint32_t count, const RangeFunction &function) {
+    auto start = std::chrono::steady_clock::now();
+    function(0, count, 0);
+    m_workers[0]->busyNanoseconds.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count(),
+        std::memory_order_relaxed);
+    m_workers[0]->jobCount.fetch_add(1, std::memory_order_relaxed);
+  };
+
+public:
+  JobScheduler(uint32_t threadCount = std::thread::hardware_concurrency()) {
+    threadCount = std::max(threadCount, 1u);
+    for (uint32_t i = 0; i < threadCount; i++) {
+      m_workers.push_back(std::make_unique<Worker>());
+    }
+    for (uint32_t i = 1; i < threadCount; i++) {
+      m_threads.emplace_back(&JobScheduler::workerLoop, this, i);
+    }
+    m_statsStart = std::chrono::steady_clock::now();
+  };
+  ~JobScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(m_wakeMutex);
+      m_quit = true;
+    }
+    m_wake.notify_all();
+    for (auto &thread : m_threads) {
+      thread.join();
+    }
+  };
+  JobScheduler(const JobScheduler &) = delete;
+  JobScheduler &operator=(const JobScheduler &) = delete;
+  uint32_t threadCount() { return m_workers.size(); };
+  // Runs function over [0, count) in chunks of chunkSize and returns once
+  // every chunk has finished. Only as many workers as get minPerWorker
+  // items each take part; with fewer than two the range runs inline on
+  // the caller. Not reentrant.
+  void parallelFor(uint32_t count, uint32_t chunkSize,
+                   const RangeFunction &function, uint32_t minPerWorker = 1) {
+    if (count == 0) {
+      return;
+    }
+    chunkSize = std::max(chunkSize, 1u);
+    uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+    uint32_t participants = std::min<uint32_t>(
+        {uint32_t(m_workers.size()), chunkCount,
+         count / std::max(minPerWorker, 1u)});
+    if (participants <= 1) {
+      runInline(count, function);
+      return;
+    }
+    // Contiguous slices, so each worker starts on its own part of memory
+    // and only steals once it runs dry.
+    uint32_t perWorker = (chunkCount + participants - 1) / participants;
+    for (uint32_t w = 0; w < participants; w++) {
+      m_workers[w]->nextChunk.store(std::min(w * perWorker, chunkCount),
+                                    std::memory_order_relaxed);
+      m_workers[w]->endChunk = std::min((w + 1) * perWorker, chunkCount);
+    }
+    m_function = &function;
+    m_count = count;
+    m_chunkSize = chunkSize;
+    m_sliceCount = participants;
+    {
+      std::lock_guard<std::mutex> lock(m_wakeMutex);
+      m_generation++;
+      m_open = true;
+    }
+    for (uint32_t w = 1; w < participants; w++) {
+      m_wake.notify_one();
+    }
+    runJobs(0);
+    std::unique_lock<std::mutex> lock(m_wakeMutex);
+    m_open = false;
+    m_done.wait(lock, [&] {
+      return m_active.load(std::memory_order_acquire) == 0;
+    });
+  };
+  std::vector<WorkerStats> stats() {
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - m_statsStart)
+                         .count();
+    std::vector<WorkerStats> result;
+    for (const auto &worker : m_workers) {
+      WorkerStats stats{};
+      stats.jobs = worker->jobCount.load(std::memory_order_relaxed);
+      stats.steals = worker->stealCount.load(std::memory_order_relaxed);
+      stats.busySeconds =
+          worker->busyNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+      stats.utilization = elapsed > 0.0 ? stats.busySeconds / elapsed : 0.0;
+      result.push_back(stats);
+    }
+    return result;
+  };
+  void resetStats() {
+    for (auto &worker : m_workers) {
+      worker->jobCount.store(0, std::memory_order_relaxed);
+      worker->stealCount.store(0, std::memory_order_relaxed);
+      worker->busyNanoseconds.store(0, std::memory_order_relaxed);
+    }
+    m_statsStart = std::chrono::steady_clock::now();
+  };
+};
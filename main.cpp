@@ -1,591 +1,582 @@
-#define VMA_IMPLEMENTATION
-#define VMA_VULKAN_VERSION 1002000
-#include <vk_mem_alloc.h>
-#include <vulkan/vulkan.hpp>
-#define GLFW_INCLUDE_VULKAN
-#include "frag.h"
-#include "vert.h"
-#include <GLFW/glfw3.h>
+#include "ball_system.h"
+#include "profiler.h"
+#include "simulation_clock.h"
+#include "scene_file.h"
+#include "simulation_thread.h"
+#include "vulkan_renderer.h"
+#include <algorithm>
 #include <chrono>
-#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
-#define HEIGHT 1000
-#define WIDTH 1000
-#define MAX_FRAMES_IN_FLIGHT 3
+#define DEFAULT_PIPELINE_CACHE_PATH "pipeline_cache.bin"
+#define DEFAULT_MEMORY_STATS_PATH "memory_stats.json"
+// Upward velocity added to every ball by the K key.
+#define KICK_IMPULSE 1.0f
 
-class VulkanRenderer {
-private:
-  uint8_t m_currentFrame = 0;
-  GLFWwindow *m_window;
-  vk::Instance m_instance;
-  vk::PhysicalDevice m_physicalDevice;
-  vk::Device m_device;
-  VmaAllocator m_allocator;
-  vk::Queue m_queue;
-  vk::SurfaceKHR m_surface;
-  vk::SwapchainKHR m_swapchain;
-  std::vector<vk::Image> m_swapchainImages;
-  std::vector<vk::ImageView> m_swapchainImageViews;
-  vk::RenderPass m_renderPass;
-  vk::PipelineLayout m_pipelineLayout;
-  vk::Pipeline m_graphicsPipeline;
-  std::vector<vk::Framebuffer> m_framebuffers;
-  vk::CommandPool m_commandPool;
-  vk::CommandBuffer m_commandBuffer[MAX_FRAMES_IN_FLIGHT];
-  vk::Semaphore m_imageAvailableSemaphores[MAX_FRAMES_IN_FLIGHT];
-  vk::Semaphore m_renderFinishedSemaphores[MAX_FRAMES_IN_FLIGHT];
-  vk::Fence m_inFlightFences[MAX_FRAMES_IN_FLIGHT];
-  vk::Buffer m_vertexBuffers[MAX_FRAMES_IN_FLIGHT];
-  VmaAllocation m_vertexBufferAllocations[MAX_FRAMES_IN_FLIGHT];
-  vk::Buffer m_indexBuffers[MAX_FRAMES_IN_FLIGHT];
-  VmaAllocation m_indexBufferAllocations[MAX_FRAMES_IN_FLIGHT];
-  vk::Buffer m_instanceBuffers[MAX_FRAMES_IN_FLIGHT];
-  VmaAllocation m_instanceBufferAllocations[MAX_FRAMES_IN_FLIGHT];
-  vk::Buffer m_stagingBuffers[MAX_FRAMES_IN_FLIGHT];
-  VmaAllocation m_stagingBufferAllocations[MAX_FRAMES_IN_FLIGHT];
-  void *m_mappedStagingBuffers[MAX_FRAMES_IN_FLIGHT];
-  float m_vertices[54];
-  uint32_t m_indices[78];
-  void initWindow() {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    m_window =
-        glfwCreateWindow(WIDTH, HEIGHT, "Vulkan Window", nullptr, nullptr);
-  };
-  void createInstance() {
-    vk::ApplicationInfo appInfo("VulkanApp", 1, "No Engine", 1,
-                                VK_API_VERSION_1_2);
-    uint32_t glfwExtensionCount = 0;
-    const char **glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-    std::vector<const char *> extensions(glfwExtensions,
-                                         glfwExtensions + glfwExtensionCount);
-    extensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
-    std::vector<const char *> layers = {"VK_LAYER_KHRONOS_validation"};
-    vk::InstanceCreateInfo createInfo(
-        vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR, &appInfo,
-        layers.size(), layers.data(), extensions.size(), extensions.data());
-    m_instance = vk::createInstance(createInfo);
-  };
-  void createPhysicalDevice() {
-    std::vector<vk::PhysicalDevice> devices =
-        m_instance.enumeratePhysicalDevices();
-    for (const auto &deviceType :
-         {vk::PhysicalDeviceType::eDiscreteGpu,
-          vk::PhysicalDeviceType::eIntegratedGpu,
-          vk::PhysicalDeviceType::eVirtualGpu, vk::PhysicalDeviceType::eCpu}) {
-      for (const auto &device : devices) {
-        if (device.getProperties().deviceType == deviceType) {
-          m_physicalDevice = device;
-          break;
-        }
+int main(int argc, char **argv) {
+  RendererSettings settings;
+  settings.pipelineCachePath = DEFAULT_PIPELINE_CACHE_PATH;
+  uint64_t frameLimit = 0;
+  uint32_t ballCount = 1;
+  uint32_t seed = 1;
+  uint32_t threadCount = std::thread::hardware_concurrency();
+  bool collisions = false;
+  bool sleeping = false;
+  float sleepSpeed = DEFAULT_SLEEP_SPEED;
+  float restitution = 1.0f;
+  float damping = 0.0f;
+  uint32_t reorderInterval = 0;
+  std::string scenePath;
+  std::string checkpointPath;
+  uint64_t checkpointInterval = 0;
+  std::string recordPath;
+  std::string replayPath;
+  std::string pacingLogPath;
+  double stepRate = DEFAULT_STEP_RATE;
+  uint32_t maxSubsteps = DEFAULT_MAX_SUBSTEPS;
+  uint32_t stepsPerFrame = 0;
+  uint64_t simulateSteps = 0;
+  std::string profilePrefix;
+  float zoom = 1.0f;
+  bool pipelined = true;
+  uint64_t memoryReportInterval = 0;
+  std::string memoryStatsPath;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      settings.headless = true;
+    } else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+      settings.framesInFlight = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--targets") == 0 && i + 1 < argc) {
+      settings.offscreenTargetCount = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frameLimit = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc) {
+      ballCount = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threadCount = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--collisions") == 0) {
+      collisions = true;
+    } else if (strcmp(argv[i], "--sleep") == 0) {
+      sleeping = true;
+    } else if (strcmp(argv[i], "--sleep-speed") == 0 && i + 1 < argc) {
+      sleepSpeed = std::strtof(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--restitution") == 0 && i + 1 < argc) {
+      restitution = std::strtof(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--damping") == 0 && i + 1 < argc) {
+      damping = std::strtof(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+      reorderInterval = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+      scenePath = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpointPath = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-interval") == 0 &&
+               i + 1 < argc) {
+      checkpointInterval = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      recordPath = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replayPath = argv[++i];
+    } else if (strcmp(argv[i], "--gpu-physics") == 0) {
+      settings.gpuPhysics = true;
+    } else if (strcmp(argv[i], "--step-rate") == 0 && i + 1 < argc) {
+      stepRate = std::max(1.0, std::strtod(argv[++i], nullptr));
+    } else if (strcmp(argv[i], "--max-substeps") == 0 && i + 1 < argc) {
+      maxSubsteps = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--steps-per-frame") == 0 && i + 1 < argc) {
+      stepsPerFrame = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+      simulateSteps = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePrefix = argv[++i];
+    } else if (strcmp(argv[i], "--pipeline-cache") == 0 && i + 1 < argc) {
+      settings.pipelineCachePath = argv[++i];
+    } else if (strcmp(argv[i], "--shader-dir") == 0 && i + 1 < argc) {
+      settings.shaderDirectory = argv[++i];
+    } else if (strcmp(argv[i], "--instance-format") == 0 && i + 1 < argc) {
+      const char *format = argv[++i];
+      if (strcmp(format, "float") == 0 || strcmp(format, "float32") == 0) {
+        settings.instanceFormat = InstanceFormat::eFloat32;
+      } else if (strcmp(format, "half") == 0) {
+        settings.instanceFormat = InstanceFormat::eHalf;
+      } else if (strcmp(format, "snorm16") == 0) {
+        settings.instanceFormat = InstanceFormat::eSnorm16;
+      } else {
+        fprintf(stderr, "--instance-format takes float, half or snorm16\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--sdf") == 0) {
+      settings.renderMode = RenderMode::eImpostor;
+    } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+      settings.recordThreads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--record-batches") == 0 && i + 1 < argc) {
+      settings.recordBatches = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      settings.capturePath = argv[++i];
+    } else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc) {
+      const char *format = argv[++i];
+      if (strcmp(format, "ppm") == 0) {
+        settings.captureFormat = CaptureFormat::ePpm;
+      } else if (strcmp(format, "raw") == 0) {
+        settings.captureFormat = CaptureFormat::eRaw;
+      } else if (strcmp(format, "mmap") == 0) {
+        settings.captureFormat = CaptureFormat::eMapped;
+      } else {
+        fprintf(stderr, "--capture-format takes ppm, raw or mmap\n");
+        return 1;
       }
+    } else if (strcmp(argv[i], "--capture-interval") == 0 && i + 1 < argc) {
+      settings.captureInterval = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--capture-limit") == 0 && i + 1 < argc) {
+      settings.captureLimit = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--serial") == 0) {
+      pipelined = false;
+    } else if (strcmp(argv[i], "--cull") == 0) {
+      settings.gpuCulling = true;
+    } else if (strcmp(argv[i], "--cull-min-pixels") == 0 && i + 1 < argc) {
+      settings.cullMinPixels = std::strtof(argv[++i], nullptr);
+    } else if (strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+      zoom = std::max(0.01f, std::strtof(argv[++i], nullptr));
+    } else if (strcmp(argv[i], "--memory-report") == 0 && i + 1 < argc) {
+      memoryReportInterval = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--memory-stats") == 0 && i + 1 < argc) {
+      memoryStatsPath = argv[++i];
+    } else if (strcmp(argv[i], "--fixed-pacing") == 0) {
+      settings.adaptivePacing = false;
+    } else if (strcmp(argv[i], "--pacing-log") == 0 && i + 1 < argc) {
+      pacingLogPath = argv[++i];
+    } else if (strcmp(argv[i], "--no-transfer-queue") == 0) {
+      settings.transferQueue = false;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--headless] [--frames-in-flight N] [--targets N] "
+              "[--frames N] "
+              "[--balls N] [--seed N] [--threads N] [--collisions] "
+              "[--sleep] [--sleep-speed V] [--restitution E] [--damping D] "
+              "[--reorder STEPS] [--scene FILE] [--checkpoint FILE] "
+              "[--checkpoint-interval STEPS] [--record FILE] "
+              "[--replay FILE] [--gpu-physics] [--step-rate HZ] "
+              "[--max-substeps N] "
+              "[--steps-per-frame N] [--simulate STEPS] "
+              "[--profile PREFIX] [--pipeline-cache FILE] "
+              "[--shader-dir DIR] [--no-transfer-queue] [--sdf] [--cull] "
+              "[--cull-min-pixels N] [--zoom Z] [--serial] "
+              "[--record-threads N] [--record-batches N] [--capture PATH] "
+              "[--capture-format ppm|raw|mmap] [--capture-interval N] "
+              "[--capture-limit N] [--memory-report N] "
+              "[--memory-stats FILE] [--fixed-pacing] [--pacing-log FILE] "
+              "[--instance-format float|half|snorm16]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  // Replay streams recorded frames into the renderer and runs no physics.
+  std::unique_ptr<ReplayReader> replay;
+  if (!replayPath.empty()) {
+    replay = std::make_unique<ReplayReader>(replayPath);
+    printf("Replaying %llu frames of %u balls from %s\n",
+           static_cast<unsigned long long>(replay->frameCount()),
+           replay->ballCount(), replayPath.c_str());
+    if (frameLimit == 0 && settings.headless) {
+      frameLimit = replay->frameCount();
     }
+    settings.gpuPhysics = false;
+    collisions = false;
+    checkpointPath.clear();
+    recordPath.clear();
+  }
+  if (settings.headless && frameLimit == 0) {
+    frameLimit = 1000;
+  }
+  if (settings.gpuPhysics && collisions) {
+    fprintf(stderr, "--collisions is not supported with --gpu-physics\n");
+    collisions = false;
+  }
+  // The compute pass writes float32 instances in place.
+  if (settings.gpuPhysics &&
+      settings.instanceFormat != InstanceFormat::eFloat32) {
+    fprintf(stderr, "--instance-format %s is not supported with "
+                    "--gpu-physics, using float\n",
+            instanceFormatName(settings.instanceFormat));
+    settings.instanceFormat = InstanceFormat::eFloat32;
+  }
+  if (settings.gpuPhysics && (!checkpointPath.empty() || !recordPath.empty())) {
+    fprintf(stderr, "--checkpoint and --record are not supported with "
+                    "--gpu-physics\n");
+    checkpointPath.clear();
+    recordPath.clear();
+  }
+  JobScheduler scheduler(threadCount);
+  BallSystem balls;
+  if (!scenePath.empty()) {
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    MappedFile sceneFile(scenePath);
+    balls.loadState(mapSceneFile(sceneFile, scenePath), &scheduler);
+    printf("Loaded %u balls at step %llu from %s in %.1f ms\n",
+           balls.size(), static_cast<unsigned long long>(balls.getStepCount()),
+           scenePath.c_str(),
+           std::chrono::duration<double, std::milli>(
+               std::chrono::high_resolution_clock::now() - loadStart)
+               .count());
+  } else if (!replay) {
+    spawnBalls(balls, ballCount, seed);
+  }
+  balls.setCollisions(collisions);
+  balls.setRestitution(restitution);
+  balls.setDamping(damping);
+  balls.setSleeping(sleeping && !settings.gpuPhysics, sleepSpeed);
+  // GPU physics keeps the state on the device in spawn order.
+  balls.setReorderInterval(settings.gpuPhysics ? 0 : reorderInterval);
+  if (balls.getSleeping() && restitution >= 1.0f && damping <= 0.0f) {
+    fprintf(stderr, "--sleep without --restitution below 1 or --damping: "
+                    "balls never come to rest\n");
+  }
+  SimulationClock clock(stepRate, maxSubsteps);
+  std::unique_ptr<CheckpointWriter> checkpoint;
+  if (!checkpointPath.empty()) {
+    checkpoint =
+        std::make_unique<CheckpointWriter>(checkpointPath, checkpointInterval);
+  }
+  // Checkpoints the final state, so the run can be resumed with --scene.
+  auto finishCheckpoint = [&]() {
+    if (!checkpoint) {
+      return;
+    }
+    checkpoint->submit(balls);
+    checkpoint->drain();
+    CheckpointStats stats = checkpoint->getStats();
+    printf("checkpoint: %llu written to %s (%llu superseded, %llu failed), "
+           "last in %.1f ms\n",
+           static_cast<unsigned long long>(stats.written),
+           checkpoint->getPath().c_str(),
+           static_cast<unsigned long long>(stats.superseded),
+           static_cast<unsigned long long>(stats.failed),
+           stats.lastMilliseconds);
   };
-  void createLogicalDevice() {
-    float queuePriority = 1.0f;
-    vk::DeviceQueueCreateInfo queueCreateInfo({}, 0, 1, &queuePriority);
-    std::vector<const char *> deviceExtensions;
-    std::vector<vk::ExtensionProperties> supportedExtensions =
-        m_physicalDevice.enumerateDeviceExtensionProperties();
-    for (const auto &extension :
-         {VK_KHR_SWAPCHAIN_EXTENSION_NAME, "VK_KHR_portability_subset"}) {
-      bool found = false;
-      for (const auto &supportedExtension : supportedExtensions) {
-        if (strcmp(extension, supportedExtension.extensionName) == 0) {
-          found = true;
-          break;
-        }
-      }
-      if (found) {
-        deviceExtensions.push_back(extension);
+  if (simulateSteps > 0) {
+    // Batch mode: run a fixed number of steps without a renderer and print
+    // a checksum of the final state so separate runs can be compared.
+    uint64_t pairsColliding = 0;
+    uint64_t pairIndexDistance = 0;
+    auto simulateStart = std::chrono::high_resolution_clock::now();
+    for (uint64_t step = 0; step < simulateSteps; step++) {
+      balls.step(clock.getStepSeconds(), &scheduler);
+      pairsColliding += balls.getBroadphaseStats().pairsColliding;
+      pairIndexDistance += balls.getBroadphaseStats().pairIndexDistance;
+      if (checkpoint) {
+        checkpoint->update(balls);
       }
     }
-    vk::DeviceCreateInfo createInfo{};
-    createInfo.queueCreateInfoCount = 1;
-    createInfo.pQueueCreateInfos = &queueCreateInfo;
-    createInfo.enabledExtensionCount = deviceExtensions.size();
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
-    m_device = m_physicalDevice.createDevice(createInfo);
-    m_queue = m_device.getQueue(0, 0);
-  };
-  void createAllocator() {
-    VmaAllocatorCreateInfo allocatorInfo{};
-    allocatorInfo.physicalDevice = m_physicalDevice;
-    allocatorInfo.device = m_device;
-    allocatorInfo.instance = m_instance;
-    allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
-    vmaCreateAllocator(&allocatorInfo, &m_allocator);
-  };
-  void createSurface() {
-    VkSurfaceKHR surface;
-    if (glfwCreateWindowSurface(m_instance, m_window, nullptr, &surface) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("Failed to create window surface");
+    double seconds =
+        std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - simulateStart)
+            .count();
+    printf("%llu steps in %.3f s, checksum %016llx\n",
+           static_cast<unsigned long long>(balls.getStepCount()), seconds,
+           static_cast<unsigned long long>(balls.checksum()));
+    if (pairsColliding > 0) {
+      printf("colliding pairs are %.0f slots apart on average\n",
+             double(pairIndexDistance) / pairsColliding);
     }
-    m_surface = surface;
-  };
-  void createSwapchain() {
-    vk::SurfaceCapabilitiesKHR surfaceCapabilities =
-        m_physicalDevice.getSurfaceCapabilitiesKHR(m_surface);
-    vk::SurfaceFormatKHR surfaceFormat = vk::Format::eB8G8R8A8Srgb;
-    vk::PresentModeKHR presentMode = vk::PresentModeKHR::eFifo;
-    vk::Extent2D extent = vk::Extent2D{WIDTH, HEIGHT};
-    vk::SwapchainCreateInfoKHR createInfo(
-        {}, m_surface, surfaceCapabilities.minImageCount, surfaceFormat.format,
-        surfaceFormat.colorSpace, extent, 1,
-        vk::ImageUsageFlagBits::eColorAttachment, vk::SharingMode::eExclusive,
-        0, nullptr, surfaceCapabilities.currentTransform,
-        vk::CompositeAlphaFlagBitsKHR::eOpaque, presentMode, VK_TRUE);
-    m_swapchain = m_device.createSwapchainKHR(createInfo);
-  };
-  void createImageViews() {
-    m_swapchainImages = m_device.getSwapchainImagesKHR(m_swapchain);
-    for (const auto &image : m_swapchainImages) {
-      vk::ImageViewCreateInfo createInfo(
-          {}, image, vk::ImageViewType::e2D, vk::Format::eB8G8R8A8Srgb,
-          vk::ComponentMapping{},
-          vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0,
-                                    1});
-      m_swapchainImageViews.push_back(m_device.createImageView(createInfo));
+    if (balls.getReorderInterval() > 0) {
+      ReorderStats reorder = balls.getReorderStats();
+      printf("reorder: %llu sorts, %.3f ms each on average\n",
+             static_cast<unsigned long long>(reorder.reorders),
+             reorder.reorders > 0
+                 ? reorder.totalMilliseconds / reorder.reorders
+                 : 0.0);
     }
-  };
-  void createRenderPass() {
-    vk::AttachmentDescription attachmentDescription{};
-    attachmentDescription.format = vk::Format::eB8G8R8A8Srgb;
-    attachmentDescription.samples = vk::SampleCountFlagBits::e1;
-    attachmentDescription.loadOp = vk::AttachmentLoadOp::eClear;
-    attachmentDescription.storeOp = vk::AttachmentStoreOp::eStore;
-    attachmentDescription.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
-    attachmentDescription.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
-    attachmentDescription.initialLayout = vk::ImageLayout::eUndefined;
-    attachmentDescription.finalLayout = vk::ImageLayout::ePresentSrcKHR;
-    vk::AttachmentReference colorAttachmentRef(
-        0, vk::ImageLayout::eColorAttachmentOptimal);
-    vk::SubpassDescription subpassDescription(
-        {}, vk::PipelineBindPoint::eGraphics, 0, nullptr, 1,
-        &colorAttachmentRef, nullptr, nullptr, 0, nullptr);
-    vk::SubpassDependency dependency(
-        VK_SUBPASS_EXTERNAL, 0,
-        vk::PipelineStageFlagBits::eColorAttachmentOutput,
-        vk::PipelineStageFlagBits::eColorAttachmentOutput, {},
-        vk::AccessFlagBits::eColorAttachmentWrite,
-        vk::DependencyFlagBits::eByRegion);
-    vk::RenderPassCreateInfo createInfo({}, 1, &attachmentDescription, 1,
-                                        &subpassDescription, 1, &dependency);
-    m_renderPass = m_device.createRenderPass(createInfo);
+    finishCheckpoint();
+    return 0;
   }
-  void createGraphicsPipeline() {
-    vk::ShaderModuleCreateInfo vertShaderCreateInfo{};
-    vertShaderCreateInfo.codeSize = sizeof(vert_spv);
-    vertShaderCreateInfo.pCode = reinterpret_cast<const uint32_t *>(vert_spv);
-    vk::ShaderModule vertShaderModule =
-        m_device.createShaderModule(vertShaderCreateInfo);
-    vk::ShaderModuleCreateInfo fragShaderCreateInfo{};
-    fragShaderCreateInfo.codeSize = sizeof(frag_spv);
-    fragShaderCreateInfo.pCode = reinterpret_cast<const uint32_t *>(frag_spv);
-    vk::ShaderModule fragShaderModule =
-        m_device.createShaderModule(fragShaderCreateInfo);
-    vk::PipelineShaderStageCreateInfo vertShaderStageInfo(
-        {}, vk::ShaderStageFlagBits::eVertex, vertShaderModule, "main");
-    vk::PipelineShaderStageCreateInfo fragShaderStageInfo(
-        {}, vk::ShaderStageFlagBits::eFragment, fragShaderModule, "main");
-    vk::PipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
-                                                        fragShaderStageInfo};
-    vk::VertexInputBindingDescription bindingDescription[2];
-    bindingDescription[0].binding = 0;
-    bindingDescription[0].stride = sizeof(float) * 2;
-    bindingDescription[0].inputRate = vk::VertexInputRate::eVertex;
-    bindingDescription[1].binding = 1;
-    bindingDescription[1].stride = sizeof(float) * 3;
-    bindingDescription[1].inputRate = vk::VertexInputRate::eInstance;
-    vk::VertexInputAttributeDescription attributeDescription[2];
-    attributeDescription[0].binding = 0;
-    attributeDescription[0].location = 0;
-    attributeDescription[0].format = vk::Format::eR32G32Sfloat;
-    attributeDescription[0].offset = 0;
-    attributeDescription[1].binding = 1;
-    attributeDescription[1].location = 1;
-    attributeDescription[1].format = vk::Format::eR32G32B32Sfloat;
-    attributeDescription[1].offset = 0;
-    vk::PipelineVertexInputStateCreateInfo vertexInputInfo{};
-    vertexInputInfo.vertexBindingDescriptionCount = 2;
-    vertexInputInfo.pVertexBindingDescriptions = bindingDescription;
-    vertexInputInfo.vertexAttributeDescriptionCount = 2;
-    vertexInputInfo.pVertexAttributeDescriptions = attributeDescription;
-    vk::PipelineInputAssemblyStateCreateInfo inputAssemblyInfo(
-        {}, vk::PrimitiveTopology::eTriangleList, VK_FALSE);
-    vk::Viewport viewport(0.0f, 0.0f, WIDTH, HEIGHT, 0.0f, 1.0f);
-    vk::Rect2D scissor({0, 0}, {WIDTH, HEIGHT});
-    vk::PipelineViewportStateCreateInfo viewportStateInfo({}, 1, &viewport, 1,
-                                                          &scissor);
-    vk::PipelineRasterizationStateCreateInfo rasterizerInfo(
-        {}, VK_FALSE, VK_FALSE, vk::PolygonMode::eFill,
-        vk::CullModeFlagBits::eNone, vk::FrontFace::eCounterClockwise, VK_FALSE,
-        0.0f, 0.0f, 0.0f, 1.0f);
-    vk::PipelineMultisampleStateCreateInfo multisamplingInfo;
-    vk::PipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
-        vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
-        vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    vk::PipelineColorBlendStateCreateInfo colorBlendingInfo(
-        {}, VK_FALSE, vk::LogicOp::eCopy, 1, &colorBlendAttachment);
-    vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
-    m_pipelineLayout = m_device.createPipelineLayout(pipelineLayoutInfo);
-    vk::GraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
-    pipelineInfo.pViewportState = &viewportStateInfo;
-    pipelineInfo.pRasterizationState = &rasterizerInfo;
-    pipelineInfo.pMultisampleState = &multisamplingInfo;
-    pipelineInfo.pColorBlendState = &colorBlendingInfo;
-    pipelineInfo.layout = m_pipelineLayout;
-    pipelineInfo.renderPass = m_renderPass;
-    pipelineInfo.subpass = 0;
-    m_graphicsPipeline =
-        m_device.createGraphicsPipeline({}, pipelineInfo).value;
-    m_device.destroyShaderModule(vertShaderModule);
-    m_device.destroyShaderModule(fragShaderModule);
-  };
-  void createFramebuffers() {
-    for (const auto &imageView : m_swapchainImageViews) {
-      vk::FramebufferCreateInfo createInfo({}, m_renderPass, 1, &imageView,
-                                           WIDTH, HEIGHT, 1);
-      m_framebuffers.push_back(m_device.createFramebuffer(createInfo));
-    }
-  };
-  void createCommandPool() {
-    vk::CommandPoolCreateInfo createInfo{};
-    createInfo.queueFamilyIndex = 0;
-    createInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
-    m_commandPool = m_device.createCommandPool(createInfo);
-  };
-  void createCommandBuffers() {
-    vk::CommandBufferAllocateInfo allocateInfo(
-        m_commandPool, vk::CommandBufferLevel::ePrimary, MAX_FRAMES_IN_FLIGHT);
-    std::vector<vk::CommandBuffer> buffers =
-        m_device.allocateCommandBuffers(allocateInfo);
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      m_commandBuffer[i] = buffers[i];
+  settings.maxInstances = replay ? replay->ballCount() : balls.size();
+  Profiler profiler;
+  profiler.setEnabled(!profilePrefix.empty());
+  settings.profiler = &profiler;
+  auto startupBegin = std::chrono::high_resolution_clock::now();
+  VulkanRenderer app(settings);
+  app.setView(0.0f, 0.0f, zoom);
+  printf("Startup in %.1f ms (pipeline cache %s, uploads on %s queue):",
+         std::chrono::duration<double, std::milli>(
+             std::chrono::high_resolution_clock::now() - startupBegin)
+             .count(),
+         app.pipelineCacheHit() ? "hit" : "miss",
+         app.usesTransferQueue() ? "transfer" : "graphics");
+  for (const auto &stage : app.getStartupStages()) {
+    printf(" %s %.1f ms", stage.name, stage.milliseconds);
+  }
+  printf("\n");
+  if (app.usesGpuPhysics()) {
+    app.initGpuPhysics(balls.arrays(), balls.size(), balls.getGravity());
+    printf("Simulating %u balls on the GPU\n", balls.size());
+  } else {
+    printf("Simulating %u balls (%s, %u threads), instance ring %s\n",
+           balls.size(), simdLevelName(balls.getSimdLevel()),
+           scheduler.threadCount(),
+           app.instanceRingHostVisible() ? "mapped" : "staged");
+  }
+  // Simulating frame N + 1 overlaps recording frame N unless --serial asks
+  // for the original lock-step loop.
+  std::unique_ptr<SimulationThread> simulation;
+  if (!app.usesGpuPhysics() && !replay && pipelined) {
+    simulation = std::make_unique<SimulationThread>(
+        balls, clock, &scheduler, &profiler, stepsPerFrame, checkpoint.get());
+  }
+  std::unique_ptr<ReplayRecorder> recorder;
+  if (!recordPath.empty()) {
+    recorder = std::make_unique<ReplayRecorder>(recordPath, balls.size(),
+                                                clock.getStepSeconds());
+  }
+  uint64_t frames = 0;
+  uint64_t pairsTested = 0;
+  uint64_t pairsColliding = 0;
+  uint64_t pairIndexDistance = 0;
+  uint64_t steps = 0;
+  uint32_t sleepingBalls = 0;
+  std::vector<InstanceRange> dirtyRanges;
+  FILE *pacingLog = nullptr;
+  if (!pacingLogPath.empty()) {
+    pacingLog = fopen(pacingLogPath.c_str(), "w");
+    if (pacingLog == nullptr) {
+      fprintf(stderr, "Failed to open %s\n", pacingLogPath.c_str());
+    } else {
+      fprintf(pacingLog, "frame,depth,wait_us\n");
     }
-  };
-  void createSyncObjects() {
-    vk::SemaphoreCreateInfo semaphoreInfo{};
-    vk::FenceCreateInfo fenceInfo{vk::FenceCreateFlagBits::eSignaled};
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      m_imageAvailableSemaphores[i] = m_device.createSemaphore(semaphoreInfo);
-      m_renderFinishedSemaphores[i] = m_device.createSemaphore(semaphoreInfo);
-      m_inFlightFences[i] = m_device.createFence(fenceInfo);
+  }
+  // One CSV line per frame, written once the frame's drawFrame() returned.
+  auto logPacing = [&]() {
+    if (pacingLog != nullptr && frames > 0) {
+      FramePacingStats pacing = app.getFramePacing();
+      fprintf(pacingLog, "%llu,%u,%.1f\n",
+              static_cast<unsigned long long>(frames - 1), pacing.depth,
+              pacing.lastWaitMicroseconds);
     }
   };
-  void createVertexBuffers() {
-    VmaAllocationCreateInfo allocInfo{};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    vk::BufferCreateInfo bufferInfo{};
-    bufferInfo.size = sizeof(float) * 54;
-    bufferInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer |
-                       vk::BufferUsageFlagBits::eTransferDst;
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      vmaCreateBuffer(
-          m_allocator, reinterpret_cast<VkBufferCreateInfo *>(&bufferInfo),
-          &allocInfo, reinterpret_cast<VkBuffer *>(&m_vertexBuffers[i]),
-          &m_vertexBufferAllocations[i], nullptr);
+  auto startTime = std::chrono::high_resolution_clock::now();
+  while (!app.shouldQuit() && (frameLimit == 0 || frames < frameLimit)) {
+    logPacing();
+    app.pollEvents();
+    if (app.keyPressed(GLFW_KEY_P)) {
+      profiler.setEnabled(!profiler.isEnabled());
+      if (profilePrefix.empty()) {
+        profilePrefix = "profile";
+      }
+      printf("Profiling %s\n", profiler.isEnabled() ? "on" : "off");
     }
-  };
-  void createIndexBuffers() {
-    VmaAllocationCreateInfo allocInfo{};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    vk::BufferCreateInfo bufferInfo{};
-    bufferInfo.size = sizeof(uint32_t) * 78;
-    bufferInfo.usage = vk::BufferUsageFlagBits::eIndexBuffer |
-                       vk::BufferUsageFlagBits::eTransferDst;
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      vmaCreateBuffer(
-          m_allocator, reinterpret_cast<VkBufferCreateInfo *>(&bufferInfo),
-          &allocInfo, reinterpret_cast<VkBuffer *>(&m_indexBuffers[i]),
-          &m_indexBufferAllocations[i], nullptr);
+    if (app.keyPressed(GLFW_KEY_M)) {
+      app.setRenderMode(app.getRenderMode() == RenderMode::eMesh
+                            ? RenderMode::eImpostor
+                            : RenderMode::eMesh);
+      printf("Rendering %s\n", renderModeName(app.getRenderMode()));
     }
-  };
-  void createInstanceBuffers() {
-    VmaAllocationCreateInfo allocInfo{};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    vk::BufferCreateInfo bufferInfo{};
-    bufferInfo.size = sizeof(float) * 3;
-    bufferInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer |
-                       vk::BufferUsageFlagBits::eTransferDst;
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      vmaCreateBuffer(
-          m_allocator, reinterpret_cast<VkBufferCreateInfo *>(&bufferInfo),
-          &allocInfo, reinterpret_cast<VkBuffer *>(&m_instanceBuffers[i]),
-          &m_instanceBufferAllocations[i], nullptr);
+    if (app.keyPressed(GLFW_KEY_K) && !app.usesGpuPhysics()) {
+      if (simulation) {
+        simulation->applyImpulse(0.0f, KICK_IMPULSE);
+      } else {
+        balls.applyImpulse(0.0f, KICK_IMPULSE);
+      }
     }
-  };
-  void createStagingBuffers() {
-    VmaAllocationCreateInfo allocInfo{};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
-    allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT |
-                      VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-    vk::BufferCreateInfo bufferInfo{};
-    bufferInfo.size = sizeof(uint32_t) * 78;
-    bufferInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      VmaAllocationInfo info;
-      vmaCreateBuffer(
-          m_allocator, reinterpret_cast<VkBufferCreateInfo *>(&bufferInfo),
-          &allocInfo, reinterpret_cast<VkBuffer *>(&m_stagingBuffers[i]),
-          &m_stagingBufferAllocations[i], &info);
-      m_mappedStagingBuffers[i] = info.pMappedData;
+    if (app.keyPressed(GLFW_KEY_B)) {
+      std::string path = memoryStatsPath.empty() ? DEFAULT_MEMORY_STATS_PATH
+                                                 : memoryStatsPath;
+      if (app.writeMemoryStats(path)) {
+        printf("Wrote %s\n", path.c_str());
+      } else {
+        fprintf(stderr, "Failed to write memory stats %s\n", path.c_str());
+      }
     }
-  };
-  void generateVertices() {
-    for (uint32_t i = 0; i < 25; i++) {
-      m_vertices[2 * i] = std::cos(2 * M_PI * i / 25);
-      m_vertices[2 * i + 1] = std::sin(2 * M_PI * i / 25);
+    if (memoryReportInterval > 0 && frames % memoryReportInterval == 0) {
+      printMemoryTelemetry(stdout, app.getMemoryTelemetry());
     }
-    m_vertices[52] = 0.0f;
-    m_vertices[53] = 0.0f;
-  };
-  void generateIndices() {
-    for (uint32_t i = 0; i < 25; i++) {
-      m_indices[3 * i] = i;
-      m_indices[3 * i + 1] = (i + 1) % 25;
-      m_indices[3 * i + 2] = 26;
+    if (app.keyPressed(GLFW_KEY_EQUAL)) {
+      app.setView(0.0f, 0.0f, app.getZoom() * 1.25f);
     }
-  };
-  void transferVertexBuffers() {
-    m_commandBuffer[m_currentFrame].begin(
-        {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      memcpy(m_mappedStagingBuffers[i], m_vertices, sizeof(float) * 54);
-      vk::BufferCopy copyRegion(0, 0, sizeof(float) * 54);
-      m_commandBuffer[m_currentFrame].copyBuffer(
-          m_stagingBuffers[i], m_vertexBuffers[i], copyRegion);
+    if (app.keyPressed(GLFW_KEY_MINUS)) {
+      app.setView(0.0f, 0.0f, app.getZoom() / 1.25f);
     }
-    m_commandBuffer[m_currentFrame].end();
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer[m_currentFrame];
-    submitInfo.signalSemaphoreCount = 0;
-    submitInfo.waitSemaphoreCount = 0;
-    submitInfo.pWaitSemaphores = nullptr;
-    submitInfo.pSignalSemaphores = nullptr;
-    submitInfo.pWaitDstStageMask = nullptr;
-    m_queue.submit(submitInfo, nullptr);
-    m_queue.waitIdle();
-  };
-  void transferIndexBuffers() {
-    m_commandBuffer[m_currentFrame].begin(
-        {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      memcpy(m_mappedStagingBuffers[i], m_indices, sizeof(uint32_t) * 78);
-      vk::BufferCopy copyRegion(0, 0, sizeof(uint32_t) * 78);
-      m_commandBuffer[m_currentFrame].copyBuffer(m_stagingBuffers[i],
-                                                 m_indexBuffers[i], copyRegion);
+    profiler.beginFrame(frames);
+    if (replay) {
+      app.drawFrame(replay->frame(frames % replay->frameCount()),
+                    replay->ballCount());
+      frames++;
+      continue;
     }
-    m_commandBuffer[m_currentFrame].end();
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer[m_currentFrame];
-    submitInfo.signalSemaphoreCount = 0;
-    submitInfo.waitSemaphoreCount = 0;
-    submitInfo.pWaitSemaphores = nullptr;
-    submitInfo.pSignalSemaphores = nullptr;
-    submitInfo.pWaitDstStageMask = nullptr;
-    m_queue.submit(submitInfo, nullptr);
-    m_queue.waitIdle();
-  };
-
-public:
-  VulkanRenderer() {
-    initWindow();
-    createInstance();
-    createPhysicalDevice();
-    createLogicalDevice();
-    createAllocator();
-    createSurface();
-    createSwapchain();
-    createImageViews();
-    createRenderPass();
-    createGraphicsPipeline();
-    createFramebuffers();
-    createCommandPool();
-    createCommandBuffers();
-    createSyncObjects();
-    createVertexBuffers();
-    createIndexBuffers();
-    createInstanceBuffers();
-    createStagingBuffers();
-    generateVertices();
-    generateIndices();
-    transferVertexBuffers();
-    transferIndexBuffers();
-  };
-  ~VulkanRenderer() {
-    m_device.waitIdle();
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-      vmaDestroyBuffer(m_allocator, m_stagingBuffers[i],
-                       m_stagingBufferAllocations[i]);
-      vmaDestroyBuffer(m_allocator, m_instanceBuffers[i],
-                       m_instanceBufferAllocations[i]);
-      vmaDestroyBuffer(m_allocator, m_indexBuffers[i],
-                       m_indexBufferAllocations[i]);
-      vmaDestroyBuffer(m_allocator, m_vertexBuffers[i],
-                       m_vertexBufferAllocations[i]);
-      m_device.destroySemaphore(m_imageAvailableSemaphores[i]);
-      m_device.destroySemaphore(m_renderFinishedSemaphores[i]);
-      m_device.destroyFence(m_inFlightFences[i]);
-      m_device.freeCommandBuffers(m_commandPool, m_commandBuffer[i]);
+    if (simulation) {
+      const SimulationSnapshot &snapshot = simulation->acquire();
+      steps += snapshot.steps;
+      pairsTested += snapshot.pairsTested;
+      pairsColliding += snapshot.pairsColliding;
+      pairIndexDistance += snapshot.pairIndexDistance;
+      sleepingBalls = snapshot.sleeping;
+      app.drawFrame(snapshot.instanceData.data(), snapshot.count,
+                    &snapshot.dirtyRanges);
+      if (recorder) {
+        recorder->record(snapshot.instanceData.data());
+      }
+      frames++;
+      continue;
     }
-    m_device.destroyCommandPool(m_commandPool);
-    for (const auto &framebuffer : m_framebuffers) {
-      m_device.destroyFramebuffer(framebuffer);
+    // --steps-per-frame locks the simulation to the frame count instead of
+    // wall time, which keeps unpaced headless runs reproducible.
+    uint32_t frameSteps = stepsPerFrame > 0 ? stepsPerFrame : clock.advance();
+    float alpha = stepsPerFrame > 0 ? 1.0f : clock.getAlpha();
+    steps += frameSteps;
+    if (app.usesGpuPhysics()) {
+      app.setGpuPhysicsSteps(clock.getStepSeconds(), frameSteps);
+      app.drawFrame(nullptr, balls.size());
+      frames++;
+      continue;
     }
-    m_device.destroyPipeline(m_graphicsPipeline);
-    m_device.destroyPipelineLayout(m_pipelineLayout);
-    m_device.destroyRenderPass(m_renderPass);
-    for (const auto &imageView : m_swapchainImageViews) {
-      m_device.destroyImageView(imageView);
+    ProfileScope physicsScope(&profiler, "physics");
+    for (uint32_t step = 0; step < frameSteps; step++) {
+      balls.step(clock.getStepSeconds(), &scheduler);
+      BroadphaseStats broadphase = balls.getBroadphaseStats();
+      pairsTested += broadphase.pairsTested;
+      pairsColliding += broadphase.pairsColliding;
+      pairIndexDistance += broadphase.pairIndexDistance;
     }
-    m_device.destroySwapchainKHR(m_swapchain);
-    m_instance.destroySurfaceKHR(m_surface);
-    vmaDestroyAllocator(m_allocator);
-    m_device.destroy();
-    m_instance.destroy();
-    glfwDestroyWindow(m_window);
-    glfwTerminate();
-  };
-  bool shouldQuit() { return glfwWindowShouldClose(m_window); };
-  void uploadInstanceData(float *data, uint32_t instanceCount) {
-    float *currentStagingBuffer =
-        reinterpret_cast<float *>(m_mappedStagingBuffers[m_currentFrame]);
-    memcpy(currentStagingBuffer, data, sizeof(float) * 3 * instanceCount);
-    vk::BufferCopy copyRegion(0, 0, sizeof(float) * 3 * instanceCount);
-    m_commandBuffer[m_currentFrame].copyBuffer(
-        m_stagingBuffers[m_currentFrame], m_instanceBuffers[m_currentFrame],
-        copyRegion);
-    vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite,
-                              vk::AccessFlagBits::eVertexAttributeRead);
-    vk::BufferMemoryBarrier bufferBarrier(
-        vk::AccessFlagBits::eTransferWrite,
-        vk::AccessFlagBits::eVertexAttributeRead, VK_QUEUE_FAMILY_IGNORED,
-        VK_QUEUE_FAMILY_IGNORED, m_instanceBuffers[m_currentFrame], 0,
-        VK_WHOLE_SIZE);
-    m_commandBuffer[m_currentFrame].pipelineBarrier(
-        vk::PipelineStageFlagBits::eTransfer,
-        vk::PipelineStageFlagBits::eVertexInput, {}, barrier, bufferBarrier,
-        {});
-  }
-  void drawFrame(float *instanceData, uint32_t instanceCount = 1) {
-    m_device.waitForFences(1, &m_inFlightFences[m_currentFrame], VK_TRUE,
-                           UINT64_MAX);
-    m_device.resetFences(1, &m_inFlightFences[m_currentFrame]);
-    uint32_t imageIndex =
-        m_device
-            .acquireNextImageKHR(m_swapchain, UINT64_MAX,
-                                 m_imageAvailableSemaphores[m_currentFrame])
-            .value;
-    m_commandBuffer[m_currentFrame].begin(
-        {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-    uploadInstanceData(instanceData, instanceCount);
-    vk::ClearValue clearValue{};
-    clearValue.color = {0.0f, 0.0f, 0.0f, 1.0f};
-    vk::RenderPassBeginInfo renderPassBeginInfo{};
-    renderPassBeginInfo.clearValueCount = 1;
-    renderPassBeginInfo.pClearValues = &clearValue;
-    renderPassBeginInfo.framebuffer = m_framebuffers[imageIndex];
-    renderPassBeginInfo.renderArea = vk::Rect2D{{0, 0}, {WIDTH, HEIGHT}};
-    renderPassBeginInfo.renderPass = m_renderPass;
-    m_commandBuffer[m_currentFrame].beginRenderPass(
-        renderPassBeginInfo, vk::SubpassContents::eInline);
-    m_commandBuffer[m_currentFrame].bindPipeline(
-        vk::PipelineBindPoint::eGraphics, m_graphicsPipeline);
-    m_commandBuffer[m_currentFrame].bindVertexBuffers(
-        0, {m_vertexBuffers[m_currentFrame], m_instanceBuffers[m_currentFrame]},
-        {0, 0});
-    m_commandBuffer[m_currentFrame].bindIndexBuffer(
-        m_indexBuffers[m_currentFrame], 0, vk::IndexType::eUint32);
-    m_commandBuffer[m_currentFrame].drawIndexed(78, instanceCount, 0, 0, 0);
-    m_commandBuffer[m_currentFrame].endRenderPass();
-    m_commandBuffer[m_currentFrame].end();
-    vk::SubmitInfo submitInfo{};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer[m_currentFrame];
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &m_renderFinishedSemaphores[m_currentFrame];
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = &m_imageAvailableSemaphores[m_currentFrame];
-    vk::PipelineStageFlags waitStages[] = {
-        vk::PipelineStageFlagBits::eColorAttachmentOutput};
-    submitInfo.pWaitDstStageMask = waitStages;
-    m_queue.submit(submitInfo, m_inFlightFences[m_currentFrame]);
-    vk::PresentInfoKHR presentInfo{};
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &m_renderFinishedSemaphores[m_currentFrame];
-    presentInfo.swapchainCount = 1;
-    presentInfo.pSwapchains = &m_swapchain;
-    presentInfo.pImageIndices = &imageIndex;
-    presentInfo.pResults = nullptr;
-    m_queue.presentKHR(presentInfo);
-    m_currentFrame = (m_currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
-  };
-};
-
-class BouncingBall {
-private:
-  const float GRAVITY = 0.5;
-  float m_vx;
-  float m_vy;
-  float m_instanceData[3];
-  std::chrono::time_point<std::chrono::high_resolution_clock> m_lastTime;
-
-public:
-  BouncingBall(float x, float y, float vx, float vy, float radius) {
-    m_instanceData[0] = x;
-    m_instanceData[1] = y;
-    m_instanceData[2] = radius;
-    m_vx = vx;
-    m_vy = vy;
-    m_lastTime = std::chrono::high_resolution_clock::now();
-  };
-  float *getInstanceData() { return m_instanceData; };
-  void update() {
-    auto currentTime = std::chrono::high_resolution_clock::now();
-    auto dt = std::chrono::duration<float>(currentTime - m_lastTime).count();
-    m_instanceData[0] += m_vx * dt;
-    m_instanceData[1] -= m_vy * dt;
-    m_vy -= GRAVITY * dt;
-    m_lastTime = currentTime;
-    if (m_instanceData[0] + m_instanceData[2] > 1.0) {
-      m_vx = -m_vx;
-      m_instanceData[0] = 1.0 - m_instanceData[2];
+    physicsScope.end();
+    if (checkpoint) {
+      checkpoint->update(balls);
     }
-    if (m_instanceData[0] - m_instanceData[2] < -1.0) {
-      m_vx = -m_vx;
-      m_instanceData[0] = -1.0 + m_instanceData[2];
+    ProfileScope interpolateScope(&profiler, "interpolate");
+    float *instanceData = balls.getInterpolatedInstanceData(alpha, &scheduler);
+    interpolateScope.end();
+    balls.takeDirtyRanges(dirtyRanges);
+    sleepingBalls = balls.getSleepingCount();
+    app.drawFrame(instanceData, balls.size(), &dirtyRanges);
+    if (recorder) {
+      recorder->record(instanceData);
     }
-    if (m_instanceData[1] + m_instanceData[2] > 1.0) {
-      m_vy = -m_vy;
-      m_instanceData[1] = 1.0 - m_instanceData[2];
+    frames++;
+  }
+  logPacing();
+  if (pacingLog != nullptr) {
+    fclose(pacingLog);
+  }
+  simulation.reset();
+  if (recorder) {
+    // Every frame was recorded; the destructor writes the queued ones.
+    recorder.reset();
+    printf("Recorded %llu frames to %s\n",
+           static_cast<unsigned long long>(frames), recordPath.c_str());
+  }
+  finishCheckpoint();
+  if (app.isHeadless()) {
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::high_resolution_clock::now() - startTime)
+                         .count();
+    printf("%llu frames in %.3f s (%.1f fps)\n",
+           static_cast<unsigned long long>(frames), seconds,
+           frames / seconds);
+  }
+  printf("%llu fixed steps of %.4f s, %llu dropped\n",
+         static_cast<unsigned long long>(steps), clock.getStepSeconds(),
+         static_cast<unsigned long long>(clock.getDroppedSteps()));
+  if (balls.getCollisions() && steps > 0) {
+    printf("broadphase: %.1f pairs tested, %.1f colliding per step (%ux%u "
+           "grid), colliding pairs %.0f slots apart\n",
+           double(pairsTested) / steps, double(pairsColliding) / steps,
+           balls.getBroadphaseStats().gridDim,
+           balls.getBroadphaseStats().gridDim,
+           pairsColliding > 0 ? double(pairIndexDistance) / pairsColliding
+                              : 0.0);
+  }
+  if (balls.getReorderInterval() > 0) {
+    ReorderStats reorder = balls.getReorderStats();
+    printf("reorder: every %u steps, %llu sorts, %.3f ms last, %.3f ms "
+           "mean\n",
+           balls.getReorderInterval(),
+           static_cast<unsigned long long>(reorder.reorders),
+           reorder.lastMilliseconds,
+           reorder.reorders > 0 ? reorder.totalMilliseconds / reorder.reorders
+                                : 0.0);
+  }
+  if (balls.getSleeping()) {
+    InstanceUploadStats upload = app.getInstanceUploadStats();
+    printf("sleeping: %u of %u balls asleep, %u awake; last frame uploaded "
+           "%.1f KB in %u copy regions\n",
+           sleepingBalls, balls.size(), balls.size() - sleepingBalls,
+           upload.lastBytes / 1e3, upload.lastRegions);
+  }
+  if (!app.usesGpuPhysics()) {
+    // Measured on the final state; the error bound depends only on the
+    // format and the range of the values.
+    InstancePrecision precision = measureInstancePrecision(
+        app.getInstanceFormat(), balls.getInstanceData(), balls.size());
+    float pixelsPerUnit = 0.5f * WIDTH * app.getZoom();
+    printf("instances: %s, %.1f KB per frame, max error %.3g px position, "
+           "%.3g px radius\n",
+           instanceFormatName(app.getInstanceFormat()),
+           app.getInstanceBytesPerFrame() / 1e3,
+           precision.maxPositionError * pixelsPerUnit,
+           precision.maxRadiusError * pixelsPerUnit);
+  }
+  FramePacingStats pacing = app.getFramePacing();
+  printf("pacing: %u of %u frames ahead (%llu up, %llu down), mean wait "
+         "%.1f us, %.1f%% of frames starved the GPU\n",
+         pacing.depth, pacing.maxDepth,
+         static_cast<unsigned long long>(pacing.depthIncreases),
+         static_cast<unsigned long long>(pacing.depthDecreases),
+         pacing.meanWaitMicroseconds,
+         pacing.frames > 0 ? 100.0 * pacing.starvedFrames / pacing.frames
+                           : 0.0);
+  if (app.usesGpuCulling()) {
+    CullStats cull = app.getCullStats();
+    printf("culling: %u of %u visible in the last frame, %.1f%% on average\n",
+           cull.visible, cull.total,
+           cull.totalSum > 0 ? 100.0 * cull.visibleSum / cull.totalSum : 0.0);
+  }
+  if (!profilePrefix.empty()) {
+    if (profiler.writeChromeTrace(profilePrefix + ".json") &&
+        profiler.writeCsv(profilePrefix + ".csv")) {
+      printf("Wrote %s.json and %s.csv\n", profilePrefix.c_str(),
+             profilePrefix.c_str());
+    } else {
+      fprintf(stderr, "Failed to write profile %s\n", profilePrefix.c_str());
     }
-    if (m_instanceData[1] - m_instanceData[2] < -1.0) {
-      m_vy = -m_vy;
-      m_instanceData[1] = -1.0 + m_instanceData[2];
+  }
+  if (memoryReportInterval > 0) {
+    printMemoryTelemetry(stdout, app.getMemoryTelemetry());
+  }
+  if (!memoryStatsPath.empty()) {
+    if (app.writeMemoryStats(memoryStatsPath)) {
+      printf("Wrote %s\n", memoryStatsPath.c_str());
+    } else {
+      fprintf(stderr, "Failed to write memory stats %s\n",
+              memoryStatsPath.c_str());
     }
-  };
-};
-
-int main() {
-  VulkanRenderer app;
-  BouncingBall ball(0, 0, 0.1, 0.2, 0.2);
-  while (!app.shouldQuit()) {
-    glfwPollEvents();
-    app.drawFrame(ball.getInstanceData());
-    ball.update();
+  }
+  if (app.isCapturing()) {
+    app.finishCapture();
+    CaptureStats capture = app.getCaptureStats();
+    printf("capture: %llu frames written (%.1f MB), %llu dropped, "
+           "%.1f frames/s\n",
+           static_cast<unsigned long long>(capture.written),
+           capture.bytes / 1e6,
+           static_cast<unsigned long long>(capture.dropped),
+           capture.framesPerSecond);
+  }
+  const std::vector<RecordThreadStats> &recordStats = app.getRecordStats();
+  for (uint32_t i = 0; i < recordStats.size(); i++) {
+    printf("record thread %u: %llu batches, %.3f ms per frame\n", i,
+           static_cast<unsigned long long>(recordStats[i].batches),
+           frames > 0 ? recordStats[i].recordMilliseconds / frames : 0.0);
+  }
+  std::vector<WorkerStats> workerStats = scheduler.stats();
+  for (uint32_t i = 0; i < workerStats.size(); i++) {
+    printf("worker %u: %llu jobs, %llu steals, %.1f%% busy\n", i,
+           static_cast<unsigned long long>(workerStats[i].jobs),
+           static_cast<unsigned long long>(workerStats[i].steals),
+           workerStats[i].utilization * 100.0);
   }
   return 0;
 }
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "job_scheduler.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#define RADIX_SORT_BITS 8
+#define RADIX_SORT_BUCKETS (1u << RADIX_SORT_BITS)
+
+// Spreads the low 16 bits of value to the even bit positions.
+inline uint32_t spreadBits16(uint32_t value) {
+  value &= 0xffff;
+  value = (value | (value << 8)) & 0x00ff00ff;
+  value = (value | (value << 4)) & 0x0f0f0f0f;
+  value = (value | (value << 2)) & 0x33333333;
+  value = (value | (value << 1)) & 0x55555555;
+  return value;
+}
+
+// Z-order index of a point in the [-1, 1] NDC domain, 16 bits per axis.
+// Points close on the curve are close in space, so sorting by it keeps
+// spatial neighbours close in memory.
+inline uint32_t mortonCode(float x, float y) {
+  auto quantize = [](float value) {
+    float scaled = (value + 1.0f) * 32767.5f;
+    return uint32_t(std::min(65535.0f, std::max(0.0f, scaled)));
+  };
+  return spreadBits16(quantize(x)) | (spreadBits16(quantize(y)) << 1);
+}
+
+// Stable least-significant-digit radix sort of 32-bit keys carrying a
+// 32-bit value. Each pass histograms chunks in parallel, prefix-sums the
+// histograms in chunk order and scatters chunks in parallel, so the output
+// does not depend on scheduling. Passes whose digit is the same for every
+// key are skipped, and so are digits at or above keyBits.
+class RadixSorter {
+private:
+  std::vector<uint32_t> m_keyScratch;
+  std::vector<uint32_t> m_valueScratch;
+  std::vector<uint32_t> m_offsets;
+
+public:
+  void sort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values,
+            JobScheduler *scheduler, uint32_t chunkSize,
+            uint32_t keyBits = 32) {
+    uint32_t count = keys.size();
+    uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+    m_keyScratch.resize(count);
+    m_valueScratch.resize(count);
+    m_offsets.resize(size_t(chunkCount) * RADIX_SORT_BUCKETS);
+    auto forEachChunk = [&](auto function) {
+      auto run = [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunkBegin = begin; chunkBegin < end;
+             chunkBegin += chunkSize) {
+          function(chunkBegin / chunkSize, chunkBegin,
+                   std::min(chunkBegin + chunkSize, end));
+        }
+      };
+      if (scheduler != nullptr) {
+        scheduler->parallelFor(count, chunkSize, run);
+      } else {
+        run(0, count, 0);
+      }
+    };
+    for (uint32_t shift = 0; shift < keyBits; shift += RADIX_SORT_BITS) {
+      forEachChunk([&](uint32_t chunk, uint32_t begin, uint32_t end) {
+        uint32_t *histogram = &m_offsets[size_t(chunk) * RADIX_SORT_BUCKETS];
+        std::fill(histogram, histogram + RADIX_SORT_BUCKETS, 0);
+        for (uint32_t i = begin; i < end; i++) {
+          histogram[(keys[i] >> shift) & (RADIX_SORT_BUCKETS - 1)]++;
+        }
+      });
+      // Bucket-major prefix sum: chunk c's run of bucket b starts after
+      // every smaller bucket and after bucket b of the chunks before c.
+      uint32_t sum = 0;
+      bool uniform = false;
+      for (uint32_t bucket = 0; bucket < RADIX_SORT_BUCKETS; bucket++) {
+        uint32_t bucketStart = sum;
+        for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+          uint32_t &offset = m_offsets[size_t(chunk) * RADIX_SORT_BUCKETS +
+                                       bucket];
+          uint32_t size = offset;
+          offset = sum;
+          sum += size;
+        }
+        uniform |= sum - bucketStart == count;
+      }
+      if (uniform) {
+        continue;
+      }
+      forEachChunk([&](uint32_t chunk, uint32_t begin, uint32_t end) {
+        uint32_t *offsets = &m_offsets[size_t(chunk) * RADIX_SORT_BUCKETS];
+        for (uint32_t i = begin; i < end; i++) {
+          uint32_t target =
+              offsets[(keys[i] >> shift) & (RADIX_SORT_BUCKETS - 1)]++;
+          m_keyScratch[target] = keys[i];
+          m_valueScratch[target] = values[i];
+        }
+      });
+      keys.swap(m_keyScratch);
+      values.swap(m_valueScratch);
+    }
+  };
+};
@@ -0,0 +1,363 @@
+#include "ball_system.h"
+#include "instance_format.h"
+#include "simulation_clock.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define DEFAULT_BENCH_STEPS 200
+#define DEFAULT_WARMUP_STEPS 20
+#define CROSS_CHECK_BALLS 20000
+#define CROSS_CHECK_STEPS 300
+// Worker count of the parallel cross-check runs; the reference is serial.
+#define CROSS_CHECK_THREADS 4
+
+// What one timed step covers. eIntegrate is a free-flying population where
+// walls are rarely hit, eWall starts every step with every ball crossing a
+// wall, eCollide is a full step with broadphase and contact response.
+enum class PhysicsCase { eIntegrate, eWall, eCollide };
+
+struct PhysicsConfig {
+  PhysicsCase physicsCase;
+  SimdLevel simdLevel;
+  uint32_t ballCount;
+  uint32_t threadCount;
+};
+
+struct PhysicsResult {
+  PhysicsConfig config;
+  uint64_t steps;
+  double seconds;
+  double nanosecondsPerBallStep;
+  double minNanosecondsPerBallStep;
+};
+
+const char *physicsCaseName(PhysicsCase physicsCase) {
+  switch (physicsCase) {
+  case PhysicsCase::eWall:
+    return "wall";
+  case PhysicsCase::eCollide:
+    return "collide";
+  default:
+    return "integrate";
+  }
+}
+
+// Parses a comma-separated list of positive integers. Returns false on an
+// empty list, an empty or non-numeric entry, or a zero.
+bool parseList(const char *arg, std::vector<uint32_t> &values) {
+  values.clear();
+  while (true) {
+    if (*arg < '0' || *arg > '9') {
+      return false;
+    }
+    char *end;
+    unsigned long value = std::strtoul(arg, &end, 10);
+    if (value == 0 || value > UINT32_MAX) {
+      return false;
+    }
+    values.push_back(value);
+    if (*end == '\0') {
+      return true;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    arg = end + 1;
+  }
+}
+
+// Every ball sits on one of the four walls moving into it, so the next
+// step bounces all of them.
+void spawnWallBalls(BallSystem &balls, uint32_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  float maxRadius = std::min(0.2f, 0.3f / std::sqrt(float(count)));
+  std::uniform_real_distribution<float> radius(0.5f * maxRadius, maxRadius);
+  std::uniform_real_distribution<float> along(-1.0f + maxRadius,
+                                              1.0f - maxRadius);
+  std::uniform_real_distribution<float> speed(0.1f, 0.5f);
+  balls.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    float r = radius(rng);
+    float t = along(rng);
+    float v = speed(rng);
+    // y points down and vy up, so the floor is y = 1 with vy < 0.
+    switch (i % 4) {
+    case 0:
+      balls.addBall(1.0f - r, t, v, 0.0f, r);
+      break;
+    case 1:
+      balls.addBall(-1.0f + r, t, -v, 0.0f, r);
+      break;
+    case 2:
+      balls.addBall(t, 1.0f - r, 0.0f, -v, r);
+      break;
+    default:
+      balls.addBall(t, -1.0f + r, 0.0f, v, r);
+      break;
+    }
+  }
+}
+
+// Times steps one at a time; eWall restores its starting state before each
+// step outside the timed region.
+PhysicsResult runConfig(const PhysicsConfig &config, uint64_t stepCount,
+                        uint64_t warmupSteps, uint32_t seed) {
+  JobScheduler scheduler(config.threadCount);
+  BallSystem balls(config.simdLevel);
+  if (config.physicsCase == PhysicsCase::eWall) {
+    spawnWallBalls(balls, config.ballCount, seed);
+  } else {
+    spawnBalls(balls, config.ballCount, seed);
+  }
+  balls.setCollisions(config.physicsCase == PhysicsCase::eCollide);
+  BallState start;
+  balls.saveState(start);
+  float dt = SimulationClock().getStepSeconds();
+  for (uint64_t i = 0; i < warmupSteps; i++) {
+    if (config.physicsCase == PhysicsCase::eWall) {
+      balls.loadState(start.view());
+    }
+    balls.step(dt, &scheduler);
+  }
+  double total = 0.0;
+  double fastest = 0.0;
+  for (uint64_t i = 0; i < stepCount; i++) {
+    if (config.physicsCase == PhysicsCase::eWall) {
+      balls.loadState(start.view());
+    }
+    auto stepStart = std::chrono::high_resolution_clock::now();
+    balls.step(dt, &scheduler);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::high_resolution_clock::now() - stepStart)
+                         .count();
+    total += seconds;
+    fastest = i == 0 ? seconds : std::min(fastest, seconds);
+  }
+  PhysicsResult result{};
+  result.config = config;
+  result.steps = stepCount;
+  result.seconds = total;
+  result.nanosecondsPerBallStep =
+      stepCount > 0 ? total * 1e9 / (double(stepCount) * config.ballCount)
+                    : 0.0;
+  result.minNanosecondsPerBallStep = fastest * 1e9 / config.ballCount;
+  return result;
+}
+
+struct CrossCheck {
+  const char *name;
+  SimdLevel simdLevel;
+  uint32_t threadCount;
+  uint64_t expected;
+  uint64_t actual;
+};
+
+// Runs the same seeded workloads at every SIMD level, serially and on
+// CROSS_CHECK_THREADS workers, and compares the results against the serial
+// scalar kernels bit for bit.
+std::vector<CrossCheck> crossCheck(const std::vector<SimdLevel> &levels,
+                                   uint32_t seed) {
+  std::vector<CrossCheck> checks;
+  JobScheduler serial(1);
+  JobScheduler parallel(CROSS_CHECK_THREADS);
+  float dt = SimulationClock().getStepSeconds();
+  auto simulate = [&](SimdLevel level, bool wall, bool collisions,
+                      JobScheduler &scheduler) {
+    BallSystem balls(level);
+    if (wall) {
+      spawnWallBalls(balls, CROSS_CHECK_BALLS, seed);
+    } else {
+      spawnBalls(balls, CROSS_CHECK_BALLS, seed);
+    }
+    balls.setCollisions(collisions);
+    if (collisions) {
+      // Exercise the restitution, damping and sleep paths as well.
+      balls.setRestitution(0.8f);
+      balls.setDamping(0.2f);
+      balls.setSleeping(true);
+    }
+    for (uint32_t step = 0; step < CROSS_CHECK_STEPS; step++) {
+      balls.step(dt, &scheduler);
+    }
+    return balls.checksum();
+  };
+  struct Workload {
+    const char *name;
+    bool wall;
+    bool collisions;
+  };
+  const Workload workloads[] = {{"integrate", false, false},
+                                {"wall", true, false},
+                                {"collide", false, true}};
+  for (const Workload &workload : workloads) {
+    uint64_t expected = simulate(SimdLevel::eScalar, workload.wall,
+                                 workload.collisions, serial);
+    for (SimdLevel level : levels) {
+      if (level != SimdLevel::eScalar) {
+        checks.push_back({workload.name, level, 1, expected,
+                          simulate(level, workload.wall,
+                                   workload.collisions, serial)});
+      }
+      checks.push_back({workload.name, level, CROSS_CHECK_THREADS, expected,
+                        simulate(level, workload.wall, workload.collisions,
+                                 parallel)});
+    }
+  }
+  // The instance packers have their own SIMD paths.
+  BallSystem balls;
+  spawnBalls(balls, CROSS_CHECK_BALLS, seed);
+  for (InstanceFormat format :
+       {InstanceFormat::eHalf, InstanceFormat::eSnorm16}) {
+    std::vector<uint16_t> scalar(4 * size_t(balls.size()));
+    std::vector<uint16_t> packed(scalar.size());
+    packInstances(format, balls.getInstanceData(), scalar.data(), 0,
+                  balls.size(), SimdLevel::eScalar);
+    for (SimdLevel level : levels) {
+      if (level == SimdLevel::eScalar) {
+        continue;
+      }
+      packInstances(format, balls.getInstanceData(), packed.data(), 0,
+                    balls.size(), level);
+      bool equal = memcmp(scalar.data(), packed.data(),
+                          scalar.size() * sizeof(uint16_t)) == 0;
+      checks.push_back(
+          {instanceFormatName(format), level, 1, 0, equal ? 0u : 1u});
+    }
+  }
+  return checks;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint32_t> ballCounts = {1000, 10000, 100000};
+  std::vector<uint32_t> threadCounts = {1, 2, 4};
+  std::vector<PhysicsCase> cases = {PhysicsCase::eIntegrate,
+                                    PhysicsCase::eWall,
+                                    PhysicsCase::eCollide};
+  std::vector<SimdLevel> levels = {SimdLevel::eScalar};
+#ifdef BALL_SYSTEM_X86
+  levels.push_back(SimdLevel::eSse);
+  if (BallSystem::detectSimdLevel() == SimdLevel::eAvx2) {
+    levels.push_back(SimdLevel::eAvx2);
+  }
+#endif
+  uint64_t stepCount = DEFAULT_BENCH_STEPS;
+  uint64_t warmupSteps = DEFAULT_WARMUP_STEPS;
+  uint32_t seed = 1;
+  bool check = true;
+  std::string outputPath;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc) {
+      if (!parseList(argv[++i], ballCounts)) {
+        fprintf(stderr, "--balls takes positive integers, e.g. 1000,10000\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      if (!parseList(argv[++i], threadCounts)) {
+        fprintf(stderr, "--threads takes positive integers, e.g. 1,2,4\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--cases") == 0 && i + 1 < argc) {
+      cases.clear();
+      const char *names = argv[++i];
+      if (strstr(names, "integrate") != nullptr) {
+        cases.push_back(PhysicsCase::eIntegrate);
+      }
+      if (strstr(names, "wall") != nullptr) {
+        cases.push_back(PhysicsCase::eWall);
+      }
+      if (strstr(names, "collide") != nullptr) {
+        cases.push_back(PhysicsCase::eCollide);
+      }
+      if (cases.empty()) {
+        fprintf(stderr, "--cases takes integrate, wall and/or collide\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+      stepCount = std::max(1ull, std::strtoull(argv[++i], nullptr, 10));
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmupSteps = std::strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = std::strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--no-check") == 0) {
+      check = false;
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--balls N,N,...] [--threads N,N,...] "
+              "[--cases integrate,wall,collide] [--steps N] [--warmup N] "
+              "[--seed N] [--no-check] [--output FILE]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  std::vector<CrossCheck> checks;
+  bool passed = true;
+  if (check) {
+    checks = crossCheck(levels, seed);
+    for (const CrossCheck &result : checks) {
+      bool ok = result.expected == result.actual;
+      passed &= ok;
+      fprintf(stderr, "check %-9s %-6s %u thread(s) %s\n", result.name,
+              simdLevelName(result.simdLevel), result.threadCount,
+              ok ? "ok" : "MISMATCH");
+    }
+  }
+  std::vector<PhysicsResult> results;
+  for (PhysicsCase physicsCase : cases) {
+    for (SimdLevel level : levels) {
+      for (uint32_t ballCount : ballCounts) {
+        for (uint32_t threadCount : threadCounts) {
+          PhysicsConfig config{physicsCase, level, ballCount, threadCount};
+          PhysicsResult result =
+              runConfig(config, stepCount, warmupSteps, seed);
+          fprintf(stderr,
+                  "%-9s %-6s %8u balls, %2u threads: %8.3f ns/ball/step "
+                  "(min %.3f)\n",
+                  physicsCaseName(physicsCase), simdLevelName(level),
+                  config.ballCount, config.threadCount,
+                  result.nanosecondsPerBallStep,
+                  result.minNanosecondsPerBallStep);
+          results.push_back(result);
+        }
+      }
+    }
+  }
+  FILE *output = stdout;
+  if (!outputPath.empty()) {
+    output = fopen(outputPath.c_str(), "w");
+    if (output == nullptr) {
+      fprintf(stderr, "Failed to open %s\n", outputPath.c_str());
+      return 1;
+    }
+  }
+  fprintf(output,
+          "{\n  \"steps\": %llu,\n  \"warmup\": %llu,\n  \"seed\": %u,\n"
+          "  \"cross_check\": \"%s\",\n  \"results\": [",
+          static_cast<unsigned long long>(stepCount),
+          static_cast<unsigned long long>(warmupSteps), seed,
+          !check ? "skipped" : passed ? "pass" : "fail");
+  for (size_t i = 0; i < results.size(); i++) {
+    const PhysicsResult &result = results[i];
+    fprintf(output,
+            "%s\n    {\"case\": \"%s\", \"simd\": \"%s\", \"balls\": %u, "
+            "\"threads\": %u, \"seconds\": %.6f, "
+            "\"ns_per_ball_step\": %.4f, \"min_ns_per_ball_step\": %.4f}",
+            i == 0 ? "" : ",", physicsCaseName(result.config.physicsCase),
+            simdLevelName(result.config.simdLevel), result.config.ballCount,
+            result.config.threadCount, result.seconds,
+            result.nanosecondsPerBallStep, result.minNanosecondsPerBallStep);
+  }
+  fprintf(output, "\n  ]\n}\n");
+  if (output != stdout) {
+    fclose(output);
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define PIPELINE_CACHE_MAGIC 0x43505642u
+
+// File header written in front of the driver's cache blob. The driver
+// validates its own header too, but a mismatched blob is only guaranteed
+// to be ignored, not rejected cheaply, so entries from another device or
+// driver build are discarded before they reach vkCreatePipelineCache.
+struct PipelineCacheFileHeader {
+  uint32_t magic;
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint32_t driverVersion;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+  uint64_t dataSize;
+};
+
+// Reads a whole file into memory. Returns an empty vector when the file is
+// missing or unreadable.
+inline std::vector<char> readBinaryFile(const std::string &path) {
+  std::vector<char> data;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return data;
+  }
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long size = ftell(file);
+    if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+      data.resize(size);
+      if (fread(data.data(), 1, data.size(), file) != data.size()) {
+        data.clear();
+      }
+    }
+  }
+  fclose(file);
+  return data;
+}
+
+// vk::PipelineCache persisted across runs. An empty path keeps the cache in
+// memory only.
+class PipelineCache {
+private:
+  vk::Device m_device;
+  vk::PhysicalDeviceProperties m_properties;
+  std::string m_path;
+  vk::PipelineCache m_cache;
+  bool m_loaded = false;
+  size_t m_loadedBytes = 0;
+  PipelineCacheFileHeader makeHeader(uint64_t dataSize) {
+    PipelineCacheFileHeader header{};
+    header.magic = PIPELINE_CACHE_MAGIC;
+    header.vendorID = m_properties.vendorID;
+    header.deviceID = m_properties.deviceID;
+    header.driverVersion = m_properties.driverVersion;
+    memcpy(header.pipelineCacheUUID, m_properties.pipelineCacheUUID,
+           VK_UUID_SIZE);
+    header.dataSize = dataSize;
+    return header;
+  };
+  bool matches(const PipelineCacheFileHeader &header, size_t fileSize) {
+    PipelineCacheFileHeader expected = makeHeader(header.dataSize);
+    return memcmp(&header, &expected, sizeof(header)) == 0 &&
+           header.dataSize == fileSize - sizeof(header);
+  };
+
+public:
+  void create(vk::Device device, vk::PhysicalDevice physicalDevice,
+              const std::string &path) {
+    m_device = device;
+    m_properties = physicalDevice.getProperties();
+    m_path = path;
+    std::vector<char> file;
+    if (!m_path.empty()) {
+      file = readBinaryFile(m_path);
+    }
+    vk::PipelineCacheCreateInfo createInfo{};
+    PipelineCacheFileHeader header;
+    if (file.size() > sizeof(header)) {
+      memcpy(&header, file.data(), sizeof(header));
+      if (matches(header, file.size())) {
+        createInfo.initialDataSize = header.dataSize;
+        createInfo.pInitialData = file.data() + sizeof(header);
+        m_loaded = true;
+        m_loadedBytes = header.dataSize;
+      } else {
+        fprintf(stderr,
+                "Ignoring pipeline cache %s: built for another device or "
+                "driver\n",
+                m_path.c_str());
+      }
+    }
+    m_cache = m_device.createPipelineCache(createInfo);
+  };
+  // Writes to a temporary file and renames it so an interrupted save never
+  // leaves a truncated cache behind.
+  bool save() {
+    if (m_path.empty() || !m_cache) {
+      return false;
+    }
+    std::vector<uint8_t> data = m_device.getPipelineCacheData(m_cache);
+    PipelineCacheFileHeader header = makeHeader(data.size());
+    std::string temporaryPath = m_path + ".tmp";
+    FILE *file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporaryPath.c_str(), m_path.c_str()) != 0) {
+      remove(temporaryPath.c_str());
+      return false;
+    }
+    return true;
+  };
+  void destroy() {
+    if (m_cache) {
+      m_device.destroyPipelineCache(m_cache);
+      m_cache = nullptr;
+    }
+  };
+  vk::PipelineCache get() { return m_cache; };
+  bool wasLoaded() { return m_loaded; };
+  size_t getLoadedBytes() { return m_loadedBytes; };
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Track id used for GPU timestamp events in the exported trace.
+#define PROFILER_GPU_TRACK 0
+
+struct ProfileEvent {
+  const char *name;
+  uint32_t track;
+  uint64_t frame;
+  double startMicroseconds;
+  double durationMicroseconds;
+};
+
+// Collects CPU scopes and GPU timestamp ranges tagged with a frame number
+// and exports them as a Chrome trace (chrome://tracing, Perfetto) or a CSV
+// with one row per frame and one column per phase. Recording can be
+// switched on and off at any time; event names must be string literals.
+class Profiler {
+private:
+  std::atomic<bool> m_enabled{false};
+  std::atomic<uint64_t> m_frame{0};
+  std::mutex m_mutex;
+  std::vector<ProfileEvent> m_events;
+  std::chrono::time_point<std::chrono::steady_clock> m_origin;
+  static uint32_t threadTrack() {
+    static std::atomic<uint32_t> nextTrack{PROFILER_GPU_TRACK + 1};
+    thread_local uint32_t track = nextTrack.fetch_add(1);
+    return track;
+  };
+
+public:
+  Profiler() { m_origin = std::chrono::steady_clock::now(); };
+  bool isEnabled() { return m_enabled.load(std::memory_order_relaxed); };
+  void setEnabled(bool enabled) {
+    m_enabled.store(enabled, std::memory_order_relaxed);
+  };
+  void beginFrame(uint64_t frame) {
+    m_frame.store(frame, std::memory_order_relaxed);
+  };
+  uint64_t getFrame() { return m_frame.load(std::memory_order_relaxed); };
+  double nowMicroseconds() {
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now() - m_origin)
+        .count();
+  };
+  void recordCpu(const char *name, double startMicroseconds,
+                 double durationMicroseconds) {
+    recordCpu(name, startMicroseconds, durationMicroseconds, getFrame());
+  };
+  // For work done ahead of the frame beginFrame() last announced, e.g. on
+  // a pipelined simulation thread.
+  void recordCpu(const char *name, double startMicroseconds,
+                 double durationMicroseconds, uint64_t frame) {
+    record({name, threadTrack(), frame, startMicroseconds,
+            durationMicroseconds});
+  };
+  void record(const ProfileEvent &event) {
+    if (!isEnabled()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(event);
+  };
+  bool writeChromeTrace(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      return false;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                  "\"tid\":%u,\"args\":{\"name\":\"GPU\"}}",
+            PROFILER_GPU_TRACK);
+    for (const auto &event : m_events) {
+      fprintf(file,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+              event.name, event.track, event.startMicroseconds,
+              event.durationMicroseconds,
+              static_cast<unsigned long long>(event.frame));
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+  };
+  // Durations of repeated events within a frame are summed.
+  bool writeCsv(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> phases;
+    std::map<std::string, size_t> phaseColumns;
+    std::map<uint64_t, std::vector<double>> frames;
+    for (const auto &event : m_events) {
+      auto column = phaseColumns.find(event.name);
+      if (column == phaseColumns.end()) {
+        column = phaseColumns.emplace(event.name, phases.size()).first;
+        phases.push_back(event.name);
+      }
+      std::vector<double> &row = frames[event.frame];
+      row.resize(phases.size(), 0.0);
+      row[column->second] += event.durationMicroseconds / 1000.0;
+    }
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      return false;
+    }
+    fprintf(file, "frame");
+    for (const auto &phase : phases) {
+      fprintf(file, ",%s_ms", phase.c_str());
+    }
+    fprintf(file, "\n");
+    for (auto &frame : frames) {
+      frame.second.resize(phases.size(), 0.0);
+      fprintf(file, "%llu", static_cast<unsigned long long>(frame.first));
+      for (double duration : frame.second) {
+        fprintf(file, ",%.4f", duration);
+      }
+      fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+  };
+};
+
+// Records the time between construction and end() or destruction. A null
+// profiler makes the scope a no-op. Scopes are tagged with the profiler's
+// current frame unless given one.
+class ProfileScope {
+private:
+  Profiler *m_profiler;
+  const char *m_name;
+  double m_start = 0.0;
+  bool m_hasFrame = false;
+  uint64_t m_frame = 0;
+
+public:
+  ProfileScope(Profiler *profiler, const char *name)
+      : m_profiler(profiler != nullptr && profiler->isEnabled() ? profiler
+                                                                 : nullptr),
+        m_name(name) {
+    if (m_profiler != nullptr) {
+      m_start = m_profiler->nowMicroseconds();
+    }
+  };
+  ProfileScope(Profiler *profiler, const char *name, uint64_t frame)
+      : ProfileScope(profiler, name) {
+    m_hasFrame = true;
+    m_frame = frame;
+  };
+  ~ProfileScope() { end(); };
+  void end() {
+    if (m_profiler != nullptr) {
+      double duration = m_profiler->nowMicroseconds() - m_start;
+      if (m_hasFrame) {
+        m_profiler->recordCpu(m_name, m_start, duration, m_frame);
+      } else {
+        m_profiler->recordCpu(m_name, m_start, duration);
+      }
+      m_profiler = nullptr;
+    }
+  };
+};
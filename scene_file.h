@@ -0,0 +1,493 @@
+#pragma once
+
+#include "ball_system.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define SCENE_FILE_MAGIC "BBSCENE1"
+#define REPLAY_FILE_MAGIC "BBREPLY1"
+#define SCENE_FILE_VERSION 1
+// Every array starts on a cache line, which keeps mapped arrays usable as
+// aligned SIMD input and lets the loader copy whole lines.
+#define SCENE_FILE_ALIGNMENT 64
+// x, y, radius, vx, vy, ids, asleep, restSteps.
+#define SCENE_ARRAY_COUNT 8
+// Frames the replay recorder may queue before record() blocks.
+#define REPLAY_QUEUE_DEPTH 4
+// Loaded positions must lie within this distance of the origin on each
+// axis. Contact response can push a ball slightly past a wall, but nothing
+// legitimate gets near this, and the bound keeps the grid's float-to-int
+// cell conversion in range.
+#define SCENE_POSITION_LIMIT 2.0f
+
+// A scene file holds a BallStateView: a header followed by one array per
+// field in slot order, at the byte offsets listed in the header. Values are
+// stored in the host's byte order. Scenes double as checkpoints: loading
+// one resumes the run it was saved from bit-exactly.
+struct SceneFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t ballCount;
+  uint64_t stepCount;
+  uint64_t offsets[SCENE_ARRAY_COUNT];
+};
+
+// A replay file holds the instance stream (x, y, radius per ball) of every
+// recorded frame, back to back after the header, each frame starting on a
+// SCENE_FILE_ALIGNMENT boundary. frameCount is 0 while a recording is in
+// progress, and stays 0 if the recorder never finished; the reader then
+// counts the complete frames in the file instead.
+struct ReplayFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t ballCount;
+  uint64_t frameCount;
+  uint64_t frameBytes;
+  uint64_t firstFrameOffset;
+  double stepSeconds;
+};
+
+inline uint64_t alignSceneOffset(uint64_t offset) {
+  return (offset + SCENE_FILE_ALIGNMENT - 1) &
+         ~uint64_t(SCENE_FILE_ALIGNMENT - 1);
+}
+
+inline uint64_t sceneArrayBytes(uint32_t array, uint32_t count) {
+  static const uint32_t elementSizes[SCENE_ARRAY_COUNT] = {
+      sizeof(float), sizeof(float),    sizeof(float),   sizeof(float),
+      sizeof(float), sizeof(uint32_t), sizeof(uint8_t), sizeof(uint16_t)};
+  return uint64_t(elementSizes[array]) * count;
+}
+
+// Read-only private mapping of a whole file. Pages are faulted in on first
+// touch, so opening a multi-gigabyte file costs nothing up front.
+class MappedFile {
+private:
+  int m_file = -1;
+  uint8_t *m_data = nullptr;
+  size_t m_size = 0;
+
+public:
+  MappedFile(const std::string &path) {
+    m_file = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (m_file < 0 || fstat(m_file, &status) != 0) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    m_size = status.st_size;
+    if (m_size == 0) {
+      throw std::runtime_error("Empty file " + path);
+    }
+    void *mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("Failed to map " + path);
+    }
+    m_data = static_cast<uint8_t *>(mapped);
+    madvise(m_data, m_size, MADV_SEQUENTIAL);
+  };
+  ~MappedFile() {
+    if (m_data != nullptr) {
+      munmap(m_data, m_size);
+    }
+    if (m_file >= 0) {
+      close(m_file);
+    }
+  };
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  const uint8_t *data() { return m_data; };
+  size_t size() { return m_size; };
+};
+
+// Validates a mapped scene file and returns a view pointing into it.
+inline BallStateView mapSceneFile(MappedFile &file, const std::string &path) {
+  SceneFileHeader header;
+  if (file.size() < sizeof(header)) {
+    throw std::runtime_error("Truncated scene file " + path);
+  }
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    throw std::runtime_error("Not a scene file: " + path);
+  }
+  if (header.version != SCENE_FILE_VERSION) {
+    throw std::runtime_error("Unsupported scene file version " +
+                             std::to_string(header.version) + " in " + path);
+  }
+  for (uint32_t array = 0; array < SCENE_ARRAY_COUNT; array++) {
+    uint64_t offset = header.offsets[array];
+    if (offset % SCENE_FILE_ALIGNMENT != 0 || offset > file.size() ||
+        sceneArrayBytes(array, header.ballCount) > file.size() - offset) {
+      throw std::runtime_error("Corrupt scene file " + path);
+    }
+  }
+  const uint8_t *data = file.data();
+  const uint64_t *offsets = header.offsets;
+  BallStateView view{
+      header.ballCount,
+      header.stepCount,
+      reinterpret_cast<const float *>(data + offsets[0]),
+      reinterpret_cast<const float *>(data + offsets[1]),
+      reinterpret_cast<const float *>(data + offsets[2]),
+      reinterpret_cast<const float *>(data + offsets[3]),
+      reinterpret_cast<const float *>(data + offsets[4]),
+      reinterpret_cast<const uint32_t *>(data + offsets[5]),
+      data + offsets[6],
+      reinterpret_cast<const uint16_t *>(data + offsets[7])};
+  // loadState() trusts the id mapping; a duplicate would corrupt it.
+  std::vector<uint8_t> seen(header.ballCount, 0);
+  for (uint32_t slot = 0; slot < header.ballCount; slot++) {
+    uint32_t id = view.ids[slot];
+    if (id >= header.ballCount || seen[id]) {
+      throw std::runtime_error("Corrupt ball ids in scene file " + path);
+    }
+    seen[id] = 1;
+  }
+  // The grid turns positions and radii into cell indices; NaNs or huge
+  // values would overflow that conversion.
+  for (uint32_t slot = 0; slot < header.ballCount; slot++) {
+    bool valid = std::fabs(view.x[slot]) <= SCENE_POSITION_LIMIT &&
+                 std::fabs(view.y[slot]) <= SCENE_POSITION_LIMIT &&
+                 view.radius[slot] > 0.0f && view.radius[slot] <= 1.0f &&
+                 std::isfinite(view.vx[slot]) && std::isfinite(view.vy[slot]);
+    if (!valid) {
+      throw std::runtime_error("Invalid ball " + std::to_string(slot) +
+                               " in scene file " + path);
+    }
+  }
+  return view;
+}
+
+// Writes to path + ".tmp" and renames it over path, so a crash mid-write
+// never leaves a torn checkpoint behind.
+inline bool writeSceneFile(const std::string &path,
+                           const BallStateView &view) {
+  SceneFileHeader header{};
+  memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_FILE_VERSION;
+  header.ballCount = view.count;
+  header.stepCount = view.stepCount;
+  const void *arrays[SCENE_ARRAY_COUNT] = {
+      view.x,  view.y,   view.radius, view.vx,
+      view.vy, view.ids, view.asleep, view.restSteps};
+  uint64_t offset = alignSceneOffset(sizeof(header));
+  for (uint32_t array = 0; array < SCENE_ARRAY_COUNT; array++) {
+    header.offsets[array] = offset;
+    offset = alignSceneOffset(offset + sceneArrayBytes(array, view.count));
+  }
+  std::string temporaryPath = path + ".tmp";
+  FILE *file = fopen(temporaryPath.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  static const uint8_t padding[SCENE_FILE_ALIGNMENT] = {};
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  uint64_t written = sizeof(header);
+  for (uint32_t array = 0; array < SCENE_ARRAY_COUNT && ok; array++) {
+    uint64_t gap = header.offsets[array] - written;
+    ok = fwrite(padding, 1, gap, file) == gap;
+    uint64_t bytes = sceneArrayBytes(array, view.count);
+    ok = ok && fwrite(arrays[array], 1, bytes, file) == bytes;
+    written = header.offsets[array] + bytes;
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    remove(temporaryPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct CheckpointStats {
+  uint64_t written;
+  uint64_t failed;
+  // Checkpoints replaced by a newer one before the writer got to them.
+  uint64_t superseded;
+  double lastMilliseconds;
+};
+
+// Writes checkpoints of a BallSystem on a background thread. The stepping
+// thread only copies the state (saveState()) and hands it over; if the
+// previous checkpoint is still queued it is superseded rather than waited
+// for.
+class CheckpointWriter {
+private:
+  std::string m_path;
+  uint64_t m_interval;
+  // Index of the last interval checkpointed; UINT64_MAX until the first
+  // update(), so resuming mid-interval does not write at once.
+  uint64_t m_lastCheckpoint = UINT64_MAX;
+  BallState m_capture;
+  BallState m_pending;
+  BallState m_writing;
+  bool m_hasPending = false;
+  bool m_busy = false;
+  bool m_stop = false;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+  std::atomic<uint64_t> m_written{0};
+  std::atomic<uint64_t> m_failed{0};
+  std::atomic<uint64_t> m_superseded{0};
+  std::atomic<double> m_lastMilliseconds{0.0};
+  void run() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() { return m_stop || m_hasPending; });
+        if (!m_hasPending) {
+          return;
+        }
+        std::swap(m_writing, m_pending);
+        m_hasPending = false;
+        m_busy = true;
+      }
+      auto start = std::chrono::steady_clock::now();
+      if (writeSceneFile(m_path, m_writing.view())) {
+        m_written.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        m_failed.fetch_add(1, std::memory_order_relaxed);
+      }
+      m_lastMilliseconds.store(std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count(),
+                               std::memory_order_relaxed);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_busy = false;
+      }
+      m_condition.notify_all();
+    }
+  };
+
+public:
+  // interval is in simulation steps; 0 writes only on submit().
+  CheckpointWriter(const std::string &path, uint64_t interval)
+      : m_path(path), m_interval(interval) {
+    m_thread = std::thread([this]() { run(); });
+  };
+  // Writes whatever is still queued before returning.
+  ~CheckpointWriter() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+  };
+  // Call from the thread that steps balls, after stepping; checkpoints
+  // once per interval steps.
+  void update(BallSystem &balls) {
+    if (m_interval == 0) {
+      return;
+    }
+    uint64_t checkpoint = balls.getStepCount() / m_interval;
+    if (m_lastCheckpoint == UINT64_MAX) {
+      m_lastCheckpoint = checkpoint;
+    } else if (checkpoint != m_lastCheckpoint) {
+      m_lastCheckpoint = checkpoint;
+      submit(balls);
+    }
+  };
+  void submit(BallSystem &balls) {
+    balls.saveState(m_capture);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_hasPending) {
+        m_superseded.fetch_add(1, std::memory_order_relaxed);
+      }
+      std::swap(m_capture, m_pending);
+      m_hasPending = true;
+    }
+    m_condition.notify_one();
+  };
+  // Blocks until every submitted checkpoint is on disk.
+  void drain() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [&]() { return !m_hasPending && !m_busy; });
+  };
+  const std::string &getPath() { return m_path; };
+  CheckpointStats getStats() {
+    return CheckpointStats{m_written.load(), m_failed.load(),
+                           m_superseded.load(), m_lastMilliseconds.load()};
+  };
+};
+
+// Appends the instance stream of every frame to a replay file. record()
+// copies the frame into a pooled buffer and a background thread writes it;
+// record() blocks only when REPLAY_QUEUE_DEPTH frames are already queued,
+// since a replay with holes would not reproduce the run.
+class ReplayRecorder {
+private:
+  std::string m_path;
+  FILE *m_file;
+  ReplayFileHeader m_header{};
+  std::deque<std::vector<float>> m_queue;
+  std::vector<std::vector<float>> m_free;
+  bool m_stop = false;
+  bool m_failed = false;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+  void run() {
+    static const uint8_t padding[SCENE_FILE_ALIGNMENT] = {};
+    uint64_t gap = m_header.frameBytes % SCENE_FILE_ALIGNMENT == 0
+                       ? 0
+                       : SCENE_FILE_ALIGNMENT -
+                             m_header.frameBytes % SCENE_FILE_ALIGNMENT;
+    while (true) {
+      std::vector<float> frame;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty()) {
+          return;
+        }
+        frame.swap(m_queue.front());
+        m_queue.pop_front();
+      }
+      // Flushed per frame so a killed run leaves every written frame
+      // readable.
+      bool ok = fwrite(frame.data(), 1, m_header.frameBytes, m_file) ==
+                    m_header.frameBytes &&
+                fwrite(padding, 1, gap, m_file) == gap && fflush(m_file) == 0;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_failed |= !ok;
+        m_header.frameCount += ok;
+        m_free.push_back(std::move(frame));
+      }
+      m_condition.notify_all();
+    }
+  };
+
+public:
+  ReplayRecorder(const std::string &path, uint32_t ballCount,
+                 double stepSeconds)
+      : m_path(path) {
+    memcpy(m_header.magic, REPLAY_FILE_MAGIC, sizeof(m_header.magic));
+    m_header.version = SCENE_FILE_VERSION;
+    m_header.ballCount = ballCount;
+    m_header.frameBytes = sizeof(float) * 3 * uint64_t(ballCount);
+    m_header.firstFrameOffset = alignSceneOffset(sizeof(m_header));
+    m_header.stepSeconds = stepSeconds;
+    m_file = fopen(path.c_str(), "wb");
+    static const uint8_t padding[SCENE_FILE_ALIGNMENT] = {};
+    if (m_file == nullptr ||
+        fwrite(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+        fwrite(padding, 1, m_header.firstFrameOffset - sizeof(m_header),
+               m_file) != m_header.firstFrameOffset - sizeof(m_header)) {
+      throw std::runtime_error("Failed to create replay file " + path);
+    }
+    m_thread = std::thread([this]() { run(); });
+  };
+  // Writes the queued frames, then the final frame count into the header.
+  ~ReplayRecorder() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+    if (fseek(m_file, 0, SEEK_SET) != 0 ||
+        fwrite(&m_header, sizeof(m_header), 1, m_file) != 1) {
+      m_failed = true;
+    }
+    if (fclose(m_file) != 0 || m_failed) {
+      fprintf(stderr, "Failed to write replay file %s\n", m_path.c_str());
+    }
+  };
+  ReplayRecorder(const ReplayRecorder &) = delete;
+  ReplayRecorder &operator=(const ReplayRecorder &) = delete;
+  // instanceData holds 3 * ballCount floats.
+  void record(const float *instanceData) {
+    std::vector<float> frame;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock,
+                       [&]() { return m_queue.size() < REPLAY_QUEUE_DEPTH; });
+      if (!m_free.empty()) {
+        frame.swap(m_free.back());
+        m_free.pop_back();
+      }
+    }
+    frame.resize(3 * size_t(m_header.ballCount));
+    memcpy(frame.data(), instanceData, m_header.frameBytes);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(std::move(frame));
+    }
+    m_condition.notify_one();
+  };
+  uint64_t getFrameCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_header.frameCount;
+  };
+};
+
+// Serves the frames of a replay file straight out of the mapping; frame()
+// pointers go to drawFrame() without a copy.
+class ReplayReader {
+private:
+  MappedFile m_file;
+  ReplayFileHeader m_header;
+
+public:
+  ReplayReader(const std::string &path) : m_file(path) {
+    if (m_file.size() < sizeof(m_header)) {
+      throw std::runtime_error("Truncated replay file " + path);
+    }
+    memcpy(&m_header, m_file.data(), sizeof(m_header));
+    if (memcmp(m_header.magic, REPLAY_FILE_MAGIC, sizeof(m_header.magic)) !=
+        0) {
+      throw std::runtime_error("Not a replay file: " + path);
+    }
+    if (m_header.version != SCENE_FILE_VERSION) {
+      throw std::runtime_error("Unsupported replay file version " +
+                               std::to_string(m_header.version) + " in " +
+                               path);
+    }
+    if (m_header.ballCount == 0 ||
+        m_header.frameBytes != sizeof(float) * 3 * uint64_t(
+                                   m_header.ballCount) ||
+        m_header.firstFrameOffset % SCENE_FILE_ALIGNMENT != 0 ||
+        m_header.firstFrameOffset > m_file.size()) {
+      throw std::runtime_error("Corrupt replay file " + path);
+    }
+    // A frame is complete once its data is there; the padding after the
+    // last one may be missing if the recorder was killed.
+    uint64_t available = m_file.size() - m_header.firstFrameOffset;
+    uint64_t completeFrames =
+        available < m_header.frameBytes
+            ? 0
+            : (available - m_header.frameBytes) / frameStride() + 1;
+    if (m_header.frameCount == 0) {
+      m_header.frameCount = completeFrames;
+    }
+    if (m_header.frameCount == 0 || m_header.frameCount > completeFrames) {
+      throw std::runtime_error("Corrupt replay file " + path);
+    }
+  };
+  uint32_t ballCount() { return m_header.ballCount; };
+  uint64_t frameCount() { return m_header.frameCount; };
+  double stepSeconds() { return m_header.stepSeconds; };
+  uint64_t frameStride() { return alignSceneOffset(m_header.frameBytes); };
+  const float *frame(uint64_t index) {
+    return reinterpret_cast<const float *>(
+        m_file.data() + m_header.firstFrameOffset + index * frameStride());
+  };
+};
@@ -0,0 +1,16 @@
+#version 450
+
+layout(location = 0) in vec2 inLocal;
+layout(location = 1) in float inRadius;
+
+layout(location = 0) out vec4 fragColor;
+
+void main() {
+    float distance = length(inLocal) - inRadius;
+    float coverage = clamp(0.5 - distance / fwidth(distance), 0.0, 1.0);
+    if (coverage <= 0.0) {
+        discard;
+    }
+    // Premultiplied alpha.
+    fragColor = vec4(1.0, 0.0, 0.0, 1.0) * coverage;
+}
@@ -0,0 +1,24 @@
+#version 450
+
+layout(location = 1) in vec3 inData;
+
+layout(location = 0) out vec2 outLocal;
+layout(location = 1) out float outRadius;
+
+layout(push_constant) uniform View {
+    vec2 center;
+    float zoom;
+} view;
+
+// One pixel in NDC; the quad is padded by it so the anti-aliased edge is
+// not clipped.
+const float PIXEL = 2.0 / 1000.0;
+
+void main() {
+    vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1) * 2.0 - 1.0;
+    float radius = inData.z * view.zoom;
+    vec2 local = corner * (radius + PIXEL);
+    outLocal = local;
+    outRadius = radius;
+    gl_Position = vec4((inData.xy - view.center) * view.zoom + local, 0.0, 1.0);
+}
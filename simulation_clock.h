@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#define DEFAULT_STEP_RATE 120
+#define DEFAULT_MAX_SUBSTEPS 8
+
+// Fixed-step accumulator. Each frame adds the elapsed wall time and hands
+// out whole steps of exactly getStepSeconds(); the remainder is kept for
+// the next frame and exposed as an interpolation factor. When a hitch
+// would need more than maxSubsteps steps the excess time is dropped, so the
+// simulation slows down instead of spiralling.
+class SimulationClock {
+private:
+  double m_stepSeconds;
+  uint32_t m_maxSubsteps;
+  double m_accumulator = 0.0;
+  uint64_t m_droppedSteps = 0;
+  std::chrono::time_point<std::chrono::steady_clock> m_lastTime;
+
+public:
+  SimulationClock(double stepRate = DEFAULT_STEP_RATE,
+                  uint32_t maxSubsteps = DEFAULT_MAX_SUBSTEPS)
+      : m_stepSeconds(1.0 / stepRate),
+        m_maxSubsteps(std::max(maxSubsteps, 1u)) {
+    m_lastTime = std::chrono::steady_clock::now();
+  };
+  float getStepSeconds() { return m_stepSeconds; };
+  uint64_t getDroppedSteps() { return m_droppedSteps; };
+  // Returns how many fixed steps to run for the time elapsed since the
+  // previous call.
+  uint32_t advance() {
+    auto currentTime = std::chrono::steady_clock::now();
+    m_accumulator +=
+        std::chrono::duration<double>(currentTime - m_lastTime).count();
+    m_lastTime = currentTime;
+    uint32_t steps = m_accumulator / m_stepSeconds;
+    if (steps > m_maxSubsteps) {
+      m_droppedSteps += steps - m_maxSubsteps;
+      steps = m_maxSubsteps;
+      m_accumulator = 0.0;
+    } else {
+      m_accumulator -= steps * m_stepSeconds;
+    }
+    return steps;
+  };
+  float getAlpha() {
+    return std::min(1.0, m_accumulator / m_stepSeconds);
+  };
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "ball_system.h"
+#include "job_scheduler.h"
+#include "profiler.h"
+#include "scene_file.h"
+#include "simulation_clock.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define SIMULATION_SNAPSHOT_COUNT 3
+
+struct SimulationSnapshot {
+  AlignedVector<float> instanceData;
+  uint32_t count = 0;
+  // Instances changed since the previous snapshot.
+  std::vector<InstanceRange> dirtyRanges;
+  uint32_t sleeping = 0;
+  uint32_t steps = 0;
+  uint64_t pairsTested = 0;
+  uint64_t pairsColliding = 0;
+  uint64_t pairIndexDistance = 0;
+};
+
+// Runs the fixed-step simulation for frame N + 1 on its own thread while
+// the render thread records and submits frame N. Frames are handed over
+// through three snapshots: the simulation thread fills the write slot and
+// swaps it with the shared slot, and acquire() swaps the shared slot with
+// the read slot, so neither side ever touches a snapshot the other is
+// using. The simulation thread starts a new frame only after the previous
+// one was acquired, which keeps it exactly one frame ahead.
+class SimulationThread {
+private:
+  BallSystem &m_balls;
+  SimulationClock &m_clock;
+  JobScheduler *m_scheduler;
+  Profiler *m_profiler;
+  uint32_t m_stepsPerFrame;
+  CheckpointWriter *m_checkpoint;
+  // Frame the next produce() simulates; the render thread is a frame
+  // behind, so the profiler's current frame would tag it one early.
+  uint64_t m_frame = 0;
+  SimulationSnapshot m_snapshots[SIMULATION_SNAPSHOT_COUNT];
+  uint32_t m_writeIndex = 0;
+  uint32_t m_sharedIndex = 1;
+  uint32_t m_readIndex = 2;
+  bool m_sharedFresh = false;
+  bool m_requested = true;
+  bool m_stop = false;
+  float m_impulseX = 0.0f;
+  float m_impulseY = 0.0f;
+  bool m_impulsePending = false;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+  void produce(SimulationSnapshot &snapshot) {
+    // A fixed step count locks the simulation to the frame count instead
+    // of wall time, which keeps unpaced headless runs reproducible.
+    uint32_t steps =
+        m_stepsPerFrame > 0 ? m_stepsPerFrame : m_clock.advance();
+    float alpha = m_stepsPerFrame > 0 ? 1.0f : m_clock.getAlpha();
+    snapshot.steps = steps;
+    snapshot.pairsTested = 0;
+    snapshot.pairsColliding = 0;
+    snapshot.pairIndexDistance = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_impulsePending) {
+        m_balls.applyImpulse(m_impulseX, m_impulseY);
+        m_impulseX = 0.0f;
+        m_impulseY = 0.0f;
+        m_impulsePending = false;
+      }
+    }
+    ProfileScope physicsScope(m_profiler, "physics", m_frame);
+    for (uint32_t step = 0; step < steps; step++) {
+      m_balls.step(m_clock.getStepSeconds(), m_scheduler);
+      BroadphaseStats broadphase = m_balls.getBroadphaseStats();
+      snapshot.pairsTested += broadphase.pairsTested;
+      snapshot.pairsColliding += broadphase.pairsColliding;
+      snapshot.pairIndexDistance += broadphase.pairIndexDistance;
+    }
+    physicsScope.end();
+    if (m_checkpoint != nullptr) {
+      m_checkpoint->update(m_balls);
+    }
+    ProfileScope interpolateScope(m_profiler, "interpolate", m_frame);
+    snapshot.count = m_balls.size();
+    snapshot.instanceData.resize(3 * size_t(snapshot.count));
+    m_balls.writeInterpolatedInstanceData(
+        alpha, snapshot.instanceData.data(), m_scheduler);
+    m_balls.takeDirtyRanges(snapshot.dirtyRanges);
+    snapshot.sleeping = m_balls.getSleepingCount();
+    m_frame++;
+  };
+  void run() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() { return m_requested || m_stop; });
+        if (m_stop) {
+          return;
+        }
+        m_requested = false;
+      }
+      produce(m_snapshots[m_writeIndex]);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(m_writeIndex, m_sharedIndex);
+        m_sharedFresh = true;
+      }
+      m_condition.notify_all();
+    }
+  };
+
+public:
+  // The simulation thread owns balls, clock and scheduler until
+  // destruction.
+  SimulationThread(BallSystem &balls, SimulationClock &clock,
+                   JobScheduler *scheduler, Profiler *profiler,
+                   uint32_t stepsPerFrame,
+                   CheckpointWriter *checkpoint = nullptr)
+      : m_balls(balls), m_clock(clock), m_scheduler(scheduler),
+        m_profiler(profiler), m_stepsPerFrame(stepsPerFrame),
+        m_checkpoint(checkpoint) {
+    m_thread = std::thread([this]() { run(); });
+  };
+  ~SimulationThread() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+  };
+  // Applied to every ball before the next frame is simulated.
+  void applyImpulse(float dvx, float dvy) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_impulseX += dvx;
+    m_impulseY += dvy;
+    m_impulsePending = true;
+  };
+  // Blocks until the next frame is ready, returns it and starts simulating
+  // the one after. The snapshot stays valid until the next acquire().
+  const SimulationSnapshot &acquire() {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [&]() { return m_sharedFresh; });
+      std::swap(m_readIndex, m_sharedIndex);
+      m_sharedFresh = false;
+      m_requested = true;
+    }
+    m_condition.notify_all();
+    return m_snapshots[m_readIndex];
+  };
+};
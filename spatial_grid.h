@@ -0,0 +1,166 @@
+#pragma once
+
+#include "job_scheduler.h"
+#include "morton_order.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Upper bound on cells per axis. The cap only kicks in for radii below
+// 1 / SPATIAL_GRID_MAX_DIM, so capped cells are still wider than a diameter.
+#define SPATIAL_GRID_MAX_DIM 2048
+// Cells are split into 3 x 3 phases by coordinate modulo 3. Two distinct
+// cells of one phase are at least three cells apart on some axis, so their
+// 3x3 neighbourhoods never overlap.
+#define SPATIAL_GRID_PHASES 9
+
+// Uniform grid over the [-1, 1] NDC domain. Cells are at least one
+// diameter of the largest ball wide, so every overlapping pair lies in
+// adjacent cells. Balls are sorted by cell with the parallel radix sort
+// into m_sortedBalls; m_cellStart[c]..m_cellStart[c + 1] is the run for
+// cell c.
+class SpatialGrid {
+private:
+  uint32_t m_dim = 0;
+  uint32_t m_keyBits = 0;
+  float m_inverseCellSize = 0.0f;
+  bool m_valid = false;
+  std::vector<uint32_t> m_ballCell;
+  std::vector<uint32_t> m_sortedCells;
+  std::vector<uint32_t> m_sortedBalls;
+  std::vector<uint32_t> m_cellStart;
+  RadixSorter m_sorter;
+  uint32_t cellCoord(float value) {
+    int32_t coord = static_cast<int32_t>((value + 1.0f) * m_inverseCellSize);
+    return std::min<uint32_t>(std::max(coord, 0), m_dim - 1);
+  };
+  template <typename Function>
+  void forEachChunk(uint32_t count, JobScheduler *scheduler,
+                    uint32_t chunkSize, Function function) {
+    auto run = [&](uint32_t begin, uint32_t end, uint32_t) {
+      for (uint32_t chunkBegin = begin; chunkBegin < end;
+           chunkBegin += chunkSize) {
+        function(chunkBegin / chunkSize, chunkBegin,
+                 std::min(chunkBegin + chunkSize, end));
+      }
+    };
+    if (scheduler != nullptr) {
+      scheduler->parallelFor(count, chunkSize, run);
+    } else {
+      run(0, count, 0);
+    }
+  };
+  // Fills m_cellStart from the sorted cells. The first ball of each cell
+  // writes the start of that cell and of the empty cells before it, so
+  // chunks write disjoint entries.
+  void indexCells(uint32_t count, JobScheduler *scheduler,
+                  uint32_t chunkSize) {
+    forEachChunk(count, scheduler, chunkSize,
+                 [&](uint32_t, uint32_t begin, uint32_t end) {
+                   for (uint32_t k = begin; k < end; k++) {
+                     uint32_t cell = m_sortedCells[k];
+                     uint32_t gap = k == 0 ? 0 : m_sortedCells[k - 1] + 1;
+                     if (gap <= cell) {
+                       std::fill(&m_cellStart[gap], &m_cellStart[cell] + 1,
+                                 k);
+                     }
+                   }
+                 });
+    uint32_t tail = count == 0 ? 0 : m_sortedCells[count - 1] + 1;
+    std::fill(&m_cellStart[tail], &m_cellStart[m_dim * m_dim] + 1, count);
+  };
+
+public:
+  void configure(float maxRadius) {
+    uint32_t dim = SPATIAL_GRID_MAX_DIM;
+    if (maxRadius > 0.0f) {
+      dim = std::min<uint32_t>(dim, std::max(1.0f, 1.0f / maxRadius));
+    }
+    if (dim != m_dim) {
+      m_dim = dim;
+      m_inverseCellSize = m_dim / 2.0f;
+      uint32_t cellCount = m_dim * m_dim;
+      m_cellStart.assign(size_t(cellCount) + 1, 0);
+      m_keyBits = 1;
+      while ((cellCount - 1) >> m_keyBits != 0) {
+        m_keyBits++;
+      }
+      m_valid = false;
+    }
+  };
+  uint32_t dim() { return m_dim; };
+  uint32_t cellOf(float x, float y) {
+    return cellCoord(y) * m_dim + cellCoord(x);
+  };
+  // Recomputes every ball's cell and, when at least one ball crossed a cell
+  // boundary since the previous build, re-sorts the balls by cell. The
+  // sort and the cell table are both built in parallel chunks. Each cell
+  // keeps its balls in ascending index order, which makes pair lists and
+  // therefore collision response deterministic.
+  // Returns whether the grid was rebuilt.
+  bool build(const float *x, const float *y, uint32_t count,
+             JobScheduler *scheduler, uint32_t chunkSize) {
+    if (m_ballCell.size() != count) {
+      m_ballCell.assign(count, 0);
+      m_valid = false;
+    }
+    m_sortedCells.resize(count);
+    m_sortedBalls.resize(count);
+    std::atomic<bool> changed{false};
+    forEachChunk(count, scheduler, chunkSize,
+                 [&](uint32_t, uint32_t begin, uint32_t end) {
+                   bool localChanged = false;
+                   for (uint32_t i = begin; i < end; i++) {
+                     uint32_t cell = cellOf(x[i], y[i]);
+                     localChanged |= cell != m_ballCell[i];
+                     m_ballCell[i] = cell;
+                   }
+                   if (localChanged) {
+                     changed.store(true, std::memory_order_relaxed);
+                   }
+                 });
+    if (m_valid && !changed.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    forEachChunk(count, scheduler, chunkSize,
+                 [&](uint32_t, uint32_t begin, uint32_t end) {
+                   for (uint32_t i = begin; i < end; i++) {
+                     m_sortedCells[i] = m_ballCell[i];
+                     m_sortedBalls[i] = i;
+                   }
+                 });
+    // Stable, so balls start in ascending index order within each cell.
+    m_sorter.sort(m_sortedCells, m_sortedBalls, scheduler, chunkSize,
+                  m_keyBits);
+    indexCells(count, scheduler, chunkSize);
+    m_valid = true;
+    return true;
+  };
+  // Calls visit(j) for every ball in the 3x3 cell neighbourhood of ball.
+  template <typename Visitor>
+  void forEachNeighbour(uint32_t ball, Visitor visit) {
+    uint32_t cell = m_ballCell[ball];
+    uint32_t cx = cell % m_dim;
+    uint32_t cy = cell / m_dim;
+    uint32_t x0 = cx > 0 ? cx - 1 : 0;
+    uint32_t x1 = std::min(cx + 1, m_dim - 1);
+    uint32_t y0 = cy > 0 ? cy - 1 : 0;
+    uint32_t y1 = std::min(cy + 1, m_dim - 1);
+    for (uint32_t gy = y0; gy <= y1; gy++) {
+      uint32_t rowStart = m_cellStart[gy * m_dim + x0];
+      uint32_t rowEnd = m_cellStart[gy * m_dim + x1 + 1];
+      for (uint32_t k = rowStart; k < rowEnd; k++) {
+        visit(m_sortedBalls[k]);
+      }
+    }
+  };
+  // Ball at sorted position k and its cell; balls of one cell are
+  // contiguous.
+  uint32_t sortedBall(uint32_t k) { return m_sortedBalls[k]; };
+  uint32_t sortedCell(uint32_t k) { return m_sortedCells[k]; };
+  // Phase of cell, see SPATIAL_GRID_PHASES.
+  uint32_t phaseOf(uint32_t cell) {
+    return (cell / m_dim) % 3 * 3 + cell % m_dim % 3;
+  };
+};
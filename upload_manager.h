@@ -0,0 +1,286 @@
+#pragma once
+
+#include "gpu_memory.h"
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define UPLOAD_ARENA_CHUNK_SIZE (4 * 1024 * 1024)
+#define UPLOAD_ARENA_ALIGNMENT 16
+#define UPLOAD_BATCH_COUNT 2
+// Staging memory a retired batch keeps for the next one; chunks past this
+// high-water mark, e.g. one sized for a start-up upload, are freed.
+#define UPLOAD_ARENA_RETAIN_BYTES UPLOAD_ARENA_CHUNK_SIZE
+
+struct UploadStats {
+  uint64_t batches;
+  uint64_t uploads;
+  uint64_t bytes;
+  // Staging memory currently allocated.
+  uint64_t arenaBytes;
+};
+
+// Collects buffer uploads into one command buffer and submits
+// them together with a fence and a semaphore, instead of a submit and a
+// waitIdle per resource. Source data is copied into a linear staging arena
+// made of persistently mapped chunks; the arena is rewound once the batch
+// that used it has completed. Batches alternate between UPLOAD_BATCH_COUNT
+// command buffers and arenas, so recording the next batch only waits for
+// the one before the last. When the device exposes a transfer-only
+// queue family the batch runs there, and destinations must be created with
+// shareBetweenQueues() so no ownership transfer is needed.
+class UploadManager {
+private:
+  struct ArenaChunk {
+    vk::Buffer buffer;
+    VmaAllocation allocation;
+    char *mapped;
+    vk::DeviceSize size;
+  };
+  struct WaitedSemaphore {
+    vk::Semaphore semaphore;
+    uint64_t frameNumber;
+  };
+  vk::Device m_device;
+  VmaAllocator m_allocator;
+  vk::Queue m_queue;
+  // Upload family first, graphics family second.
+  uint32_t m_queueFamilies[2] = {0, 0};
+  struct Batch {
+    vk::CommandBuffer commandBuffer;
+    vk::Fence fence;
+    bool inFlight = false;
+    std::vector<ArenaChunk> chunks;
+    size_t chunkIndex = 0;
+    vk::DeviceSize chunkOffset = 0;
+  };
+  vk::CommandPool m_commandPool;
+  Batch m_batches[UPLOAD_BATCH_COUNT];
+  uint32_t m_currentBatch = 0;
+  bool m_recording = false;
+  std::vector<vk::Semaphore> m_freeSemaphores;
+  std::vector<vk::Semaphore> m_pendingSemaphores;
+  std::vector<WaitedSemaphore> m_waitedSemaphores;
+  UploadStats m_stats{};
+  void addChunk(Batch &batch, vk::DeviceSize size) {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT |
+                      VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = size;
+    bufferInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
+    ArenaChunk chunk;
+    chunk.size = size;
+    VmaAllocationInfo info;
+    createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                      "upload_arena_" + std::to_string(m_currentBatch) + "_" +
+                          std::to_string(batch.chunks.size()),
+                      chunk.buffer, chunk.allocation, &info);
+    chunk.mapped = static_cast<char *>(info.pMappedData);
+    batch.chunks.push_back(chunk);
+    m_stats.arenaBytes += size;
+  };
+  // Copies data into the current batch's arena and returns the chunk and
+  // offset holding it. Oversized uploads get a chunk of their own.
+  const ArenaChunk &stage(const void *data, vk::DeviceSize size,
+                          vk::DeviceSize &offset) {
+    Batch &batch = m_batches[m_currentBatch];
+    vk::DeviceSize aligned =
+        (batch.chunkOffset + UPLOAD_ARENA_ALIGNMENT - 1) &
+        ~vk::DeviceSize(UPLOAD_ARENA_ALIGNMENT - 1);
+    while (batch.chunkIndex < batch.chunks.size() &&
+           aligned + size > batch.chunks[batch.chunkIndex].size) {
+      batch.chunkIndex++;
+      aligned = 0;
+    }
+    if (batch.chunkIndex == batch.chunks.size()) {
+      addChunk(batch,
+               std::max<vk::DeviceSize>(size, UPLOAD_ARENA_CHUNK_SIZE));
+    }
+    const ArenaChunk &chunk = batch.chunks[batch.chunkIndex];
+    memcpy(chunk.mapped + aligned, data, size);
+    offset = aligned;
+    batch.chunkOffset = aligned + size;
+    m_stats.uploads++;
+    m_stats.bytes += size;
+    return chunk;
+  };
+  // Rewinds the arena of a batch whose fence has signalled and frees its
+  // chunks past UPLOAD_ARENA_RETAIN_BYTES.
+  void finish(Batch &batch) {
+    m_device.resetFences(1, &batch.fence);
+    batch.inFlight = false;
+    batch.chunkIndex = 0;
+    batch.chunkOffset = 0;
+    vk::DeviceSize retained = 0;
+    size_t kept = 0;
+    for (const auto &chunk : batch.chunks) {
+      if (retained + chunk.size <= UPLOAD_ARENA_RETAIN_BYTES) {
+        retained += chunk.size;
+        batch.chunks[kept++] = chunk;
+      } else {
+        vmaDestroyBuffer(m_allocator, chunk.buffer, chunk.allocation);
+        m_stats.arenaBytes -= chunk.size;
+      }
+    }
+    batch.chunks.resize(kept);
+  };
+  // Blocks until batch has finished, then finishes it.
+  void retire(Batch &batch) {
+    if (!batch.inFlight) {
+      return;
+    }
+    m_device.waitForFences(1, &batch.fence, VK_TRUE, UINT64_MAX);
+    finish(batch);
+  };
+  vk::CommandBuffer &begin() {
+    Batch &batch = m_batches[m_currentBatch];
+    if (!m_recording) {
+      retire(batch);
+      batch.commandBuffer.begin(
+          {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+      m_recording = true;
+    }
+    return batch.commandBuffer;
+  };
+
+public:
+  void create(vk::Device device, VmaAllocator allocator, vk::Queue queue,
+              uint32_t queueFamily, uint32_t graphicsQueueFamily) {
+    m_device = device;
+    m_allocator = allocator;
+    m_queue = queue;
+    m_queueFamilies[0] = queueFamily;
+    m_queueFamilies[1] = graphicsQueueFamily;
+    vk::CommandPoolCreateInfo poolInfo{};
+    poolInfo.queueFamilyIndex = m_queueFamilies[0];
+    poolInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    m_commandPool = m_device.createCommandPool(poolInfo);
+    vk::CommandBufferAllocateInfo allocateInfo(
+        m_commandPool, vk::CommandBufferLevel::ePrimary, UPLOAD_BATCH_COUNT);
+    std::vector<vk::CommandBuffer> commandBuffers =
+        m_device.allocateCommandBuffers(allocateInfo);
+    for (uint32_t i = 0; i < UPLOAD_BATCH_COUNT; i++) {
+      m_batches[i].commandBuffer = commandBuffers[i];
+      m_batches[i].fence = m_device.createFence({});
+    }
+    addChunk(m_batches[0], UPLOAD_ARENA_CHUNK_SIZE);
+  };
+  void destroy() {
+    wait();
+    for (auto &batch : m_batches) {
+      for (const auto &chunk : batch.chunks) {
+        vmaDestroyBuffer(m_allocator, chunk.buffer, chunk.allocation);
+      }
+      batch.chunks.clear();
+      m_device.destroyFence(batch.fence);
+      m_device.freeCommandBuffers(m_commandPool, batch.commandBuffer);
+    }
+    for (const auto &semaphore : m_freeSemaphores) {
+      m_device.destroySemaphore(semaphore);
+    }
+    for (const auto &semaphore : m_pendingSemaphores) {
+      m_device.destroySemaphore(semaphore);
+    }
+    for (const auto &waited : m_waitedSemaphores) {
+      m_device.destroySemaphore(waited.semaphore);
+    }
+    m_device.destroyCommandPool(m_commandPool);
+  };
+  bool usesDedicatedQueue() {
+    return m_queueFamilies[0] != m_queueFamilies[1];
+  };
+  // Makes a resource written by this manager readable from the graphics
+  // queue without a queue family ownership transfer.
+  template <typename CreateInfo> void shareBetweenQueues(CreateInfo &info) {
+    if (usesDedicatedQueue()) {
+      info.sharingMode = vk::SharingMode::eConcurrent;
+      info.queueFamilyIndexCount = 2;
+      info.pQueueFamilyIndices = m_queueFamilies;
+    }
+  };
+  void uploadBuffer(vk::Buffer destination, vk::DeviceSize destinationOffset,
+                    const void *data, vk::DeviceSize size) {
+    if (size == 0) {
+      return;
+    }
+    vk::CommandBuffer &commandBuffer = begin();
+    vk::DeviceSize offset;
+    const ArenaChunk &chunk = stage(data, size, offset);
+    commandBuffer.copyBuffer(chunk.buffer, destination,
+                             vk::BufferCopy(offset, destinationOffset, size));
+  };
+  // Submits everything recorded since the last flush. The batch signals a
+  // semaphore that the next graphics submit must wait on (see
+  // takeWaitSemaphores()).
+  void flush() {
+    if (!m_recording) {
+      return;
+    }
+    Batch &batch = m_batches[m_currentBatch];
+    batch.commandBuffer.end();
+    m_recording = false;
+    vk::Semaphore semaphore;
+    if (m_freeSemaphores.empty()) {
+      semaphore = m_device.createSemaphore({});
+    } else {
+      semaphore = m_freeSemaphores.back();
+      m_freeSemaphores.pop_back();
+    }
+    vk::SubmitInfo submitInfo{};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.commandBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &semaphore;
+    m_queue.submit(submitInfo, batch.fence);
+    m_pendingSemaphores.push_back(semaphore);
+    batch.inFlight = true;
+    m_currentBatch = (m_currentBatch + 1) % UPLOAD_BATCH_COUNT;
+    m_stats.batches++;
+  };
+  // Blocks until every flushed batch has finished.
+  void wait() {
+    for (auto &batch : m_batches) {
+      retire(batch);
+    }
+  };
+  // Hands the semaphores of flushed batches to the graphics submit of
+  // frameNumber. They are reused once that frame has retired.
+  std::vector<vk::Semaphore> takeWaitSemaphores(uint64_t frameNumber) {
+    std::vector<vk::Semaphore> semaphores;
+    semaphores.swap(m_pendingSemaphores);
+    for (const auto &semaphore : semaphores) {
+      m_waitedSemaphores.push_back({semaphore, frameNumber});
+    }
+    return semaphores;
+  };
+  void recycleSemaphores(uint64_t currentFrame, uint32_t framesInFlight) {
+    auto it = m_waitedSemaphores.begin();
+    while (it != m_waitedSemaphores.end()) {
+      if (it->frameNumber + framesInFlight <= currentFrame) {
+        m_freeSemaphores.push_back(it->semaphore);
+        it = m_waitedSemaphores.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  };
+  // Finishes batches that have completed without blocking, so staging
+  // memory of a large one-off upload is released even if no further
+  // upload comes. Call once per frame.
+  void reclaim() {
+    for (auto &batch : m_batches) {
+      if (batch.inFlight &&
+          m_device.getFenceStatus(batch.fence) == vk::Result::eSuccess) {
+        finish(batch);
+      }
+    }
+  };
+  UploadStats getStats() { return m_stats; };
+};
@@ -3,6 +3,12 @@
 layout(location = 0) in vec2 inVtx;
 layout(location = 1) in vec3 inData;
 
+layout(push_constant) uniform View {
+    vec2 center;
+    float zoom;
+} view;
+
 void main() {
-    gl_Position = vec4((inData.z * inVtx)+inData.xy, 0.0, 1.0);
+    vec2 position = (inData.z * inVtx) + inData.xy;
+    gl_Position = vec4((position - view.center) * view.zoom, 0.0, 1.0);
 }
@@ -0,0 +1,3 @@
+#define VMA_IMPLEMENTATION
+#define VMA_VULKAN_VERSION 1002000
+#include <vk_mem_alloc.h>
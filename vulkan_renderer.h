@@ -0,0 +1,1926 @@
+#pragma once
+
+#define VMA_VULKAN_VERSION 1002000
+#include <vk_mem_alloc.h>
+#include <vulkan/vulkan.hpp>
+#define GLFW_INCLUDE_VULKAN
+#include "ball_system.h"
+#include "comp.h"
+#include "cull.h"
+#include "frag.h"
+#include "frame_capture.h"
+#include "frame_pacer.h"
+#include "gpu_memory.h"
+#include "instance_format.h"
+#include "pipeline_cache.h"
+#include "profiler.h"
+#include "sdf_frag.h"
+#include "sdf_vert.h"
+#include "upload_manager.h"
+#include "vert.h"
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define HEIGHT 1000
+#define WIDTH 1000
+#define DEFAULT_FRAMES_IN_FLIGHT 3
+// Triangle-fan circle: CIRCLE_SEGMENTS rim vertices followed by the centre.
+#define CIRCLE_SEGMENTS 25
+#define CIRCLE_VERTEX_COUNT (CIRCLE_SEGMENTS + 1)
+#define CIRCLE_INDEX_COUNT (CIRCLE_SEGMENTS * 3)
+// The impostor quad's four indices follow the circle's in the index buffer
+// so both modes can be drawn with drawIndexedIndirect.
+#define QUAD_FIRST_INDEX CIRCLE_INDEX_COUNT
+#define QUAD_INDEX_COUNT 4
+#define DEFAULT_CULL_MIN_PIXELS 0.5f
+// Frame start, end of upload/compute, end of render pass.
+#define GPU_TIMESTAMPS_PER_FRAME 3
+
+enum class RenderMode { eMesh, eImpostor };
+
+inline const char *renderModeName(RenderMode mode) {
+  return mode == RenderMode::eImpostor ? "sdf" : "mesh";
+}
+
+struct RendererSettings {
+  bool headless = false;
+  uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+  // Raised to framesInFlight: frames in flight must not share a target,
+  // since nothing orders one frame's writes against another's.
+  uint32_t offscreenTargetCount = DEFAULT_FRAMES_IN_FLIGHT;
+  // Initial per-frame instance capacity; the instance ring grows on demand.
+  uint32_t maxInstances = 1;
+  bool gpuPhysics = false;
+  // Layout of the uploaded instance stream. GPU physics writes its own
+  // float instances and always uses eFloat32.
+  InstanceFormat instanceFormat = InstanceFormat::eFloat32;
+  RenderMode renderMode = RenderMode::eMesh;
+  // Compact visible instances on the GPU and draw them indirectly.
+  bool gpuCulling = false;
+  // Balls whose projected radius is below this many pixels are culled.
+  float cullMinPixels = DEFAULT_CULL_MIN_PIXELS;
+  // Threads recording secondary command buffers for the draw; 0 records
+  // inline into the primary on the calling thread. GPU culling produces a
+  // single indirect draw and always records inline.
+  uint32_t recordThreads = 0;
+  // Instance batches per frame when recording in parallel; 0 means one
+  // per record thread.
+  uint32_t recordBatches = 0;
+  // Frame capture; an empty path disables it. See FrameCapture.
+  std::string capturePath;
+  CaptureFormat captureFormat = CaptureFormat::ePpm;
+  // Capture every Nth frame.
+  uint32_t captureInterval = 1;
+  uint64_t captureLimit = DEFAULT_CAPTURE_LIMIT;
+  // Let FramePacer shrink how far the CPU runs ahead below framesInFlight
+  // while the GPU stays busy; false always runs framesInFlight ahead.
+  bool adaptivePacing = true;
+  Profiler *profiler = nullptr;
+  // Serialized vk::PipelineCache; empty disables persistence.
+  std::string pipelineCachePath;
+  // Directory holding vert.spv, frag.spv and comp.spv. Shaders missing
+  // there, or an empty directory, fall back to the embedded SPIR-V.
+  std::string shaderDirectory;
+  // Run uploads on a transfer-only queue family when the device has one.
+  bool transferQueue = true;
+};
+
+struct StartupStage {
+  const char *name;
+  double milliseconds;
+};
+
+struct GpuPhysicsPushConstants {
+  float dt;
+  float gravity;
+  uint32_t count;
+};
+
+// Maps simulation space to NDC as (position - center) * zoom.
+struct ViewPushConstants {
+  float centerX;
+  float centerY;
+  float zoom;
+};
+
+struct CullPushConstants {
+  ViewPushConstants view;
+  float minRadius;
+  uint32_t count;
+  uint32_t first;
+};
+
+struct RecordThreadStats {
+  uint64_t batches;
+  double recordMilliseconds;
+};
+
+struct InstanceUploadStats {
+  uint64_t lastBytes;
+  uint32_t lastRegions;
+  uint64_t totalBytes;
+  uint64_t frames;
+};
+
+struct CullStats {
+  uint32_t visible;
+  uint32_t total;
+  uint64_t visibleSum;
+  uint64_t totalSum;
+};
+
+class VulkanRenderer {
+private:
+  uint32_t m_framesInFlight;
+  uint32_t m_currentFrame = 0;
+  bool m_headless;
+  uint32_t m_offscreenTargetCount;
+  uint32_t m_instanceCapacity;
+  uint64_t m_frameNumber = 0;
+  FramePacer m_pacer;
+  std::chrono::steady_clock::time_point m_lastFrameStart;
+  Profiler *m_profiler;
+  std::string m_pipelineCachePath;
+  std::string m_shaderDirectory;
+  PipelineCache m_pipelineCache;
+  std::vector<StartupStage> m_startupStages;
+  bool m_useTransferQueue;
+  uint32_t m_transferQueueFamily = 0;
+  vk::Queue m_transferQueue;
+  UploadManager m_uploads;
+  bool m_timestampsSupported = false;
+  float m_timestampPeriod = 1.0f;
+  uint64_t m_timestampMask = 0;
+  vk::QueryPool m_timestampQueryPool;
+  std::vector<uint64_t> m_timestampFrames;
+  std::vector<double> m_submitMicroseconds;
+  bool m_gpuClockCalibrated = false;
+  double m_gpuClockOffset = 0.0;
+  bool m_keyDown[GLFW_KEY_LAST + 1] = {};
+  bool m_gpuPhysics;
+  uint32_t m_gpuBallCount = 0;
+  float m_gpuGravity = 0.0f;
+  float m_gpuTimestep = 0.0f;
+  uint32_t m_gpuSteps = 0;
+  uint32_t m_offscreenIndex = 0;
+  GLFWwindow *m_window = nullptr;
+  vk::Instance m_instance;
+  vk::PhysicalDevice m_physicalDevice;
+  vk::Device m_device;
+  VmaAllocator m_allocator;
+  bool m_memoryBudgetExtension = false;
+  vk::Queue m_queue;
+  vk::SurfaceKHR m_surface;
+  vk::SwapchainKHR m_swapchain;
+  std::vector<vk::Image> m_swapchainImages;
+  std::vector<vk::ImageView> m_swapchainImageViews;
+  std::vector<vk::Image> m_offscreenImages;
+  std::vector<VmaAllocation> m_offscreenImageAllocations;
+  std::vector<vk::ImageView> m_offscreenImageViews;
+  vk::RenderPass m_renderPass;
+  vk::PipelineLayout m_pipelineLayout;
+  vk::Pipeline m_graphicsPipeline;
+  vk::Pipeline m_impostorPipeline;
+  RenderMode m_renderMode;
+  std::vector<vk::Framebuffer> m_framebuffers;
+  vk::CommandPool m_commandPool;
+  std::vector<vk::CommandBuffer> m_commandBuffer;
+  // Frame n signals n + 1 on m_frameTimeline; the host waits on it before
+  // reusing a frame's resources. The binary semaphores only order
+  // acquire, render and present on the swapchain.
+  vk::Semaphore m_frameTimeline;
+  std::vector<vk::Semaphore> m_imageAvailableSemaphores;
+  std::vector<vk::Semaphore> m_renderFinishedSemaphores;
+  std::vector<vk::Buffer> m_vertexBuffers;
+  std::vector<VmaAllocation> m_vertexBufferAllocations;
+  std::vector<vk::Buffer> m_indexBuffers;
+  std::vector<VmaAllocation> m_indexBufferAllocations;
+  // Instance ring: one region of m_instanceCapacity instances per frame in
+  // flight. When the ring's memory is host visible (ReBAR/UMA) instances
+  // are written into it directly; otherwise they go through a matching
+  // host ring and one copy per frame.
+  vk::Buffer m_instanceRingBuffer;
+  VmaAllocation m_instanceRingAllocation;
+  void *m_mappedInstanceRing;
+  bool m_instanceRingHostVisible;
+  vk::Buffer m_instanceStagingBuffer;
+  VmaAllocation m_instanceStagingAllocation = nullptr;
+  void *m_mappedInstanceStaging;
+  vk::DeviceSize m_instanceOffset = 0;
+  struct RetiredBuffer {
+    vk::Buffer buffer;
+    VmaAllocation allocation;
+    uint64_t frameNumber;
+  };
+  std::vector<RetiredBuffer> m_retiredBuffers;
+  vk::DescriptorSetLayout m_computeDescriptorSetLayout;
+  vk::DescriptorPool m_computeDescriptorPool;
+  vk::DescriptorSet m_computeDescriptorSet;
+  vk::PipelineLayout m_computePipelineLayout;
+  vk::Pipeline m_computePipeline;
+  vk::Buffer m_ballStateBuffer;
+  VmaAllocation m_ballStateBufferAllocation = nullptr;
+  vk::Buffer m_ballVelocityBuffer;
+  VmaAllocation m_ballVelocityBufferAllocation = nullptr;
+  ViewPushConstants m_view{0.0f, 0.0f, 1.0f};
+  // GPU culling: a compute pass appends visible instances to the frame's
+  // visible buffer and counts them in the instanceCount of its draw
+  // command. Each frame copies that count into its slot of
+  // m_visibleCountBuffer so it can be read back once the frame retires.
+  // Every frame in flight has its own buffers and descriptor set, so one
+  // frame's cull never waits for another's draw; the set is rewritten only
+  // when one of the buffers it points at is replaced.
+  struct CullSlot {
+    vk::DescriptorSet descriptorSet;
+    vk::Buffer visibleBuffer;
+    VmaAllocation visibleAllocation = nullptr;
+    uint32_t visibleCapacity = 0;
+    vk::Buffer drawCommandBuffer;
+    VmaAllocation drawCommandAllocation = nullptr;
+    // Instance buffer the descriptor set was last written with.
+    vk::Buffer boundInstances;
+    bool stale = true;
+  };
+  bool m_gpuCulling;
+  float m_cullMinPixels;
+  vk::DescriptorSetLayout m_cullDescriptorSetLayout;
+  vk::DescriptorPool m_cullDescriptorPool;
+  std::vector<CullSlot> m_cullSlots;
+  vk::PipelineLayout m_cullPipelineLayout;
+  vk::Pipeline m_cullPipeline;
+  vk::Buffer m_visibleCountBuffer;
+  VmaAllocation m_visibleCountAllocation;
+  uint32_t *m_mappedVisibleCounts;
+  std::vector<uint32_t> m_cullTotals;
+  CullStats m_cullStats{};
+  // Parallel recording: one transient pool per (frame, record thread),
+  // reset as a whole once the frame has passed on the timeline. Secondary
+  // buffers are allocated on demand and reused through m_recordUsed.
+  uint32_t m_recordThreads;
+  uint32_t m_recordBatches;
+  std::unique_ptr<JobScheduler> m_recordScheduler;
+  std::vector<vk::CommandPool> m_recordPools;
+  std::vector<std::vector<vk::CommandBuffer>> m_recordBuffers;
+  std::vector<uint32_t> m_recordUsed;
+  std::vector<RecordThreadStats> m_recordStats;
+  // Capture ring: each slot is a mapped readback buffer that is either
+  // free, waiting for the GPU (m_captureSlots[i].frame is set) or being
+  // written by m_capture. Frames with no free slot are dropped.
+  struct CaptureSlot {
+    vk::Buffer buffer;
+    VmaAllocation allocation;
+    void *mapped;
+    bool pending;
+    uint64_t frame;
+  };
+  uint32_t m_captureInterval;
+  std::unique_ptr<FrameCapture> m_capture;
+  std::vector<CaptureSlot> m_captureSlots;
+  InstanceFormat m_instanceFormat;
+  uint32_t m_instanceStride;
+  // Dirty-range uploads: each ring region is brought up to date with the
+  // ranges that changed since it was last written, i.e. the dirty ranges
+  // of the last m_framesInFlight frames.
+  struct InstanceRegion {
+    // Ranges the frame that last wrote this region reported as dirty.
+    std::vector<InstanceRange> dirty;
+    bool dirtyAll = true;
+    // Contents are unusable: the ring was regrown or the count changed.
+    bool stale = true;
+  };
+  std::vector<InstanceRegion> m_instanceRegions;
+  uint32_t m_uploadedInstanceCount = 0;
+  std::vector<InstanceRange> m_uploadRanges;
+  std::vector<vk::BufferCopy> m_copyRegions;
+  InstanceUploadStats m_instanceUploadStats{};
+  float m_vertices[2 * CIRCLE_VERTEX_COUNT];
+  uint32_t m_indices[CIRCLE_INDEX_COUNT + QUAD_INDEX_COUNT];
+  template <typename Stage>
+  void runStartupStage(const char *name, Stage stage) {
+    auto start = std::chrono::steady_clock::now();
+    stage();
+    m_startupStages.push_back(
+        {name, std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()});
+  };
+  vk::ShaderModule createShaderModule(const char *fileName,
+                                      const unsigned char *embedded,
+                                      size_t embeddedSize) {
+    vk::ShaderModuleCreateInfo createInfo{};
+    createInfo.codeSize = embeddedSize;
+    createInfo.pCode = reinterpret_cast<const uint32_t *>(embedded);
+    std::vector<char> code;
+    if (!m_shaderDirectory.empty()) {
+      code = readBinaryFile(m_shaderDirectory + "/" + fileName);
+      if (!code.empty() && code.size() % sizeof(uint32_t) == 0) {
+        createInfo.codeSize = code.size();
+        createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+      } else {
+        fprintf(stderr, "Using embedded %s: %s/%s is missing or invalid\n",
+                fileName, m_shaderDirectory.c_str(), fileName);
+      }
+    }
+    return m_device.createShaderModule(createInfo);
+  };
+  void createPipelineCache() {
+    m_pipelineCache.create(m_device, m_physicalDevice, m_pipelineCachePath);
+  };
+  void initWindow() {
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    m_window =
+        glfwCreateWindow(WIDTH, HEIGHT, "Vulkan Window", nullptr, nullptr);
+  };
+  void createInstance() {
+    vk::ApplicationInfo appInfo("VulkanApp", 1, "No Engine", 1,
+                                VK_API_VERSION_1_2);
+    std::vector<const char *> extensions;
+    if (!m_headless) {
+      uint32_t glfwExtensionCount = 0;
+      const char **glfwExtensions;
+      glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+      extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
+    extensions.push_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    std::vector<const char *> layers = {"VK_LAYER_KHRONOS_validation"};
+    vk::InstanceCreateInfo createInfo(
+        vk::InstanceCreateFlagBits::eEnumeratePortabilityKHR, &appInfo,
+        layers.size(), layers.data(), extensions.size(), extensions.data());
+    m_instance = vk::createInstance(createInfo);
+  };
+  void createPhysicalDevice() {
+    std::vector<vk::PhysicalDevice> devices =
+        m_instance.enumeratePhysicalDevices();
+    // Device types in order of preference; the first match wins.
+    for (const auto &deviceType :
+         {vk::PhysicalDeviceType::eDiscreteGpu,
+          vk::PhysicalDeviceType::eIntegratedGpu,
+          vk::PhysicalDeviceType::eVirtualGpu, vk::PhysicalDeviceType::eCpu}) {
+      for (const auto &device : devices) {
+        // Timeline semaphores and the allocator rely on core 1.2.
+        vk::PhysicalDeviceProperties properties = device.getProperties();
+        if (properties.deviceType == deviceType &&
+            properties.apiVersion >= VK_API_VERSION_1_2) {
+          m_physicalDevice = device;
+          return;
+        }
+      }
+    }
+    throw std::runtime_error("No Vulkan 1.2 device found");
+  };
+  void createLogicalDevice() {
+    float queuePriority = 1.0f;
+    std::vector<vk::DeviceQueueCreateInfo> queueCreateInfos = {
+        {{}, 0, 1, &queuePriority}};
+    if (m_useTransferQueue) {
+      std::vector<vk::QueueFamilyProperties> families =
+          m_physicalDevice.getQueueFamilyProperties();
+      for (uint32_t i = 0; i < families.size(); i++) {
+        vk::QueueFlags flags = families[i].queueFlags;
+        if ((flags & vk::QueueFlagBits::eTransfer) &&
+            !(flags & (vk::QueueFlagBits::eGraphics |
+                       vk::QueueFlagBits::eCompute))) {
+          m_transferQueueFamily = i;
+          queueCreateInfos.push_back({{}, i, 1, &queuePriority});
+          break;
+        }
+      }
+    }
+    std::vector<const char *> deviceExtensions;
+    std::vector<vk::ExtensionProperties> supportedExtensions =
+        m_physicalDevice.enumerateDeviceExtensionProperties();
+    std::vector<const char *> wantedExtensions = {
+        "VK_KHR_portability_subset", VK_EXT_MEMORY_BUDGET_EXTENSION_NAME};
+    if (!m_headless) {
+      wantedExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+    for (const auto &extension : wantedExtensions) {
+      bool found = false;
+      for (const auto &supportedExtension : supportedExtensions) {
+        if (strcmp(extension, supportedExtension.extensionName) == 0) {
+          found = true;
+          break;
+        }
+      }
+      if (found) {
+        deviceExtensions.push_back(extension);
+        if (strcmp(extension, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+          m_memoryBudgetExtension = true;
+        }
+      }
+    }
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+    vk::PhysicalDeviceFeatures2 features{};
+    features.pNext = &timelineFeatures;
+    m_physicalDevice.getFeatures2(&features);
+    if (!timelineFeatures.timelineSemaphore) {
+      throw std::runtime_error("Timeline semaphores are not supported");
+    }
+    vk::DeviceCreateInfo createInfo{};
+    createInfo.pNext = &timelineFeatures;
+    createInfo.queueCreateInfoCount = queueCreateInfos.size();
+    createInfo.pQueueCreateInfos = queueCreateInfos.data();
+    createInfo.enabledExtensionCount = deviceExtensions.size();
+    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    m_device = m_physicalDevice.createDevice(createInfo);
+    m_queue = m_device.getQueue(0, 0);
+    m_transferQueue = m_transferQueueFamily != 0
+                          ? m_device.getQueue(m_transferQueueFamily, 0)
+                          : m_queue;
+  };
+  void createAllocator() {
+    VmaAllocatorCreateInfo allocatorInfo{};
+    allocatorInfo.physicalDevice = m_physicalDevice;
+    allocatorInfo.device = m_device;
+    allocatorInfo.instance = m_instance;
+    allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_2;
+    // Without the extension VMA estimates the budget as 80% of each heap
+    // and only counts its own allocations.
+    if (m_memoryBudgetExtension) {
+      allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+    }
+    if (vmaCreateAllocator(&allocatorInfo, &m_allocator) != VK_SUCCESS) {
+      throw std::runtime_error("Failed to create allocator");
+    }
+  };
+  void createUploadManager() {
+    m_uploads.create(m_device, m_allocator, m_transferQueue,
+                     m_transferQueueFamily, 0);
+  };
+  void createSurface() {
+    VkSurfaceKHR surface;
+    if (glfwCreateWindowSurface(m_instance, m_window, nullptr, &surface) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("Failed to create window surface");
+    }
+    m_surface = surface;
+  };
+  void createSwapchain() {
+    vk::SurfaceCapabilitiesKHR surfaceCapabilities =
+        m_physicalDevice.getSurfaceCapabilitiesKHR(m_surface);
+    vk::SurfaceFormatKHR surfaceFormat = vk::Format::eB8G8R8A8Srgb;
+    vk::PresentModeKHR presentMode = vk::PresentModeKHR::eFifo;
+    vk::Extent2D extent = vk::Extent2D{WIDTH, HEIGHT};
+    vk::SwapchainCreateInfoKHR createInfo(
+        {}, m_surface, surfaceCapabilities.minImageCount, surfaceFormat.format,
+        surfaceFormat.colorSpace, extent, 1,
+        vk::ImageUsageFlagBits::eColorAttachment |
+            vk::ImageUsageFlagBits::eTransferSrc,
+        vk::SharingMode::eExclusive,
+        0, nullptr, surfaceCapabilities.currentTransform,
+        vk::CompositeAlphaFlagBitsKHR::eOpaque, presentMode, VK_TRUE);
+    m_swapchain = m_device.createSwapchainKHR(createInfo);
+  };
+  void createImageViews() {
+    m_swapchainImages = m_device.getSwapchainImagesKHR(m_swapchain);
+    for (const auto &image : m_swapchainImages) {
+      vk::ImageViewCreateInfo createInfo(
+          {}, image, vk::ImageViewType::e2D, vk::Format::eB8G8R8A8Srgb,
+          vk::ComponentMapping{},
+          vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                                    1});
+      m_swapchainImageViews.push_back(m_device.createImageView(createInfo));
+    }
+  };
+  void createOffscreenTargets() {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::ImageCreateInfo imageInfo{};
+    imageInfo.imageType = vk::ImageType::e2D;
+    imageInfo.format = vk::Format::eB8G8R8A8Srgb;
+    imageInfo.extent = vk::Extent3D{WIDTH, HEIGHT, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = vk::SampleCountFlagBits::e1;
+    imageInfo.tiling = vk::ImageTiling::eOptimal;
+    imageInfo.usage = vk::ImageUsageFlagBits::eColorAttachment |
+                      vk::ImageUsageFlagBits::eTransferSrc;
+    imageInfo.sharingMode = vk::SharingMode::eExclusive;
+    imageInfo.initialLayout = vk::ImageLayout::eUndefined;
+    m_offscreenImages.resize(m_offscreenTargetCount);
+    m_offscreenImageAllocations.resize(m_offscreenTargetCount);
+    for (uint32_t i = 0; i < m_offscreenTargetCount; i++) {
+      if (vmaCreateImage(m_allocator,
+                         reinterpret_cast<VkImageCreateInfo *>(&imageInfo),
+                         &allocInfo,
+                         reinterpret_cast<VkImage *>(&m_offscreenImages[i]),
+                         &m_offscreenImageAllocations[i],
+                         nullptr) != VK_SUCCESS) {
+        throw std::runtime_error("Failed to create offscreen target");
+      }
+      vmaSetAllocationName(m_allocator, m_offscreenImageAllocations[i],
+                           ("offscreen_target_" + std::to_string(i)).c_str());
+      vk::ImageViewCreateInfo createInfo(
+          {}, m_offscreenImages[i], vk::ImageViewType::e2D,
+          vk::Format::eB8G8R8A8Srgb, vk::ComponentMapping{},
+          vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                                    1});
+      m_offscreenImageViews.push_back(m_device.createImageView(createInfo));
+    }
+  };
+  void createRenderPass() {
+    vk::AttachmentDescription attachmentDescription{};
+    attachmentDescription.format = vk::Format::eB8G8R8A8Srgb;
+    attachmentDescription.samples = vk::SampleCountFlagBits::e1;
+    attachmentDescription.loadOp = vk::AttachmentLoadOp::eClear;
+    attachmentDescription.storeOp = vk::AttachmentStoreOp::eStore;
+    attachmentDescription.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+    attachmentDescription.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+    attachmentDescription.initialLayout = vk::ImageLayout::eUndefined;
+    attachmentDescription.finalLayout =
+        m_headless ? vk::ImageLayout::eTransferSrcOptimal
+                   : vk::ImageLayout::ePresentSrcKHR;
+    vk::AttachmentReference colorAttachmentRef(
+        0, vk::ImageLayout::eColorAttachmentOptimal);
+    vk::SubpassDescription subpassDescription(
+        {}, vk::PipelineBindPoint::eGraphics, 0, nullptr, 1,
+        &colorAttachmentRef, nullptr, nullptr, 0, nullptr);
+    vk::SubpassDependency dependency(
+        VK_SUBPASS_EXTERNAL, 0,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput, {},
+        vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::DependencyFlagBits::eByRegion);
+    vk::RenderPassCreateInfo createInfo({}, 1, &attachmentDescription, 1,
+                                        &subpassDescription, 1, &dependency);
+    m_renderPass = m_device.createRenderPass(createInfo);
+  }
+  // eMesh draws the triangle-fan circle mesh; eImpostor expands each
+  // instance into a quad from gl_VertexIndex and needs no vertex buffer.
+  vk::Pipeline buildGraphicsPipeline(RenderMode mode) {
+    bool impostor = mode == RenderMode::eImpostor;
+    vk::ShaderModule vertShaderModule =
+        impostor ? createShaderModule("sdf_vert.spv", sdf_vert_spv,
+                                      sizeof(sdf_vert_spv))
+                 : createShaderModule("vert.spv", vert_spv, sizeof(vert_spv));
+    vk::ShaderModule fragShaderModule =
+        impostor ? createShaderModule("sdf_frag.spv", sdf_frag_spv,
+                                      sizeof(sdf_frag_spv))
+                 : createShaderModule("frag.spv", frag_spv, sizeof(frag_spv));
+    vk::PipelineShaderStageCreateInfo vertShaderStageInfo(
+        {}, vk::ShaderStageFlagBits::eVertex, vertShaderModule, "main");
+    vk::PipelineShaderStageCreateInfo fragShaderStageInfo(
+        {}, vk::ShaderStageFlagBits::eFragment, fragShaderModule, "main");
+    vk::PipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
+                                                        fragShaderStageInfo};
+    vk::VertexInputBindingDescription bindingDescription[2];
+    bindingDescription[0].binding = 0;
+    bindingDescription[0].stride = sizeof(float) * 2;
+    bindingDescription[0].inputRate = vk::VertexInputRate::eVertex;
+    bindingDescription[1].binding = 1;
+    bindingDescription[1].stride = m_instanceStride;
+    bindingDescription[1].inputRate = vk::VertexInputRate::eInstance;
+    vk::VertexInputAttributeDescription attributeDescription[2];
+    attributeDescription[0].binding = 0;
+    attributeDescription[0].location = 0;
+    attributeDescription[0].format = vk::Format::eR32G32Sfloat;
+    attributeDescription[0].offset = 0;
+    attributeDescription[1].binding = 1;
+    attributeDescription[1].location = 1;
+    switch (m_instanceFormat) {
+    case InstanceFormat::eHalf:
+      attributeDescription[1].format = vk::Format::eR16G16B16A16Sfloat;
+      break;
+    case InstanceFormat::eSnorm16:
+      attributeDescription[1].format = vk::Format::eR16G16B16A16Snorm;
+      break;
+    default:
+      attributeDescription[1].format = vk::Format::eR32G32B32Sfloat;
+      break;
+    }
+    attributeDescription[1].offset = 0;
+    vk::PipelineVertexInputStateCreateInfo vertexInputInfo{};
+    uint32_t firstBinding = impostor ? 1 : 0;
+    vertexInputInfo.vertexBindingDescriptionCount = 2 - firstBinding;
+    vertexInputInfo.pVertexBindingDescriptions =
+        bindingDescription + firstBinding;
+    vertexInputInfo.vertexAttributeDescriptionCount = 2 - firstBinding;
+    vertexInputInfo.pVertexAttributeDescriptions =
+        attributeDescription + firstBinding;
+    vk::PipelineInputAssemblyStateCreateInfo inputAssemblyInfo(
+        {},
+        impostor ? vk::PrimitiveTopology::eTriangleStrip
+                 : vk::PrimitiveTopology::eTriangleList,
+        VK_FALSE);
+    vk::Viewport viewport(0.0f, 0.0f, WIDTH, HEIGHT, 0.0f, 1.0f);
+    vk::Rect2D scissor({0, 0}, {WIDTH, HEIGHT});
+    vk::PipelineViewportStateCreateInfo viewportStateInfo({}, 1, &viewport, 1,
+                                                          &scissor);
+    vk::PipelineRasterizationStateCreateInfo rasterizerInfo(
+        {}, VK_FALSE, VK_FALSE, vk::PolygonMode::eFill,
+        vk::CullModeFlagBits::eNone, vk::FrontFace::eCounterClockwise, VK_FALSE,
+        0.0f, 0.0f, 0.0f, 1.0f);
+    vk::PipelineMultisampleStateCreateInfo multisamplingInfo;
+    vk::PipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask =
+        vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+        vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+    // The impostor's anti-aliased edge is premultiplied coverage.
+    colorBlendAttachment.blendEnable = impostor;
+    colorBlendAttachment.srcColorBlendFactor = vk::BlendFactor::eOne;
+    colorBlendAttachment.dstColorBlendFactor =
+        vk::BlendFactor::eOneMinusSrcAlpha;
+    colorBlendAttachment.colorBlendOp = vk::BlendOp::eAdd;
+    colorBlendAttachment.srcAlphaBlendFactor = vk::BlendFactor::eOne;
+    colorBlendAttachment.dstAlphaBlendFactor =
+        vk::BlendFactor::eOneMinusSrcAlpha;
+    colorBlendAttachment.alphaBlendOp = vk::BlendOp::eAdd;
+    vk::PipelineColorBlendStateCreateInfo colorBlendingInfo(
+        {}, VK_FALSE, vk::LogicOp::eCopy, 1, &colorBlendAttachment);
+    vk::GraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssemblyInfo;
+    pipelineInfo.pViewportState = &viewportStateInfo;
+    pipelineInfo.pRasterizationState = &rasterizerInfo;
+    pipelineInfo.pMultisampleState = &multisamplingInfo;
+    pipelineInfo.pColorBlendState = &colorBlendingInfo;
+    pipelineInfo.layout = m_pipelineLayout;
+    pipelineInfo.renderPass = m_renderPass;
+    pipelineInfo.subpass = 0;
+    vk::Pipeline pipeline =
+        m_device.createGraphicsPipeline(m_pipelineCache.get(), pipelineInfo)
+            .value;
+    m_device.destroyShaderModule(vertShaderModule);
+    m_device.destroyShaderModule(fragShaderModule);
+    return pipeline;
+  };
+  // Both pipelines are built up front so the render mode can be switched
+  // between frames.
+  void createGraphicsPipeline() {
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eVertex, 0,
+                                            sizeof(ViewPushConstants));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo({}, 0, nullptr, 1,
+                                                    &pushConstantRange);
+    m_pipelineLayout = m_device.createPipelineLayout(pipelineLayoutInfo);
+    m_graphicsPipeline = buildGraphicsPipeline(RenderMode::eMesh);
+    m_impostorPipeline = buildGraphicsPipeline(RenderMode::eImpostor);
+  };
+  void createComputePipeline() {
+    vk::DescriptorSetLayoutBinding bindings[2] = {
+        {0, vk::DescriptorType::eStorageBuffer, 1,
+         vk::ShaderStageFlagBits::eCompute},
+        {1, vk::DescriptorType::eStorageBuffer, 1,
+         vk::ShaderStageFlagBits::eCompute}};
+    vk::DescriptorSetLayoutCreateInfo layoutInfo({}, 2, bindings);
+    m_computeDescriptorSetLayout =
+        m_device.createDescriptorSetLayout(layoutInfo);
+    vk::DescriptorPoolSize poolSize(vk::DescriptorType::eStorageBuffer, 2);
+    vk::DescriptorPoolCreateInfo poolInfo({}, 1, 1, &poolSize);
+    m_computeDescriptorPool = m_device.createDescriptorPool(poolInfo);
+    vk::DescriptorSetAllocateInfo allocateInfo(m_computeDescriptorPool, 1,
+                                               &m_computeDescriptorSetLayout);
+    m_computeDescriptorSet = m_device.allocateDescriptorSets(allocateInfo)[0];
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eCompute,
+                                            0,
+                                            sizeof(GpuPhysicsPushConstants));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo(
+        {}, 1, &m_computeDescriptorSetLayout, 1, &pushConstantRange);
+    m_computePipelineLayout =
+        m_device.createPipelineLayout(pipelineLayoutInfo);
+    vk::ShaderModule compShaderModule =
+        createShaderModule("comp.spv", comp_spv, sizeof(comp_spv));
+    vk::PipelineShaderStageCreateInfo compShaderStageInfo(
+        {}, vk::ShaderStageFlagBits::eCompute, compShaderModule, "main");
+    vk::ComputePipelineCreateInfo pipelineInfo({}, compShaderStageInfo,
+                                               m_computePipelineLayout);
+    m_computePipeline =
+        m_device.createComputePipeline(m_pipelineCache.get(), pipelineInfo)
+            .value;
+    m_device.destroyShaderModule(compShaderModule);
+  };
+  void createCullPipeline() {
+    vk::DescriptorSetLayoutBinding bindings[3] = {
+        {0, vk::DescriptorType::eStorageBuffer, 1,
+         vk::ShaderStageFlagBits::eCompute},
+        {1, vk::DescriptorType::eStorageBuffer, 1,
+         vk::ShaderStageFlagBits::eCompute},
+        {2, vk::DescriptorType::eStorageBuffer, 1,
+         vk::ShaderStageFlagBits::eCompute}};
+    vk::DescriptorSetLayoutCreateInfo layoutInfo({}, 3, bindings);
+    m_cullDescriptorSetLayout = m_device.createDescriptorSetLayout(layoutInfo);
+    vk::DescriptorPoolSize poolSize(vk::DescriptorType::eStorageBuffer,
+                                    3 * m_framesInFlight);
+    vk::DescriptorPoolCreateInfo poolInfo({}, m_framesInFlight, 1, &poolSize);
+    m_cullDescriptorPool = m_device.createDescriptorPool(poolInfo);
+    std::vector<vk::DescriptorSetLayout> layouts(m_framesInFlight,
+                                                 m_cullDescriptorSetLayout);
+    vk::DescriptorSetAllocateInfo allocateInfo(
+        m_cullDescriptorPool, m_framesInFlight, layouts.data());
+    std::vector<vk::DescriptorSet> descriptorSets =
+        m_device.allocateDescriptorSets(allocateInfo);
+    m_cullSlots.resize(m_framesInFlight);
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      m_cullSlots[i].descriptorSet = descriptorSets[i];
+    }
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eCompute,
+                                            0, sizeof(CullPushConstants));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo(
+        {}, 1, &m_cullDescriptorSetLayout, 1, &pushConstantRange);
+    m_cullPipelineLayout = m_device.createPipelineLayout(pipelineLayoutInfo);
+    vk::ShaderModule cullShaderModule =
+        createShaderModule("cull.spv", cull_spv, sizeof(cull_spv));
+    // The shader reads and copies instances as 32-bit words and decodes
+    // positions according to the instance format.
+    uint32_t instanceFormat = static_cast<uint32_t>(m_instanceFormat);
+    vk::SpecializationMapEntry formatEntry(0, 0, sizeof(instanceFormat));
+    vk::SpecializationInfo specializationInfo(1, &formatEntry,
+                                              sizeof(instanceFormat),
+                                              &instanceFormat);
+    vk::PipelineShaderStageCreateInfo cullShaderStageInfo(
+        {}, vk::ShaderStageFlagBits::eCompute, cullShaderModule, "main",
+        &specializationInfo);
+    vk::ComputePipelineCreateInfo pipelineInfo({}, cullShaderStageInfo,
+                                               m_cullPipelineLayout);
+    m_cullPipeline =
+        m_device.createComputePipeline(m_pipelineCache.get(), pipelineInfo)
+            .value;
+    m_device.destroyShaderModule(cullShaderModule);
+  };
+  void createCullBuffers() {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = sizeof(vk::DrawIndexedIndirectCommand);
+    bufferInfo.usage = vk::BufferUsageFlagBits::eIndirectBuffer |
+                       vk::BufferUsageFlagBits::eStorageBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst |
+                       vk::BufferUsageFlagBits::eTransferSrc;
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                        "indirect_draw_" + std::to_string(i),
+                        m_cullSlots[i].drawCommandBuffer,
+                        m_cullSlots[i].drawCommandAllocation);
+    }
+    VmaAllocationCreateInfo readbackAllocInfo{};
+    readbackAllocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    readbackAllocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT |
+                              VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT;
+    bufferInfo.size = sizeof(uint32_t) * m_framesInFlight;
+    bufferInfo.usage = vk::BufferUsageFlagBits::eTransferDst;
+    VmaAllocationInfo info;
+    createNamedBuffer(m_allocator, bufferInfo, readbackAllocInfo,
+                      "visible_counts", m_visibleCountBuffer,
+                      m_visibleCountAllocation, &info);
+    m_mappedVisibleCounts = static_cast<uint32_t *>(info.pMappedData);
+    m_cullTotals.assign(m_framesInFlight, 0);
+  };
+  void growVisibleBuffer(CullSlot &slot, uint32_t instanceCount) {
+    if (slot.visibleAllocation != nullptr) {
+      retireBuffer(slot.visibleBuffer, slot.visibleAllocation);
+    }
+    slot.visibleCapacity = std::max(instanceCount, slot.visibleCapacity * 2);
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = m_instanceStride * vk::DeviceSize(slot.visibleCapacity);
+    bufferInfo.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                       vk::BufferUsageFlagBits::eVertexBuffer;
+    createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                      "visible_instances_" + std::to_string(m_currentFrame),
+                      slot.visibleBuffer, slot.visibleAllocation);
+    slot.stale = true;
+  };
+  // The slot's frame has retired, so its set is not in use.
+  void writeCullDescriptorSet(CullSlot &slot, vk::Buffer instanceBuffer) {
+    vk::DescriptorBufferInfo instanceInfo(instanceBuffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo visibleInfo(slot.visibleBuffer, 0,
+                                         VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo commandInfo(slot.drawCommandBuffer, 0,
+                                         VK_WHOLE_SIZE);
+    vk::WriteDescriptorSet writes[3] = {
+        {slot.descriptorSet, 0, 0, 1, vk::DescriptorType::eStorageBuffer,
+         nullptr, &instanceInfo},
+        {slot.descriptorSet, 1, 0, 1, vk::DescriptorType::eStorageBuffer,
+         nullptr, &visibleInfo},
+        {slot.descriptorSet, 2, 0, 1, vk::DescriptorType::eStorageBuffer,
+         nullptr, &commandInfo}};
+    m_device.updateDescriptorSets(3, writes, 0, nullptr);
+    slot.boundInstances = instanceBuffer;
+    slot.stale = false;
+  };
+  // Runs after the frame timeline wait, when its count slot is final.
+  void readCullStats() {
+    if (!m_gpuCulling || m_frameNumber < m_framesInFlight) {
+      return;
+    }
+    vmaInvalidateAllocation(m_allocator, m_visibleCountAllocation,
+                            sizeof(uint32_t) * m_currentFrame,
+                            sizeof(uint32_t));
+    m_cullStats.visible = m_mappedVisibleCounts[m_currentFrame];
+    m_cullStats.total = m_cullTotals[m_currentFrame];
+    m_cullStats.visibleSum += m_cullStats.visible;
+    m_cullStats.totalSum += m_cullStats.total;
+  };
+  void cullInstances(vk::Buffer instanceBuffer, uint32_t first,
+                     uint32_t instanceCount) {
+    CullSlot &slot = m_cullSlots[m_currentFrame];
+    if (instanceCount > slot.visibleCapacity) {
+      growVisibleBuffer(slot, instanceCount);
+    }
+    if (slot.stale || slot.boundInstances != instanceBuffer) {
+      writeCullDescriptorSet(slot, instanceBuffer);
+    }
+    m_cullTotals[m_currentFrame] = instanceCount;
+    vk::CommandBuffer commandBuffer = m_commandBuffer[m_currentFrame];
+    // The slot's previous frame has passed the timeline wait, so only this
+    // frame's own writes need ordering: the command reset below and the
+    // instances written by a copy or the physics dispatch.
+    bool impostor = m_renderMode == RenderMode::eImpostor;
+    vk::DrawIndexedIndirectCommand command(
+        impostor ? QUAD_INDEX_COUNT : CIRCLE_INDEX_COUNT, 0,
+        impostor ? QUAD_FIRST_INDEX : 0, 0, 0);
+    commandBuffer.updateBuffer(slot.drawCommandBuffer, 0, sizeof(command),
+                               &command);
+    vk::MemoryBarrier beforeCull(
+        vk::AccessFlagBits::eShaderWrite | vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader |
+            vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eComputeShader, {}, beforeCull, {}, {});
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               m_cullPipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     m_cullPipelineLayout, 0,
+                                     slot.descriptorSet, {});
+    CullPushConstants pushConstants{m_view, 2.0f * m_cullMinPixels / WIDTH,
+                                    instanceCount, first};
+    commandBuffer.pushConstants(m_cullPipelineLayout,
+                                vk::ShaderStageFlagBits::eCompute, 0,
+                                sizeof(pushConstants), &pushConstants);
+    commandBuffer.dispatch((instanceCount + 63) / 64, 1, 1);
+    vk::MemoryBarrier afterCull(vk::AccessFlagBits::eShaderWrite,
+                                vk::AccessFlagBits::eIndirectCommandRead |
+                                    vk::AccessFlagBits::eVertexAttributeRead |
+                                    vk::AccessFlagBits::eTransferRead);
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eDrawIndirect |
+            vk::PipelineStageFlagBits::eVertexInput |
+            vk::PipelineStageFlagBits::eTransfer,
+        {}, afterCull, {}, {});
+  };
+  void copyVisibleCount() {
+    vk::CommandBuffer commandBuffer = m_commandBuffer[m_currentFrame];
+    commandBuffer.copyBuffer(
+        m_cullSlots[m_currentFrame].drawCommandBuffer, m_visibleCountBuffer,
+        vk::BufferCopy(offsetof(VkDrawIndexedIndirectCommand, instanceCount),
+                       sizeof(uint32_t) * m_currentFrame, sizeof(uint32_t)));
+    vk::MemoryBarrier toHost(vk::AccessFlagBits::eTransferWrite,
+                             vk::AccessFlagBits::eHostRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                  vk::PipelineStageFlagBits::eHost, {}, toHost,
+                                  {}, {});
+  };
+  void createCaptureBuffers(const RendererSettings &settings) {
+    m_captureSlots.resize(2 * m_framesInFlight);
+    m_capture = std::make_unique<FrameCapture>(
+        settings.captureFormat, settings.capturePath, WIDTH, HEIGHT, true,
+        m_captureSlots.size(), settings.captureLimit);
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT |
+                      VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = m_capture->getFrameBytes();
+    bufferInfo.usage = vk::BufferUsageFlagBits::eTransferDst;
+    for (uint32_t i = 0; i < m_captureSlots.size(); i++) {
+      CaptureSlot &slot = m_captureSlots[i];
+      VmaAllocationInfo info;
+      createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                        "capture_" + std::to_string(i), slot.buffer,
+                        slot.allocation, &info);
+      slot.mapped = info.pMappedData;
+      slot.pending = false;
+    }
+  };
+  // Hands every capture whose frame has finished to the writer; nothing
+  // blocks here.
+  void collectCaptures(bool all) {
+    uint64_t completed = m_device.getSemaphoreCounterValue(m_frameTimeline);
+    for (uint32_t i = 0; i < m_captureSlots.size(); i++) {
+      CaptureSlot &slot = m_captureSlots[i];
+      if (!slot.pending) {
+        continue;
+      }
+      if (all || slot.frame < completed) {
+        vmaInvalidateAllocation(m_allocator, slot.allocation, 0,
+                                VK_WHOLE_SIZE);
+        m_capture->submit(i, slot.mapped, slot.frame);
+        slot.pending = false;
+      }
+    }
+  };
+  // Copies the rendered target into a free capture slot after the render
+  // pass, or counts the frame as dropped when the writer is behind.
+  void recordCapture(vk::Image image) {
+    if (m_frameNumber % m_captureInterval != 0 || m_capture->isFull()) {
+      return;
+    }
+    uint32_t free = 0;
+    while (free < m_captureSlots.size() &&
+           (m_captureSlots[free].pending || m_capture->slotBusy(free))) {
+      free++;
+    }
+    if (free == m_captureSlots.size()) {
+      m_capture->noteDropped();
+      return;
+    }
+    CaptureSlot &slot = m_captureSlots[free];
+    slot.pending = true;
+    slot.frame = m_frameNumber;
+    vk::CommandBuffer commandBuffer = m_commandBuffer[m_currentFrame];
+    vk::ImageLayout finalLayout = m_headless
+                                      ? vk::ImageLayout::eTransferSrcOptimal
+                                      : vk::ImageLayout::ePresentSrcKHR;
+    vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0,
+                                    1);
+    vk::ImageMemoryBarrier toTransfer(
+        vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::AccessFlagBits::eTransferRead, finalLayout,
+        vk::ImageLayout::eTransferSrcOptimal, VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED, image, range);
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr,
+        toTransfer);
+    vk::BufferImageCopy region(0, 0, 0,
+                               {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                               {0, 0, 0}, {WIDTH, HEIGHT, 1});
+    commandBuffer.copyImageToBuffer(
+        image, vk::ImageLayout::eTransferSrcOptimal, slot.buffer, region);
+    vk::MemoryBarrier toHost(vk::AccessFlagBits::eTransferWrite,
+                             vk::AccessFlagBits::eHostRead);
+    if (m_headless) {
+      commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                    vk::PipelineStageFlagBits::eHost, {},
+                                    toHost, nullptr, nullptr);
+      return;
+    }
+    vk::ImageMemoryBarrier toPresent(
+        vk::AccessFlagBits::eTransferRead, {},
+        vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::ePresentSrcKHR,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, image, range);
+    commandBuffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eHost |
+            vk::PipelineStageFlagBits::eBottomOfPipe,
+        {}, toHost, nullptr, toPresent);
+  };
+  void createFramebuffers() {
+    for (const auto &imageView :
+         m_headless ? m_offscreenImageViews : m_swapchainImageViews) {
+      vk::FramebufferCreateInfo createInfo({}, m_renderPass, 1, &imageView,
+                                           WIDTH, HEIGHT, 1);
+      m_framebuffers.push_back(m_device.createFramebuffer(createInfo));
+    }
+  };
+  void createCommandPool() {
+    vk::CommandPoolCreateInfo createInfo{};
+    createInfo.queueFamilyIndex = 0;
+    createInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+    m_commandPool = m_device.createCommandPool(createInfo);
+  };
+  void createCommandBuffers() {
+    vk::CommandBufferAllocateInfo allocateInfo(
+        m_commandPool, vk::CommandBufferLevel::ePrimary, m_framesInFlight);
+    m_commandBuffer = m_device.allocateCommandBuffers(allocateInfo);
+  };
+  void createRecordPools() {
+    m_recordScheduler = std::make_unique<JobScheduler>(m_recordThreads);
+    vk::CommandPoolCreateInfo createInfo{};
+    createInfo.queueFamilyIndex = 0;
+    createInfo.flags = vk::CommandPoolCreateFlagBits::eTransient;
+    m_recordPools.resize(m_framesInFlight * m_recordThreads);
+    for (auto &pool : m_recordPools) {
+      pool = m_device.createCommandPool(createInfo);
+    }
+    m_recordBuffers.resize(m_recordPools.size());
+    m_recordUsed.assign(m_recordPools.size(), 0);
+    m_recordStats.assign(m_recordThreads, {0, 0.0});
+  };
+  void resetRecordPools() {
+    for (uint32_t i = 0; i < m_recordThreads; i++) {
+      uint32_t pool = m_currentFrame * m_recordThreads + i;
+      if (m_recordUsed[pool] > 0) {
+        m_device.resetCommandPool(m_recordPools[pool]);
+        m_recordUsed[pool] = 0;
+      }
+    }
+  };
+  vk::CommandBuffer nextSecondaryBuffer(uint32_t worker) {
+    uint32_t pool = m_currentFrame * m_recordThreads + worker;
+    std::vector<vk::CommandBuffer> &buffers = m_recordBuffers[pool];
+    if (m_recordUsed[pool] == buffers.size()) {
+      vk::CommandBufferAllocateInfo allocateInfo(
+          m_recordPools[pool], vk::CommandBufferLevel::eSecondary, 1);
+      buffers.push_back(m_device.allocateCommandBuffers(allocateInfo)[0]);
+    }
+    return buffers[m_recordUsed[pool]++];
+  };
+  // Binds everything the draw needs and draws instanceCount instances
+  // starting at firstInstance, or the GPU-culled set when culling.
+  void recordDraw(vk::CommandBuffer commandBuffer, vk::Buffer instanceBuffer,
+                  vk::DeviceSize instanceOffset, uint32_t firstInstance,
+                  uint32_t instanceCount) {
+    commandBuffer.pushConstants(m_pipelineLayout,
+                                vk::ShaderStageFlagBits::eVertex, 0,
+                                sizeof(m_view), &m_view);
+    if (m_renderMode == RenderMode::eImpostor) {
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
+                                 m_impostorPipeline);
+      commandBuffer.bindVertexBuffers(1, instanceBuffer, instanceOffset);
+    } else {
+      commandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
+                                 m_graphicsPipeline);
+      commandBuffer.bindVertexBuffers(
+          0, {m_vertexBuffers[m_currentFrame], instanceBuffer},
+          {0, instanceOffset});
+    }
+    commandBuffer.bindIndexBuffer(m_indexBuffers[m_currentFrame], 0,
+                                  vk::IndexType::eUint32);
+    if (m_gpuCulling) {
+      commandBuffer.drawIndexedIndirect(
+          m_cullSlots[m_currentFrame].drawCommandBuffer, 0, 1,
+          sizeof(vk::DrawIndexedIndirectCommand));
+    } else if (m_renderMode == RenderMode::eImpostor) {
+      commandBuffer.drawIndexed(QUAD_INDEX_COUNT, instanceCount,
+                                QUAD_FIRST_INDEX, 0, firstInstance);
+    } else {
+      commandBuffer.drawIndexed(CIRCLE_INDEX_COUNT, instanceCount, 0, 0,
+                                firstInstance);
+    }
+  };
+  // Splits the instances into batches, records each into a secondary
+  // buffer from the recording worker's pool and returns them in batch
+  // order so the primary executes them deterministically.
+  std::vector<vk::CommandBuffer>
+  recordBatches(uint32_t imageIndex, vk::Buffer instanceBuffer,
+                vk::DeviceSize instanceOffset, uint32_t instanceCount) {
+    uint32_t batchCount =
+        std::max(1u, std::min(m_recordBatches, instanceCount));
+    uint32_t batchSize = (instanceCount + batchCount - 1) / batchCount;
+    std::vector<vk::CommandBuffer> secondaries(batchCount);
+    std::vector<double> workerMilliseconds(m_recordThreads, 0.0);
+    std::vector<uint64_t> workerBatches(m_recordThreads, 0);
+    vk::CommandBufferInheritanceInfo inheritance(
+        m_renderPass, 0, m_framebuffers[imageIndex]);
+    vk::CommandBufferBeginInfo beginInfo(
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
+            vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+        &inheritance);
+    m_recordScheduler->parallelFor(
+        batchCount, 1, [&](uint32_t begin, uint32_t end, uint32_t worker) {
+          ProfileScope batchScope(m_profiler, "record_batch");
+          auto start = std::chrono::steady_clock::now();
+          for (uint32_t batch = begin; batch < end; batch++) {
+            uint32_t first = batch * batchSize;
+            uint32_t count =
+                first < instanceCount
+                    ? std::min(batchSize, instanceCount - first)
+                    : 0;
+            vk::CommandBuffer commandBuffer = nextSecondaryBuffer(worker);
+            commandBuffer.begin(beginInfo);
+            recordDraw(commandBuffer, instanceBuffer, instanceOffset, first,
+                       count);
+            commandBuffer.end();
+            secondaries[batch] = commandBuffer;
+            workerBatches[worker]++;
+          }
+          workerMilliseconds[worker] +=
+              std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+        });
+    for (uint32_t i = 0; i < m_recordThreads; i++) {
+      m_recordStats[i].batches += workerBatches[i];
+      m_recordStats[i].recordMilliseconds += workerMilliseconds[i];
+    }
+    return secondaries;
+  };
+  void createSyncObjects() {
+    vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+    vk::SemaphoreCreateInfo timelineCreateInfo{};
+    timelineCreateInfo.pNext = &timelineInfo;
+    m_frameTimeline = m_device.createSemaphore(timelineCreateInfo);
+    vk::SemaphoreCreateInfo semaphoreInfo{};
+    m_imageAvailableSemaphores.resize(m_framesInFlight);
+    m_renderFinishedSemaphores.resize(m_framesInFlight);
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      m_imageAvailableSemaphores[i] = m_device.createSemaphore(semaphoreInfo);
+      m_renderFinishedSemaphores[i] = m_device.createSemaphore(semaphoreInfo);
+    }
+  };
+  // Blocks until the frame timeline reaches value, i.e. frame value - 1
+  // has finished on the GPU.
+  void waitForFrame(uint64_t value) {
+    if (value == 0) {
+      return;
+    }
+    vk::SemaphoreWaitInfo waitInfo({}, 1, &m_frameTimeline, &value);
+    if (m_device.waitSemaphores(waitInfo, UINT64_MAX) !=
+        vk::Result::eSuccess) {
+      throw std::runtime_error("Failed to wait for the frame timeline");
+    }
+  };
+  void createTimestampQueries() {
+    uint32_t validBits =
+        m_physicalDevice.getQueueFamilyProperties()[0].timestampValidBits;
+    m_timestampPeriod = m_physicalDevice.getProperties().limits.timestampPeriod;
+    m_timestampsSupported = validBits > 0 && m_timestampPeriod > 0.0f;
+    if (!m_timestampsSupported) {
+      return;
+    }
+    m_timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+    vk::QueryPoolCreateInfo createInfo(
+        {}, vk::QueryType::eTimestamp,
+        GPU_TIMESTAMPS_PER_FRAME * m_framesInFlight);
+    m_timestampQueryPool = m_device.createQueryPool(createInfo);
+    m_timestampFrames.assign(m_framesInFlight, UINT64_MAX);
+    m_submitMicroseconds.assign(m_framesInFlight, 0.0);
+  };
+  // Called right after the frame timeline wait, so the slot's
+  // previous timestamps are available and reading them never stalls.
+  void readTimestamps() {
+    if (!m_timestampsSupported) {
+      return;
+    }
+    uint64_t frame = m_timestampFrames[m_currentFrame];
+    m_timestampFrames[m_currentFrame] = UINT64_MAX;
+    if (frame == UINT64_MAX || m_profiler == nullptr ||
+        !m_profiler->isEnabled()) {
+      return;
+    }
+    uint64_t ticks[GPU_TIMESTAMPS_PER_FRAME];
+    vk::Result result = m_device.getQueryPoolResults(
+        m_timestampQueryPool, GPU_TIMESTAMPS_PER_FRAME * m_currentFrame,
+        GPU_TIMESTAMPS_PER_FRAME, sizeof(ticks), ticks, sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64);
+    if (result != vk::Result::eSuccess) {
+      return;
+    }
+    double microseconds[GPU_TIMESTAMPS_PER_FRAME];
+    for (int i = 0; i < GPU_TIMESTAMPS_PER_FRAME; i++) {
+      microseconds[i] = (ticks[i] & m_timestampMask) * m_timestampPeriod / 1e3;
+    }
+    // GPU ticks have an arbitrary origin; pin the first frame's start to its
+    // CPU submit time so both timelines line up in the trace.
+    if (!m_gpuClockCalibrated) {
+      m_gpuClockOffset = m_submitMicroseconds[m_currentFrame] - microseconds[0];
+      m_gpuClockCalibrated = true;
+    }
+    m_profiler->record({"gpu_transfer", PROFILER_GPU_TRACK, frame,
+                        microseconds[0] + m_gpuClockOffset,
+                        microseconds[1] - microseconds[0]});
+    m_profiler->record({"gpu_draw", PROFILER_GPU_TRACK, frame,
+                        microseconds[1] + m_gpuClockOffset,
+                        microseconds[2] - microseconds[1]});
+  };
+  void writeTimestamp(vk::PipelineStageFlagBits stage, uint32_t index) {
+    if (m_timestampsSupported) {
+      m_commandBuffer[m_currentFrame].writeTimestamp(
+          stage, m_timestampQueryPool,
+          GPU_TIMESTAMPS_PER_FRAME * m_currentFrame + index);
+    }
+  };
+  void createVertexBuffers() {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = sizeof(m_vertices);
+    bufferInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst;
+    m_uploads.shareBetweenQueues(bufferInfo);
+    m_vertexBuffers.resize(m_framesInFlight);
+    m_vertexBufferAllocations.resize(m_framesInFlight);
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                        "circle_vertices_" + std::to_string(i),
+                        m_vertexBuffers[i], m_vertexBufferAllocations[i]);
+    }
+  };
+  void createIndexBuffers() {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = sizeof(m_indices);
+    bufferInfo.usage = vk::BufferUsageFlagBits::eIndexBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst;
+    m_uploads.shareBetweenQueues(bufferInfo);
+    m_indexBuffers.resize(m_framesInFlight);
+    m_indexBufferAllocations.resize(m_framesInFlight);
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      createNamedBuffer(m_allocator, bufferInfo, allocInfo,
+                        "circle_indices_" + std::to_string(i),
+                        m_indexBuffers[i], m_indexBufferAllocations[i]);
+    }
+  };
+  void createInstanceBuffers() {
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    allocInfo.flags =
+        VMA_ALLOCATION_CREATE_MAPPED_BIT |
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = m_instanceStride *
+                      vk::DeviceSize(m_instanceCapacity) * m_framesInFlight;
+    // Storage use lets the culling pass read the ring directly.
+    bufferInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer |
+                       vk::BufferUsageFlagBits::eStorageBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst;
+    VmaAllocationInfo info;
+    createNamedBuffer(m_allocator, bufferInfo, allocInfo, "instance_ring",
+                      m_instanceRingBuffer, m_instanceRingAllocation, &info);
+    VkMemoryPropertyFlags memoryFlags;
+    vmaGetAllocationMemoryProperties(m_allocator, m_instanceRingAllocation,
+                                     &memoryFlags);
+    m_instanceRingHostVisible =
+        (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    m_mappedInstanceRing = info.pMappedData;
+    if (m_instanceRingHostVisible) {
+      return;
+    }
+    VmaAllocationCreateInfo stagingAllocInfo{};
+    stagingAllocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    stagingAllocInfo.flags =
+        VMA_ALLOCATION_CREATE_MAPPED_BIT |
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+    bufferInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
+    createNamedBuffer(m_allocator, bufferInfo, stagingAllocInfo,
+                      "instance_staging_ring", m_instanceStagingBuffer,
+                      m_instanceStagingAllocation, &info);
+    m_mappedInstanceStaging = info.pMappedData;
+  };
+  void retireBuffer(vk::Buffer buffer, VmaAllocation allocation) {
+    m_retiredBuffers.push_back({buffer, allocation, m_frameNumber});
+  };
+  // Frames older than m_framesInFlight have passed on the frame timeline
+  // by the time the current frame's wait returns.
+  void destroyRetiredBuffers(bool all) {
+    auto it = m_retiredBuffers.begin();
+    while (it != m_retiredBuffers.end()) {
+      if (all || it->frameNumber + m_framesInFlight <= m_frameNumber) {
+        vmaDestroyBuffer(m_allocator, it->buffer, it->allocation);
+        it = m_retiredBuffers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  };
+  // Grows the ring geometrically. Buffers still referenced by frames in
+  // flight are retired rather than destroyed; nothing is copied because
+  // every frame rewrites its region.
+  void growInstanceBuffers(uint32_t instanceCount) {
+    retireBuffer(m_instanceRingBuffer, m_instanceRingAllocation);
+    if (m_instanceStagingAllocation != nullptr) {
+      retireBuffer(m_instanceStagingBuffer, m_instanceStagingAllocation);
+      m_instanceStagingAllocation = nullptr;
+    }
+    m_instanceCapacity = std::max(instanceCount, m_instanceCapacity * 2);
+    createInstanceBuffers();
+    for (auto &region : m_instanceRegions) {
+      region.stale = true;
+    }
+    // A new buffer may reuse the old handle, so compare-by-handle in
+    // cullInstances() is not enough.
+    for (auto &slot : m_cullSlots) {
+      slot.stale = true;
+    }
+  };
+  void generateVertices() {
+    for (uint32_t i = 0; i < CIRCLE_SEGMENTS; i++) {
+      m_vertices[2 * i] = std::cos(2 * M_PI * i / CIRCLE_SEGMENTS);
+      m_vertices[2 * i + 1] = std::sin(2 * M_PI * i / CIRCLE_SEGMENTS);
+    }
+    m_vertices[2 * CIRCLE_SEGMENTS] = 0.0f;
+    m_vertices[2 * CIRCLE_SEGMENTS + 1] = 0.0f;
+  };
+  void generateIndices() {
+    for (uint32_t i = 0; i < CIRCLE_SEGMENTS; i++) {
+      m_indices[3 * i] = i;
+      m_indices[3 * i + 1] = (i + 1) % CIRCLE_SEGMENTS;
+      m_indices[3 * i + 2] = CIRCLE_SEGMENTS;
+    }
+    for (uint32_t i = 0; i < QUAD_INDEX_COUNT; i++) {
+      m_indices[QUAD_FIRST_INDEX + i] = i;
+    }
+  };
+  // Queued on the upload manager; the batch is flushed at the end of the
+  // constructor and the first frame's submit waits for it.
+  void uploadMeshes() {
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      m_uploads.uploadBuffer(m_vertexBuffers[i], 0, m_vertices,
+                             sizeof(m_vertices));
+      m_uploads.uploadBuffer(m_indexBuffers[i], 0, m_indices,
+                             sizeof(m_indices));
+    }
+  };
+
+public:
+  VulkanRenderer(const RendererSettings &settings = {})
+      : m_framesInFlight(std::max(settings.framesInFlight, 1u)),
+        m_headless(settings.headless),
+        m_offscreenTargetCount(
+            std::max(settings.offscreenTargetCount, m_framesInFlight)),
+        m_instanceCapacity(std::max(settings.maxInstances, 1u)),
+        m_pacer(m_framesInFlight, settings.adaptivePacing),
+        m_profiler(settings.profiler),
+        m_pipelineCachePath(settings.pipelineCachePath),
+        m_shaderDirectory(settings.shaderDirectory),
+        m_useTransferQueue(settings.transferQueue),
+        m_gpuPhysics(settings.gpuPhysics), m_renderMode(settings.renderMode),
+        m_gpuCulling(settings.gpuCulling),
+        m_cullMinPixels(settings.cullMinPixels),
+        m_recordThreads(m_gpuCulling ? 0 : settings.recordThreads),
+        m_recordBatches(settings.recordBatches > 0 ? settings.recordBatches
+                                                   : settings.recordThreads),
+        m_captureInterval(std::max(settings.captureInterval, 1u)),
+        m_instanceFormat(settings.gpuPhysics ? InstanceFormat::eFloat32
+                                             : settings.instanceFormat),
+        m_instanceStride(instanceStride(m_instanceFormat)) {
+    if (settings.offscreenTargetCount == 0) {
+      throw std::runtime_error("Headless mode needs at least one target");
+    }
+    if (!m_headless) {
+      runStartupStage("window", [&]() { initWindow(); });
+    }
+    runStartupStage("instance", [&]() { createInstance(); });
+    runStartupStage("device", [&]() {
+      createPhysicalDevice();
+      createLogicalDevice();
+      createAllocator();
+      createUploadManager();
+    });
+    runStartupStage("targets", [&]() {
+      if (m_headless) {
+        createOffscreenTargets();
+      } else {
+        createSurface();
+        createSwapchain();
+        createImageViews();
+      }
+      createRenderPass();
+      createFramebuffers();
+    });
+    runStartupStage("pipeline_cache_load", [&]() { createPipelineCache(); });
+    runStartupStage("pipelines", [&]() {
+      createGraphicsPipeline();
+      if (m_gpuPhysics) {
+        createComputePipeline();
+      }
+      if (m_gpuCulling) {
+        createCullPipeline();
+      }
+    });
+    runStartupStage("commands", [&]() {
+      createCommandPool();
+      createCommandBuffers();
+      if (m_recordThreads > 0) {
+        createRecordPools();
+      }
+      createSyncObjects();
+      createTimestampQueries();
+    });
+    runStartupStage("buffers", [&]() {
+      createVertexBuffers();
+      createIndexBuffers();
+      createInstanceBuffers();
+      m_instanceRegions.resize(m_framesInFlight);
+      if (m_gpuCulling) {
+        createCullBuffers();
+      }
+      if (!settings.capturePath.empty()) {
+        createCaptureBuffers(settings);
+      }
+      generateVertices();
+      generateIndices();
+      uploadMeshes();
+      m_uploads.flush();
+    });
+  };
+  ~VulkanRenderer() {
+    m_device.waitIdle();
+    if (m_capture) {
+      collectCaptures(true);
+      m_capture.reset();
+      for (const auto &slot : m_captureSlots) {
+        vmaDestroyBuffer(m_allocator, slot.buffer, slot.allocation);
+      }
+    }
+    if (!m_pipelineCachePath.empty() && !m_pipelineCache.save()) {
+      fprintf(stderr, "Failed to write pipeline cache %s\n",
+              m_pipelineCachePath.c_str());
+    }
+    m_pipelineCache.destroy();
+    destroyRetiredBuffers(true);
+    vmaDestroyBuffer(m_allocator, m_instanceRingBuffer,
+                     m_instanceRingAllocation);
+    if (m_instanceStagingAllocation != nullptr) {
+      vmaDestroyBuffer(m_allocator, m_instanceStagingBuffer,
+                       m_instanceStagingAllocation);
+    }
+    if (m_gpuPhysics) {
+      if (m_ballStateBufferAllocation != nullptr) {
+        vmaDestroyBuffer(m_allocator, m_ballStateBuffer,
+                         m_ballStateBufferAllocation);
+        vmaDestroyBuffer(m_allocator, m_ballVelocityBuffer,
+                         m_ballVelocityBufferAllocation);
+      }
+      m_device.destroyPipeline(m_computePipeline);
+      m_device.destroyPipelineLayout(m_computePipelineLayout);
+      m_device.destroyDescriptorPool(m_computeDescriptorPool);
+      m_device.destroyDescriptorSetLayout(m_computeDescriptorSetLayout);
+    }
+    if (m_gpuCulling) {
+      for (const auto &slot : m_cullSlots) {
+        if (slot.visibleAllocation != nullptr) {
+          vmaDestroyBuffer(m_allocator, slot.visibleBuffer,
+                           slot.visibleAllocation);
+        }
+        vmaDestroyBuffer(m_allocator, slot.drawCommandBuffer,
+                         slot.drawCommandAllocation);
+      }
+      vmaDestroyBuffer(m_allocator, m_visibleCountBuffer,
+                       m_visibleCountAllocation);
+      m_device.destroyPipeline(m_cullPipeline);
+      m_device.destroyPipelineLayout(m_cullPipelineLayout);
+      m_device.destroyDescriptorPool(m_cullDescriptorPool);
+      m_device.destroyDescriptorSetLayout(m_cullDescriptorSetLayout);
+    }
+    for (uint32_t i = 0; i < m_framesInFlight; i++) {
+      vmaDestroyBuffer(m_allocator, m_indexBuffers[i],
+                       m_indexBufferAllocations[i]);
+      vmaDestroyBuffer(m_allocator, m_vertexBuffers[i],
+                       m_vertexBufferAllocations[i]);
+      m_device.destroySemaphore(m_imageAvailableSemaphores[i]);
+      m_device.destroySemaphore(m_renderFinishedSemaphores[i]);
+      m_device.freeCommandBuffers(m_commandPool, m_commandBuffer[i]);
+    }
+    m_device.destroySemaphore(m_frameTimeline);
+    m_device.destroyCommandPool(m_commandPool);
+    for (const auto &pool : m_recordPools) {
+      m_device.destroyCommandPool(pool);
+    }
+    if (m_timestampsSupported) {
+      m_device.destroyQueryPool(m_timestampQueryPool);
+    }
+    for (const auto &framebuffer : m_framebuffers) {
+      m_device.destroyFramebuffer(framebuffer);
+    }
+    m_device.destroyPipeline(m_graphicsPipeline);
+    m_device.destroyPipeline(m_impostorPipeline);
+    m_device.destroyPipelineLayout(m_pipelineLayout);
+    m_device.destroyRenderPass(m_renderPass);
+    for (uint32_t i = 0; i < m_offscreenImages.size(); i++) {
+      m_device.destroyImageView(m_offscreenImageViews[i]);
+      vmaDestroyImage(m_allocator, m_offscreenImages[i],
+                      m_offscreenImageAllocations[i]);
+    }
+    for (const auto &imageView : m_swapchainImageViews) {
+      m_device.destroyImageView(imageView);
+    }
+    if (!m_headless) {
+      m_device.destroySwapchainKHR(m_swapchain);
+      m_instance.destroySurfaceKHR(m_surface);
+    }
+    m_uploads.destroy();
+    vmaDestroyAllocator(m_allocator);
+    m_device.destroy();
+    m_instance.destroy();
+    if (!m_headless) {
+      glfwDestroyWindow(m_window);
+      glfwTerminate();
+    }
+  };
+  bool isHeadless() { return m_headless; };
+  const std::vector<StartupStage> &getStartupStages() {
+    return m_startupStages;
+  };
+  bool pipelineCacheHit() { return m_pipelineCache.wasLoaded(); };
+  RenderMode getRenderMode() { return m_renderMode; };
+  bool usesGpuCulling() { return m_gpuCulling; };
+  CullStats getCullStats() { return m_cullStats; };
+  FramePacingStats getFramePacing() { return m_pacer.getStats(); };
+  uint32_t getRecordThreads() { return m_recordThreads; };
+  bool isCapturing() { return m_capture != nullptr; };
+  // Waits for the GPU and the writer so every captured frame is on disk.
+  void finishCapture() {
+    if (m_capture) {
+      m_device.waitIdle();
+      collectCaptures(true);
+      m_capture->drain();
+    }
+  };
+  InstanceFormat getInstanceFormat() { return m_instanceFormat; };
+  // Mean size of the CPU-written instance stream per frame.
+  double getInstanceBytesPerFrame() {
+    return m_instanceUploadStats.frames > 0
+               ? double(m_instanceUploadStats.totalBytes) /
+                     m_instanceUploadStats.frames
+               : 0.0;
+  };
+  InstanceUploadStats getInstanceUploadStats() {
+    return m_instanceUploadStats;
+  };
+  bool hasMemoryBudget() { return m_memoryBudgetExtension; };
+  MemoryTelemetry getMemoryTelemetry() {
+    return queryMemoryTelemetry(m_allocator, m_memoryBudgetExtension);
+  };
+  bool writeMemoryStats(const std::string &path) {
+    return writeMemoryStatsJson(m_allocator, path);
+  };
+  CaptureStats getCaptureStats() {
+    return m_capture ? m_capture->getStats() : CaptureStats{};
+  };
+  const std::vector<RecordThreadStats> &getRecordStats() {
+    return m_recordStats;
+  };
+  float getZoom() { return m_view.zoom; };
+  void setView(float centerX, float centerY, float zoom) {
+    m_view = {centerX, centerY, zoom};
+  };
+  void setRenderMode(RenderMode mode) { m_renderMode = mode; };
+  bool usesTransferQueue() { return m_uploads.usesDedicatedQueue(); };
+  UploadStats getUploadStats() { return m_uploads.getStats(); };
+  uint32_t getFramesInFlight() { return m_framesInFlight; };
+  void waitIdle() { m_device.waitIdle(); };
+  bool shouldQuit() {
+    return !m_headless && glfwWindowShouldClose(m_window);
+  };
+  void pollEvents() {
+    if (!m_headless) {
+      glfwPollEvents();
+    }
+  };
+  // True once per press of key; always false without a window.
+  bool keyPressed(int key) {
+    if (m_headless) {
+      return false;
+    }
+    bool down = glfwGetKey(m_window, key) == GLFW_PRESS;
+    bool pressed = down && !m_keyDown[key];
+    m_keyDown[key] = down;
+    return pressed;
+  };
+  bool usesGpuPhysics() { return m_gpuPhysics; };
+  bool instanceRingHostVisible() { return m_instanceRingHostVisible; };
+  // Moves the ball state into device-local storage buffers. From then on
+  // drawFrame() integrates it with a compute dispatch and draws straight
+  // from the same buffer, ignoring the instance data passed to it.
+  void initGpuPhysics(const BallArrays &balls, uint32_t count, float gravity) {
+    if (!m_gpuPhysics) {
+      throw std::runtime_error("Renderer was created without GPU physics");
+    }
+    m_gpuBallCount = count;
+    m_gpuGravity = gravity;
+    std::vector<float> velocities(2 * size_t(count));
+    for (uint32_t i = 0; i < count; i++) {
+      velocities[2 * i] = balls.vx[i];
+      velocities[2 * i + 1] = balls.vy[i];
+    }
+    VmaAllocationCreateInfo allocInfo{};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    vk::BufferCreateInfo bufferInfo{};
+    bufferInfo.size = sizeof(float) * 3 * count;
+    bufferInfo.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                       vk::BufferUsageFlagBits::eVertexBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst;
+    m_uploads.shareBetweenQueues(bufferInfo);
+    createNamedBuffer(m_allocator, bufferInfo, allocInfo, "ball_state",
+                      m_ballStateBuffer, m_ballStateBufferAllocation);
+    bufferInfo.size = sizeof(float) * 2 * count;
+    bufferInfo.usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                       vk::BufferUsageFlagBits::eTransferDst;
+    createNamedBuffer(m_allocator, bufferInfo, allocInfo, "ball_velocity",
+                      m_ballVelocityBuffer, m_ballVelocityBufferAllocation);
+    m_uploads.uploadBuffer(m_ballStateBuffer, 0, balls.instanceData,
+                           sizeof(float) * 3 * count);
+    m_uploads.uploadBuffer(m_ballVelocityBuffer, 0, velocities.data(),
+                           sizeof(float) * 2 * count);
+    m_uploads.flush();
+    vk::DescriptorBufferInfo stateInfo(m_ballStateBuffer, 0, VK_WHOLE_SIZE);
+    vk::DescriptorBufferInfo velocityInfo(m_ballVelocityBuffer, 0,
+                                          VK_WHOLE_SIZE);
+    vk::WriteDescriptorSet writes[2] = {
+        {m_computeDescriptorSet, 0, 0, 1, vk::DescriptorType::eStorageBuffer,
+         nullptr, &stateInfo},
+        {m_computeDescriptorSet, 1, 0, 1, vk::DescriptorType::eStorageBuffer,
+         nullptr, &velocityInfo}};
+    m_device.updateDescriptorSets(2, writes, 0, nullptr);
+  };
+  // Sets the fixed steps the next frame's compute pass integrates.
+  void setGpuPhysicsSteps(float dt, uint32_t steps) {
+    m_gpuTimestep = dt;
+    m_gpuSteps = steps;
+  };
+  void dispatchGpuPhysics() {
+    if (m_gpuSteps == 0) {
+      return;
+    }
+    vk::CommandBuffer commandBuffer = m_commandBuffer[m_currentFrame];
+    commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                               m_computePipeline);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                     m_computePipelineLayout, 0,
+                                     m_computeDescriptorSet, {});
+    GpuPhysicsPushConstants pushConstants{m_gpuTimestep, m_gpuGravity,
+                                          m_gpuBallCount};
+    commandBuffer.pushConstants(m_computePipelineLayout,
+                                vk::ShaderStageFlagBits::eCompute, 0,
+                                sizeof(pushConstants), &pushConstants);
+    for (uint32_t step = 0; step < m_gpuSteps; step++) {
+      // Each dispatch reads what the previous one wrote, and the first
+      // must also wait for the previous frame's draw to stop reading.
+      vk::MemoryBarrier beforeDispatch(vk::AccessFlagBits::eShaderWrite,
+                                       vk::AccessFlagBits::eShaderRead |
+                                           vk::AccessFlagBits::eShaderWrite);
+      commandBuffer.pipelineBarrier(
+          vk::PipelineStageFlagBits::eComputeShader |
+              vk::PipelineStageFlagBits::eVertexInput,
+          vk::PipelineStageFlagBits::eComputeShader, {}, beforeDispatch, {},
+          {});
+      commandBuffer.dispatch((m_gpuBallCount + 63) / 64, 1, 1);
+    }
+    vk::MemoryBarrier afterDispatch(vk::AccessFlagBits::eShaderWrite,
+                                    vk::AccessFlagBits::eVertexAttributeRead);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                  vk::PipelineStageFlagBits::eVertexInput, {},
+                                  afterDispatch, {}, {});
+  };
+  // Packed formats are converted straight into the mapped ring, so the
+  // narrower stream is the only copy made.
+  // region points at instance 0 of the frame's region.
+  void writeInstances(char *region, const float *data, uint32_t begin,
+                      uint32_t end) {
+    if (m_instanceFormat == InstanceFormat::eFloat32) {
+      memcpy(region + sizeof(float) * 3 * size_t(begin),
+             data + 3 * size_t(begin), sizeof(float) * 3 * size_t(end - begin));
+    } else {
+      packInstances(m_instanceFormat, data, region, begin, end);
+    }
+  };
+  // Fills m_uploadRanges with what the current region is missing. Falls
+  // back to one full range when most of the stream is dirty anyway.
+  void collectUploadRanges(uint32_t instanceCount) {
+    bool all = m_instanceRegions[m_currentFrame].stale;
+    m_uploadRanges.clear();
+    for (const auto &region : m_instanceRegions) {
+      all = all || region.dirtyAll;
+      if (!all) {
+        m_uploadRanges.insert(m_uploadRanges.end(), region.dirty.begin(),
+                              region.dirty.end());
+      }
+    }
+    if (!all) {
+      coalesceRanges(m_uploadRanges, DIRTY_RANGE_MERGE_GAP);
+      uint64_t covered = 0;
+      for (const auto &range : m_uploadRanges) {
+        covered += range.count;
+      }
+      all = 4 * covered > 3 * uint64_t(instanceCount);
+    }
+    if (all) {
+      m_uploadRanges.assign(1, {0, instanceCount});
+    }
+  };
+  // dirtyRanges lists the instances that changed since the previous frame;
+  // nullptr means all of them.
+  void uploadInstanceData(const float *data, uint32_t instanceCount,
+                          const std::vector<InstanceRange> *dirtyRanges) {
+    if (instanceCount > m_instanceCapacity) {
+      growInstanceBuffers(instanceCount);
+    }
+    if (instanceCount != m_uploadedInstanceCount) {
+      for (auto &region : m_instanceRegions) {
+        region.stale = true;
+      }
+      m_uploadedInstanceCount = instanceCount;
+    }
+    m_instanceOffset = m_instanceStride * vk::DeviceSize(m_instanceCapacity) *
+                       m_currentFrame;
+    InstanceRegion &current = m_instanceRegions[m_currentFrame];
+    current.dirtyAll = dirtyRanges == nullptr;
+    if (dirtyRanges != nullptr) {
+      current.dirty = *dirtyRanges;
+    }
+    collectUploadRanges(instanceCount);
+    current.stale = false;
+    char *region = static_cast<char *>(m_instanceRingHostVisible
+                                           ? m_mappedInstanceRing
+                                           : m_mappedInstanceStaging) +
+                   m_instanceOffset;
+    m_copyRegions.clear();
+    vk::DeviceSize bytes = 0;
+    for (const auto &range : m_uploadRanges) {
+      if (range.count == 0) {
+        continue;
+      }
+      writeInstances(region, data, range.first, range.first + range.count);
+      vk::DeviceSize offset =
+          m_instanceOffset + vk::DeviceSize(m_instanceStride) * range.first;
+      vk::DeviceSize size = vk::DeviceSize(m_instanceStride) * range.count;
+      m_copyRegions.emplace_back(offset, offset, size);
+      bytes += size;
+    }
+    m_instanceUploadStats.lastBytes = bytes;
+    m_instanceUploadStats.lastRegions = m_copyRegions.size();
+    m_instanceUploadStats.totalBytes += bytes;
+    m_instanceUploadStats.frames++;
+    if (m_copyRegions.empty()) {
+      return;
+    }
+    // One flush and one barrier over the span covering every range.
+    vk::DeviceSize spanOffset = m_copyRegions.front().srcOffset;
+    vk::DeviceSize size = m_copyRegions.back().srcOffset +
+                          m_copyRegions.back().size - spanOffset;
+    if (m_instanceRingHostVisible) {
+      vmaFlushAllocation(m_allocator, m_instanceRingAllocation, spanOffset,
+                         size);
+      return;
+    }
+    vmaFlushAllocation(m_allocator, m_instanceStagingAllocation, spanOffset,
+                       size);
+    m_commandBuffer[m_currentFrame].copyBuffer(
+        m_instanceStagingBuffer, m_instanceRingBuffer, m_copyRegions);
+    vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite,
+                              vk::AccessFlagBits::eVertexAttributeRead);
+    vk::BufferMemoryBarrier bufferBarrier(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eVertexAttributeRead, VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED, m_instanceRingBuffer, spanOffset, size);
+    m_commandBuffer[m_currentFrame].pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eVertexInput, {}, barrier, bufferBarrier,
+        {});
+  }
+  // dirtyRanges, when given, lists the instances that changed since the
+  // previous call; only those are uploaded.
+  void drawFrame(const float *instanceData, uint32_t instanceCount = 1,
+                 const std::vector<InstanceRange> *dirtyRanges = nullptr) {
+    // The pacer's depth never exceeds m_framesInFlight, so the wait also
+    // retires the frame that last used m_currentFrame's resources.
+    auto frameStart = std::chrono::steady_clock::now();
+    ProfileScope waitScope(m_profiler, "frame_wait");
+    waitForFrame(m_pacer.waitValue(m_frameNumber));
+    waitScope.end();
+    double waitMicroseconds = std::chrono::duration<double, std::micro>(
+                                  std::chrono::steady_clock::now() - frameStart)
+                                  .count();
+    double frameMicroseconds =
+        m_frameNumber > 0 ? std::chrono::duration<double, std::micro>(
+                                frameStart - m_lastFrameStart)
+                                .count()
+                          : 0.0;
+    m_lastFrameStart = frameStart;
+    // With every submitted frame finished the queue is empty until this
+    // frame is submitted: the GPU starves while it is recorded.
+    uint64_t completed = m_device.getSemaphoreCounterValue(m_frameTimeline);
+    m_pacer.record(m_frameNumber > 0 && completed >= m_frameNumber,
+                   waitMicroseconds, frameMicroseconds);
+    if (m_capture) {
+      collectCaptures(false);
+    }
+    readTimestamps();
+    readCullStats();
+    resetRecordPools();
+    destroyRetiredBuffers(false);
+    m_uploads.recycleSemaphores(m_frameNumber, m_framesInFlight);
+    m_uploads.reclaim();
+    ProfileScope acquireScope(m_profiler, "acquire");
+    uint32_t imageIndex;
+    if (m_headless) {
+      imageIndex = m_offscreenIndex;
+      m_offscreenIndex = (m_offscreenIndex + 1) % m_offscreenTargetCount;
+    } else {
+      imageIndex =
+          m_device
+              .acquireNextImageKHR(m_swapchain, UINT64_MAX,
+                                   m_imageAvailableSemaphores[m_currentFrame])
+              .value;
+    }
+    acquireScope.end();
+    ProfileScope uploadScope(m_profiler, "upload");
+    m_commandBuffer[m_currentFrame].begin(
+        {vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    if (m_timestampsSupported) {
+      m_commandBuffer[m_currentFrame].resetQueryPool(
+          m_timestampQueryPool, GPU_TIMESTAMPS_PER_FRAME * m_currentFrame,
+          GPU_TIMESTAMPS_PER_FRAME);
+    }
+    writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, 0);
+    vk::Buffer instanceBuffer;
+    vk::DeviceSize instanceOffset = 0;
+    if (m_gpuPhysics) {
+      dispatchGpuPhysics();
+      instanceBuffer = m_ballStateBuffer;
+      instanceCount = m_gpuBallCount;
+    } else {
+      uploadInstanceData(instanceData, instanceCount, dirtyRanges);
+      instanceBuffer = m_instanceRingBuffer;
+      instanceOffset = m_instanceOffset;
+    }
+    if (m_gpuCulling) {
+      cullInstances(instanceBuffer, instanceOffset / m_instanceStride,
+                    instanceCount);
+      instanceBuffer = m_cullSlots[m_currentFrame].visibleBuffer;
+      instanceOffset = 0;
+    }
+    writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, 1);
+    uploadScope.end();
+    ProfileScope recordScope(m_profiler, "record");
+    vk::ClearValue clearValue{};
+    clearValue.color = {0.0f, 0.0f, 0.0f, 1.0f};
+    vk::RenderPassBeginInfo renderPassBeginInfo{};
+    renderPassBeginInfo.clearValueCount = 1;
+    renderPassBeginInfo.pClearValues = &clearValue;
+    renderPassBeginInfo.framebuffer = m_framebuffers[imageIndex];
+    renderPassBeginInfo.renderArea = vk::Rect2D{{0, 0}, {WIDTH, HEIGHT}};
+    renderPassBeginInfo.renderPass = m_renderPass;
+    if (m_recordThreads > 0) {
+      std::vector<vk::CommandBuffer> secondaries = recordBatches(
+          imageIndex, instanceBuffer, instanceOffset, instanceCount);
+      m_commandBuffer[m_currentFrame].beginRenderPass(
+          renderPassBeginInfo, vk::SubpassContents::eSecondaryCommandBuffers);
+      m_commandBuffer[m_currentFrame].executeCommands(secondaries);
+    } else {
+      m_commandBuffer[m_currentFrame].beginRenderPass(
+          renderPassBeginInfo, vk::SubpassContents::eInline);
+      recordDraw(m_commandBuffer[m_currentFrame], instanceBuffer,
+                 instanceOffset, 0, instanceCount);
+    }
+    m_commandBuffer[m_currentFrame].endRenderPass();
+    if (m_gpuCulling) {
+      copyVisibleCount();
+    }
+    if (m_capture) {
+      recordCapture(m_headless ? m_offscreenImages[imageIndex]
+                               : m_swapchainImages[imageIndex]);
+    }
+    writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, 2);
+    m_commandBuffer[m_currentFrame].end();
+    recordScope.end();
+    ProfileScope submitScope(m_profiler, "submit");
+    if (m_profiler != nullptr && m_timestampsSupported) {
+      m_timestampFrames[m_currentFrame] = m_frameNumber;
+      m_submitMicroseconds[m_currentFrame] = m_profiler->nowMicroseconds();
+    }
+    // Pending upload batches are waited on at every stage; they only occur
+    // at startup or when resources are (re)loaded.
+    std::vector<vk::Semaphore> waitSemaphores =
+        m_uploads.takeWaitSemaphores(m_frameNumber);
+    std::vector<vk::PipelineStageFlags> waitStages(
+        waitSemaphores.size(), vk::PipelineStageFlagBits::eAllCommands);
+    if (!m_headless) {
+      waitSemaphores.push_back(m_imageAvailableSemaphores[m_currentFrame]);
+      waitStages.push_back(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+    }
+    // The binary render-finished semaphore ignores its value.
+    vk::Semaphore signalSemaphores[] = {
+        m_frameTimeline, m_renderFinishedSemaphores[m_currentFrame]};
+    uint64_t signalValues[] = {m_frameNumber + 1, 0};
+    uint32_t signalCount = m_headless ? 1 : 2;
+    vk::TimelineSemaphoreSubmitInfo timelineInfo{};
+    timelineInfo.signalSemaphoreValueCount = signalCount;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
+    vk::SubmitInfo submitInfo{};
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &m_commandBuffer[m_currentFrame];
+    submitInfo.waitSemaphoreCount = waitSemaphores.size();
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
+    submitInfo.signalSemaphoreCount = signalCount;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+    m_queue.submit(submitInfo);
+    if (m_headless) {
+      m_currentFrame = (m_currentFrame + 1) % m_framesInFlight;
+      m_frameNumber++;
+      return;
+    }
+    submitScope.end();
+    ProfileScope presentScope(m_profiler, "present");
+    vk::PresentInfoKHR presentInfo{};
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = &m_renderFinishedSemaphores[m_currentFrame];
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = &m_swapchain;
+    presentInfo.pImageIndices = &imageIndex;
+    presentInfo.pResults = nullptr;
+    m_queue.presentKHR(presentInfo);
+    m_currentFrame = (m_currentFrame + 1) % m_framesInFlight;
+    m_frameNumber++;
+  };
+};